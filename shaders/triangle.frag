@@ -1,9 +1,9 @@
 #version 450
 #extension GL_ARB_separate_shader_objects : enable
 
-layout(location = 0) in vec3 inColor;
+layout(location = 0) in vec4 inColor;
 layout(location = 0) out vec4 outColor;
 
 void main() {
-  outColor = vec4(inColor, 1.0);
+  outColor = inColor;
 }
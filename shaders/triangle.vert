@@ -1,20 +1,41 @@
 #version 450
 
-vec2 positions[3] =
-  vec2[]
-  (vec2(-0.5, 0),
-   vec2(0, -0.5),
-   vec2(0.5, 0));
+// Per vertex
+layout(location = 0) in vec2 inPosition;
+layout(location = 1) in vec4 inColor;
 
-vec3 colors[3] =
-  vec3[]
-  (vec3(1, 0, 0),
-   vec3(0, 1, 0),
-   vec3(0, 0, 1));
+// Per instance
+layout(location = 2) in vec2 inOffset;
+layout(location = 3) in float inScale;
+layout(location = 4) in float inDepth;
+layout(location = 5) in vec4 inInstanceColor;
 
-layout(location = 0) out vec3 fragColor;
+layout(location = 0) out vec4 fragColor;
+
+// The depth pre-pass and the colour pass draw with this shader in different
+// pipelines, and the colour pass only keeps fragments whose depth matches
+// the pre-pass's, so both have to compute exactly the same positions.
+invariant gl_Position;
+
+// Matches ColorMode in shaders.h.
+layout(constant_id = 0) const uint COLOR_MODE = 0;
+
+// Matches View in scene.h.
+layout(push_constant) uniform View {
+  vec2 center;
+  float zoom;
+} view;
 
 void main() {
-  gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-  fragColor = colors[gl_VertexIndex];
+  gl_Position = vec4((inOffset + inPosition * inScale - view.center) * view.zoom, inDepth, 1.0);
+
+  if (1 == COLOR_MODE) {
+    fragColor = inColor;
+  } else if (2 == COLOR_MODE) {
+    fragColor = inInstanceColor;
+  } else if (3 == COLOR_MODE) {
+    fragColor = vec4(vec3(inDepth), 1.0);
+  } else {
+    fragColor = inColor * inInstanceColor;
+  }
 }
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <stdexcept>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+inline vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// First-fit allocation of ranges within [0, size), merging neighbouring free
+// ranges when they're released.
+class FreeList {
+private:
+  // Free ranges, offset to size.
+  std::map<vk::DeviceSize, vk::DeviceSize> ranges;
+  vk::DeviceSize capacity;
+
+public:
+  FreeList() : capacity(0) {}
+
+  explicit FreeList(vk::DeviceSize size) : capacity(size) {
+    this->ranges[0] = size;
+  }
+
+  // Returns false if there's no free range big enough.
+  bool allocate(vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize &offset) {
+    for (auto it = this->ranges.begin(); it != this->ranges.end(); ++it) {
+      vk::DeviceSize start = it->first;
+      vk::DeviceSize end = it->first + it->second;
+      vk::DeviceSize aligned = alignUp(start, alignment);
+      if (aligned + size > end)
+        continue;
+
+      this->ranges.erase(it);
+      if (aligned > start)
+        this->ranges[start] = aligned - start;
+      if (aligned + size < end)
+        this->ranges[aligned + size] = end - (aligned + size);
+
+      offset = aligned;
+      return true;
+    }
+    return false;
+  }
+
+  void release(vk::DeviceSize offset, vk::DeviceSize size) {
+    auto next = this->ranges.lower_bound(offset);
+    assert(next == this->ranges.end() || next->first >= offset + size);
+
+    if (next != this->ranges.end() && next->first == offset + size) {
+      size += next->second;
+      next = this->ranges.erase(next);
+    }
+
+    if (next != this->ranges.begin()) {
+      auto prev = std::prev(next);
+      assert(prev->first + prev->second <= offset);
+      if (prev->first + prev->second == offset) {
+        prev->second += size;
+        return;
+      }
+    }
+
+    this->ranges[offset] = size;
+  }
+
+  vk::DeviceSize freeBytes() const {
+    vk::DeviceSize total = 0;
+    for (auto &r : this->ranges)
+      total += r.second;
+    return total;
+  }
+
+  vk::DeviceSize largestFreeRange() const {
+    vk::DeviceSize largest = 0;
+    for (auto &r : this->ranges)
+      largest = std::max(largest, r.second);
+    return largest;
+  }
+
+  size_t freeRangeCount() const {
+    return this->ranges.size();
+  }
+
+  bool empty() const {
+    return 1 == this->ranges.size() && this->ranges.begin()->second == this->capacity;
+  }
+};
+
+// A piece of a device memory block. mapped is null unless the memory is
+// host visible, in which case it stays mapped for the block's lifetime.
+struct Allocation {
+  vk::DeviceMemory memory;
+  vk::DeviceSize offset;
+  vk::DeviceSize size;
+  void *mapped;
+  uint32_t memoryType;
+  uint32_t block;
+
+  Allocation() :
+    memory(),
+    offset(0),
+    size(0),
+    mapped(nullptr),
+    memoryType(0),
+    block(0) {}
+};
+
+struct AllocatorStats {
+  uint64_t blockCount;
+  uint64_t blockBytes;
+  uint64_t usedBytes;
+  uint64_t allocationCount;
+  uint64_t largestFreeRange;
+
+  // 0 when all the free space in each block is in one range, approaching 1
+  // as it's split into many small ones.
+  double fragmentation;
+};
+
+// Sub-allocates resources from large per-memory-type blocks, so that the
+// number of vkAllocateMemory calls stays far below maxMemoryAllocationCount.
+//
+// Buffers and linear images may share a bufferImageGranularity-sized page;
+// optimal-tiling images may not share one with them. Rather than track what
+// is next to what, optimal allocations are given whole pages: their offset
+// and size are rounded to the granularity.
+//
+// Data that only lives for a frame doesn't come from here but from the
+// UploadRing (upload_ring.h), which hands out its buffer front to back and
+// takes it back a frame at a time, once that frame's fence has signalled.
+class Allocator {
+private:
+  struct Block {
+    vk::DeviceMemory memory;
+    vk::DeviceSize size;
+    void *mapped;
+    FreeList freeList;
+    uint32_t allocations;
+    bool dedicated;
+  };
+
+  vk::Device device;
+  vk::PhysicalDeviceMemoryProperties memoryProperties;
+  vk::DeviceSize granularity;
+  vk::DeviceSize nonCoherentAtomSize;
+  vk::DeviceSize defaultBlockSize;
+
+  // Indexed by memory type. A block that's freed once it's empty leaves a
+  // null entry, so that the indices in outstanding Allocations stay valid.
+  std::vector<std::vector<Block>> blocks;
+
+  vk::DeviceSize blockSizeFor(uint32_t memoryType) const {
+    uint32_t heap = this->memoryProperties.memoryTypes[memoryType].heapIndex;
+    vk::DeviceSize heapSize = this->memoryProperties.memoryHeaps[heap].size;
+    return std::min(this->defaultBlockSize, alignUp(heapSize / 8, 1 << 20));
+  }
+
+  bool allocateFromBlock
+    (uint32_t memoryType,
+     uint32_t index,
+     vk::DeviceSize size,
+     vk::DeviceSize alignment,
+     Allocation &allocation) {
+
+    Block &block = this->blocks[memoryType][index];
+    vk::DeviceSize offset;
+    if (!block.freeList.allocate(size, alignment, offset))
+      return false;
+
+    ++block.allocations;
+    allocation.memory = block.memory;
+    allocation.offset = offset;
+    allocation.size = size;
+    allocation.mapped = block.mapped ? (char*) block.mapped + offset : nullptr;
+    allocation.memoryType = memoryType;
+    allocation.block = index;
+    return true;
+  }
+
+  bool allocateFrom
+    (uint32_t memoryType,
+     vk::DeviceSize size,
+     vk::DeviceSize alignment,
+     Allocation &allocation) {
+
+    std::vector<Block> &typeBlocks = this->blocks[memoryType];
+
+    for (uint32_t i = 0; i < typeBlocks.size(); ++i) {
+      if (typeBlocks[i].memory && !typeBlocks[i].dedicated &&
+          this->allocateFromBlock(memoryType, i, size, alignment, allocation))
+        return true;
+    }
+
+    // Anything bigger than half a block gets memory of its own.
+    vk::DeviceSize blockSize = this->blockSizeFor(memoryType);
+    bool dedicated = size > blockSize / 2;
+
+    Block block;
+    block.size = dedicated ? size : blockSize;
+    block.mapped = nullptr;
+    block.freeList = FreeList(block.size);
+    block.allocations = 0;
+    block.dedicated = dedicated;
+
+    try {
+      block.memory = this->device.allocateMemory(vk::MemoryAllocateInfo(block.size, memoryType));
+    } catch (vk::OutOfDeviceMemoryError) {
+      return false;
+    }
+
+    if (this->memoryProperties.memoryTypes[memoryType].propertyFlags &
+        vk::MemoryPropertyFlagBits::eHostVisible) {
+      block.mapped = this->device.mapMemory(block.memory, 0, VK_WHOLE_SIZE, {});
+    }
+
+    uint32_t index = typeBlocks.size();
+    for (uint32_t i = 0; i < typeBlocks.size(); ++i) {
+      if (!typeBlocks[i].memory) {
+        index = i;
+        break;
+      }
+    }
+    if (index == typeBlocks.size())
+      typeBlocks.push_back(block);
+    else
+      typeBlocks[index] = block;
+
+    return this->allocateFromBlock(memoryType, index, size, alignment, allocation);
+  }
+
+  // Just the allocation's part of its block, widened to whole
+  // nonCoherentAtomSize units as flushes and invalidations must be, but not
+  // past the end of the block.
+  vk::MappedMemoryRange mappedRange(const Allocation &allocation) const {
+    const Block &block = this->blocks[allocation.memoryType][allocation.block];
+    vk::DeviceSize atom = this->nonCoherentAtomSize;
+    vk::DeviceSize start = allocation.offset / atom * atom;
+    vk::DeviceSize end = std::min(alignUp(allocation.offset + allocation.size, atom), block.size);
+    return vk::MappedMemoryRange(allocation.memory, start, end - start);
+  }
+
+public:
+  Allocator() : granularity(1), nonCoherentAtomSize(1), defaultBlockSize(0) {}
+
+  void init
+    (vk::PhysicalDevice physicalDevice,
+     vk::Device device,
+     vk::DeviceSize blockSize = 64 << 20) {
+
+    this->device = device;
+    this->memoryProperties = physicalDevice.getMemoryProperties();
+    vk::PhysicalDeviceLimits limits = physicalDevice.getProperties().limits;
+    this->granularity = limits.bufferImageGranularity;
+    this->nonCoherentAtomSize = limits.nonCoherentAtomSize;
+    this->defaultBlockSize = blockSize;
+    this->blocks = std::vector<std::vector<Block>>(this->memoryProperties.memoryTypeCount);
+  }
+
+  // Frees every block. Outstanding allocations become invalid.
+  void destroy() {
+    for (auto &typeBlocks : this->blocks) {
+      for (auto &block : typeBlocks) {
+        if (block.memory)
+          this->device.freeMemory(block.memory);
+      }
+    }
+    this->blocks.clear();
+  }
+
+  // Picks a memory type with all of the required properties, preferring one
+  // that also has the preferred properties. Set optimal for images with
+  // optimal tiling.
+  Allocation allocate
+    (const vk::MemoryRequirements &requirements,
+     vk::MemoryPropertyFlags required,
+     vk::MemoryPropertyFlags preferred,
+     bool optimal) {
+
+    vk::DeviceSize size = requirements.size;
+    vk::DeviceSize alignment = requirements.alignment;
+    if (optimal) {
+      size = alignUp(size, this->granularity);
+      alignment = std::max(alignment, this->granularity);
+    }
+
+    Allocation allocation;
+    for (int pass = 0; pass < 2; ++pass) {
+      vk::MemoryPropertyFlags wanted = 0 == pass ? required | preferred : required;
+
+      for (uint32_t i = 0; i < this->memoryProperties.memoryTypeCount; ++i) {
+        if (!(requirements.memoryTypeBits & (1u << i)) ||
+            (this->memoryProperties.memoryTypes[i].propertyFlags & wanted) != wanted)
+          continue;
+
+        if (this->allocateFrom(i, size, alignment, allocation))
+          return allocation;
+      }
+    }
+
+    throw std::runtime_error("out of device memory");
+  }
+
+  void free(Allocation &allocation) {
+    if (!allocation.memory)
+      return;
+
+    Block &block = this->blocks[allocation.memoryType][allocation.block];
+    assert(block.memory == allocation.memory);
+
+    block.freeList.release(allocation.offset, allocation.size);
+    --block.allocations;
+
+    // Empty blocks go back to the driver, so that memory used only while
+    // starting up isn't held for the rest of the run.
+    if (block.freeList.empty()) {
+      this->device.freeMemory(block.memory);
+      block = Block();
+    }
+
+    allocation = Allocation();
+  }
+
+  // Host writes to memory that isn't host coherent need flushing before the
+  // device can see them.
+  void flush(const Allocation &allocation) {
+    if (this->memoryProperties.memoryTypes[allocation.memoryType].propertyFlags &
+        vk::MemoryPropertyFlagBits::eHostCoherent)
+      return;
+
+    this->device.flushMappedMemoryRanges(this->mappedRange(allocation));
+  }
+
+  // And device writes need invalidating before the host reads them.
+  void invalidate(const Allocation &allocation) {
+    if (this->memoryProperties.memoryTypes[allocation.memoryType].propertyFlags &
+        vk::MemoryPropertyFlagBits::eHostCoherent)
+      return;
+
+    this->device.invalidateMappedMemoryRanges(this->mappedRange(allocation));
+  }
+
+  AllocatorStats stats() const {
+    AllocatorStats stats = AllocatorStats();
+    double fragmentation = 0;
+    uint64_t freeBlocks = 0;
+
+    for (auto &typeBlocks : this->blocks) {
+      for (auto &block : typeBlocks) {
+        if (!block.memory)
+          continue;
+
+        vk::DeviceSize free = block.freeList.freeBytes();
+        vk::DeviceSize largest = block.freeList.largestFreeRange();
+
+        ++stats.blockCount;
+        stats.blockBytes += block.size;
+        stats.usedBytes += block.size - free;
+        stats.allocationCount += block.allocations;
+        stats.largestFreeRange = std::max<uint64_t>(stats.largestFreeRange, largest);
+
+        if (free > 0) {
+          fragmentation += 1 - (double) largest / free;
+          ++freeBlocks;
+        }
+      }
+    }
+
+    stats.fragmentation = freeBlocks > 0 ? fragmentation / freeBlocks : 0;
+    return stats;
+  }
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+inline double millisecondsSince(Clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Writes a string as a quoted JSON string.
+inline void writeJsonString(std::ostream &out, const std::string &s) {
+  out << '"';
+  for (char c : s) {
+    if ('"' == c || '\\' == c) {
+      out << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      std::ios::fmtflags flags = out.flags();
+      char fill = out.fill('0');
+      out << "\\u" << std::hex << std::setw(4) << (int) c;
+      out.fill(fill);
+      out.flags(flags);
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+// CPU time spent in each part of drawFrame, in milliseconds.
+struct FrameTimings {
+  double fenceWait;
+  double pacing;
+  double acquire;
+  double upload;
+  double record;
+  double capture;
+  double submit;
+  double present;
+  double total;
+
+  // For a frame that shows new input, from the oldest such input event to
+  // when the render thread picked it up, and to when the frame was
+  // presented. Negative for frames without any.
+  double inputQueued;
+  double inputToPresent;
+
+  FrameTimings() :
+    fenceWait(0),
+    pacing(0),
+    acquire(0),
+    upload(0),
+    record(0),
+    capture(0),
+    submit(0),
+    present(0),
+    total(0),
+    inputQueued(-1),
+    inputToPresent(-1) {}
+};
+
+// GPU-side measurements for one frame, read back from query pools once the
+// frame's fence has signalled. Times are in milliseconds.
+struct GpuFrameStats {
+  // The frame these belong to; 0 if there's nothing yet.
+  uint64_t frame;
+
+  // Which of the measurements below were available.
+  bool timed;
+  bool counted;
+
+  // The culling and sorting passes before the render pass, the whole render
+  // pass, and each slice of the draw list within it.
+  double compute;
+  double renderPass;
+  std::vector<double> slices;
+
+  uint64_t vertexInvocations;
+  uint64_t clippingPrimitives;
+  uint64_t fragmentInvocations;
+
+  GpuFrameStats() :
+    frame(0),
+    timed(false),
+    counted(false),
+    compute(0),
+    renderPass(0),
+    slices(),
+    vertexInvocations(0),
+    clippingPrimitives(0),
+    fragmentInvocations(0) {}
+};
+
+// Collects per-frame samples after a warm-up period, until either a frame
+// count or a time limit is reached, and summarises them as JSON.
+class Benchmark {
+private:
+  uint64_t warmupFrames;
+  uint64_t maxFrames;
+  double maxSeconds;
+
+  uint64_t framesSeen;
+  Clock::time_point start;
+  double elapsedSeconds;
+
+  std::vector<std::string> seriesNames;
+  std::vector<std::vector<double>> series;
+  std::vector<std::pair<std::string, double>> metrics;
+  std::vector<std::pair<std::string, std::string>> infos;
+
+  std::vector<double> &getSeries(const std::string &name) {
+    for (size_t i = 0; i < this->seriesNames.size(); ++i) {
+      if (name == this->seriesNames[i])
+        return this->series[i];
+    }
+    this->seriesNames.push_back(name);
+    this->series.push_back(std::vector<double>());
+    return this->series.back();
+  }
+
+  static double percentile(const std::vector<double> &sorted, double p) {
+    assert(!sorted.empty());
+    size_t rank = (size_t) std::ceil(p / 100 * sorted.size());
+    return sorted[std::min(std::max(rank, (size_t) 1), sorted.size()) - 1];
+  }
+
+  static void writeSummary(std::ostream &out, std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+
+    double sum = 0;
+    for (auto &v : values)
+      sum += v;
+
+    out << "{ \"mean\": " << sum / values.size()
+        << ", \"p50\": " << percentile(values, 50)
+        << ", \"p95\": " << percentile(values, 95)
+        << ", \"p99\": " << percentile(values, 99)
+        << ", \"max\": " << values.back()
+        << " }";
+  }
+
+public:
+  Benchmark(uint64_t warmupFrames, uint64_t frames, double seconds) {
+    this->warmupFrames = warmupFrames;
+    this->maxFrames = frames;
+    this->maxSeconds = seconds;
+    this->framesSeen = 0;
+    this->elapsedSeconds = 0;
+    if (0 == warmupFrames)
+      this->start = Clock::now();
+  }
+
+  bool warmingUp() const {
+    return this->framesSeen < this->warmupFrames;
+  }
+
+  uint64_t measuredFrames() const {
+    return this->warmingUp() ? 0 : this->framesSeen - this->warmupFrames;
+  }
+
+  bool done() const {
+    if (this->warmingUp())
+      return false;
+    if (this->maxFrames > 0 && this->measuredFrames() >= this->maxFrames)
+      return true;
+    if (this->maxSeconds > 0 &&
+        millisecondsSince(this->start) >= this->maxSeconds * 1000)
+      return true;
+    return false;
+  }
+
+  void record(const FrameTimings &timings) {
+    ++this->framesSeen;
+
+    if (this->framesSeen <= this->warmupFrames) {
+      if (this->framesSeen == this->warmupFrames)
+        this->start = Clock::now();
+      return;
+    }
+
+    this->sample("frame_time_ms", timings.total);
+    this->sample("fence_wait_ms", timings.fenceWait);
+    this->sample("pacing_ms", timings.pacing);
+    this->sample("acquire_ms", timings.acquire);
+    this->sample("upload_ms", timings.upload);
+    this->sample("record_ms", timings.record);
+    this->sample("capture_ms", timings.capture);
+    this->sample("submit_ms", timings.submit);
+    this->sample("present_ms", timings.present);
+    if (timings.inputToPresent >= 0) {
+      this->sample("input_queued_ms", timings.inputQueued);
+      this->sample("input_to_present_ms", timings.inputToPresent);
+    }
+  }
+
+  // Adds a value to a named per-frame series. Ignored during warm-up.
+  void sample(const std::string &name, double value) {
+    if (this->warmingUp())
+      return;
+    this->getSeries(name).push_back(value);
+  }
+
+  void metric(const std::string &name, double value) {
+    this->metrics.push_back(std::make_pair(name, value));
+  }
+
+  void info(const std::string &name, const std::string &value) {
+    this->infos.push_back(std::make_pair(name, value));
+  }
+
+  // Stops the clock. Call once the last measured frame has completed.
+  void finish() {
+    this->elapsedSeconds = this->warmingUp() ? 0 : millisecondsSince(this->start) / 1000;
+  }
+
+  double seconds() const {
+    return this->elapsedSeconds;
+  }
+
+  double framesPerSecond() const {
+    return this->elapsedSeconds > 0 ? this->measuredFrames() / this->elapsedSeconds : 0;
+  }
+
+  void writeJson(std::ostream &out) const {
+    out << "{\n";
+    for (auto &i : this->infos) {
+      out << "  ";
+      writeJsonString(out, i.first);
+      out << ": ";
+      writeJsonString(out, i.second);
+      out << ",\n";
+    }
+    out << "  \"warmup_frames\": " << this->warmupFrames << ",\n"
+        << "  \"frames\": " << this->measuredFrames() << ",\n"
+        << "  \"seconds\": " << this->elapsedSeconds << ",\n"
+        << "  \"frames_per_second\": " << this->framesPerSecond();
+    for (auto &m : this->metrics) {
+      out << ",\n  \"" << m.first << "\": " << m.second;
+    }
+    for (size_t i = 0; i < this->seriesNames.size(); ++i) {
+      if (this->series[i].empty())
+        continue;
+      out << ",\n  \"" << this->seriesNames[i] << "\": ";
+      writeSummary(out, this->series[i]);
+    }
+    out << "\n}\n";
+  }
+};
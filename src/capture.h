@@ -0,0 +1,250 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+enum class CaptureFormat {
+  // A numbered PPM file per frame, in a directory.
+  Ppm,
+
+  // Every frame appended to one file as raw RGBA, as ffmpeg's rawvideo
+  // format with pix_fmt rgba.
+  Raw
+};
+
+// A captured frame, sitting in one of the readback buffers.
+struct CapturedFrame {
+  // Counts up from 0 over the frames actually captured.
+  uint64_t number;
+
+  // The readback buffer, and the image in it: 4 bytes a pixel, rows tightly
+  // packed, as B, G, R, A if bgra is set and R, G, B, A otherwise.
+  uint32_t slot;
+  const uint8_t *pixels;
+  uint32_t width;
+  uint32_t height;
+  bool bgra;
+};
+
+// Writes captured frames out on a thread of its own, so that the render
+// thread never waits for the disk. It also keeps track of which of the
+// readback buffers (slots) are free: the render thread reserves one to copy
+// a frame into, and it's free again once the frame has been written.
+class CaptureWriter {
+private:
+  CaptureFormat format;
+  std::string path;
+  std::ofstream raw;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<CapturedFrame> frames;
+  std::vector<bool> slotBusy;
+  uint64_t written;
+  uint64_t failed;
+  bool stopping;
+
+  // The size of every frame in a Raw stream, set by the first one.
+  uint32_t rawWidth;
+  uint32_t rawHeight;
+  bool rawSizeWarned;
+
+  bool writeFrame(const CapturedFrame &frame) {
+    size_t pixelCount = (size_t) frame.width * frame.height;
+    uint32_t red = frame.bgra ? 2 : 0;
+    uint32_t blue = frame.bgra ? 0 : 2;
+
+    if (CaptureFormat::Raw == this->format) {
+      std::vector<uint8_t> rgba(pixelCount * 4);
+      for (size_t i = 0; i < pixelCount; ++i) {
+        rgba[i * 4 + 0] = frame.pixels[i * 4 + red];
+        rgba[i * 4 + 1] = frame.pixels[i * 4 + 1];
+        rgba[i * 4 + 2] = frame.pixels[i * 4 + blue];
+        rgba[i * 4 + 3] = frame.pixels[i * 4 + 3];
+      }
+      this->raw.write((const char*) rgba.data(), rgba.size());
+      return (bool) this->raw;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/frame-%06llu.ppm", (unsigned long long) frame.number);
+    std::ofstream file(this->path + name, std::ios_base::binary | std::ios_base::trunc);
+    file << "P6\n" << frame.width << " " << frame.height << "\n255\n";
+
+    std::vector<uint8_t> rgb(pixelCount * 3);
+    for (size_t i = 0; i < pixelCount; ++i) {
+      rgb[i * 3 + 0] = frame.pixels[i * 4 + red];
+      rgb[i * 3 + 1] = frame.pixels[i * 4 + 1];
+      rgb[i * 3 + 2] = frame.pixels[i * 4 + blue];
+    }
+    file.write((const char*) rgb.data(), rgb.size());
+    return (bool) file;
+  }
+
+  void writerMain() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (;;) {
+      this->wake.wait(lock, [&]() { return this->stopping || !this->frames.empty(); });
+      if (this->frames.empty())
+        return;
+
+      CapturedFrame frame = this->frames.front();
+      this->frames.pop_front();
+      lock.unlock();
+
+      bool ok = this->writeFrame(frame);
+
+      lock.lock();
+      this->slotBusy[frame.slot] = false;
+      if (ok) {
+        ++this->written;
+      } else {
+        if (0 == this->failed)
+          std::cerr << "couldn't write captured frame " << frame.number << std::endl;
+        ++this->failed;
+      }
+    }
+  }
+
+public:
+  CaptureWriter() :
+    format(CaptureFormat::Ppm),
+    written(0),
+    failed(0),
+    stopping(false),
+    rawWidth(0),
+    rawHeight(0),
+    rawSizeWarned(false) {}
+
+  CaptureWriter(const CaptureWriter&) = delete;
+  CaptureWriter &operator=(const CaptureWriter&) = delete;
+
+  ~CaptureWriter() {
+    this->stop();
+  }
+
+  // For Ppm, path is the directory to write to, which is made if it doesn't
+  // exist; for Raw, the file. Either way, it throws now if the frames can't
+  // be written there, rather than failing frame by frame later.
+  void start(CaptureFormat format, const std::string &path, uint32_t slotCount) {
+    this->format = format;
+    this->path = path;
+    this->slotBusy = std::vector<bool>(slotCount, false);
+
+    if (CaptureFormat::Raw == format) {
+      this->raw.open(path, std::ios_base::binary | std::ios_base::trunc);
+      if (!this->raw.is_open()) {
+        throw std::runtime_error("couldn't open " + path);
+      }
+    } else {
+      struct stat info;
+      if (0 != stat(path.c_str(), &info)) {
+        if (0 != mkdir(path.c_str(), 0777))
+          throw std::runtime_error("couldn't make directory " + path);
+      } else if (!S_ISDIR(info.st_mode)) {
+        throw std::runtime_error(path + " isn't a directory");
+      }
+      if (0 != access(path.c_str(), W_OK | X_OK)) {
+        throw std::runtime_error("can't write to " + path);
+      }
+    }
+
+    this->thread = std::thread(&CaptureWriter::writerMain, this);
+  }
+
+  // Writes the frames already handed over, then stops the thread.
+  void stop() {
+    if (!this->thread.joinable())
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->wake.notify_all();
+    this->thread.join();
+    this->stopping = false;
+    this->raw.close();
+  }
+
+  bool running() const {
+    return this->thread.joinable();
+  }
+
+  // Whether a frame of this size can be written. A Raw stream has nothing
+  // to say where one frame ends and the next begins, so once its first
+  // frame is accepted, frames of any other size (after a resize, say) are
+  // turned away, with a warning the first time. Render thread only.
+  bool accepts(uint32_t width, uint32_t height) {
+    if (CaptureFormat::Raw != this->format)
+      return true;
+
+    if (0 == this->rawWidth) {
+      this->rawWidth = width;
+      this->rawHeight = height;
+    }
+    if (width == this->rawWidth && height == this->rawHeight)
+      return true;
+
+    if (!this->rawSizeWarned) {
+      std::cerr << "dropping " << width << "x" << height << " captured frames from a "
+                << this->rawWidth << "x" << this->rawHeight << " raw stream" << std::endl;
+      this->rawSizeWarned = true;
+    }
+    return false;
+  }
+
+  // Finds a free slot, without waiting for one. Returns false if every slot
+  // is in use.
+  bool reserve(uint32_t &slot) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (uint32_t i = 0; i < this->slotBusy.size(); ++i) {
+      if (!this->slotBusy[i]) {
+        this->slotBusy[i] = true;
+        slot = i;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Frees a reserved slot without writing it.
+  void release(uint32_t slot) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->slotBusy[slot] = false;
+  }
+
+  // Queues a frame in a reserved slot to be written. The slot is freed
+  // once it has been.
+  void write(const CapturedFrame &frame) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->frames.push_back(frame);
+    }
+    this->wake.notify_one();
+  }
+
+  uint64_t framesWritten() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->written;
+  }
+
+  uint64_t framesFailed() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->failed;
+  }
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "benchmark.h"
+
+// Something that happened on the event thread, for the render thread to
+// act on.
+struct Event {
+  enum Type {
+    Key
+  };
+
+  Type type;
+
+  // When the event thread received it.
+  Clock::time_point time;
+
+  // Key: as passed to a GLFW key callback.
+  int key;
+  int action;
+  int mods;
+
+  Event() :
+    type(Key),
+    key(0),
+    action(0),
+    mods(0) {}
+};
+
+// A fixed-size, lock-free queue between exactly one producer thread and one
+// consumer thread. Neither side ever blocks: push fails when the queue is
+// full, and pop when it's empty.
+template <typename T, size_t Capacity>
+class SpscQueue {
+private:
+  static_assert(Capacity > 0 && 0 == (Capacity & (Capacity - 1)),
+                "Capacity must be a power of two");
+
+  T items[Capacity];
+
+  // Positions increase forever; position p is at items[p % Capacity]. Each
+  // is only written by one side, and they're kept on separate cache lines so
+  // that the two sides don't contend for one.
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+
+public:
+  SpscQueue() : head(0), tail(0) {}
+
+  SpscQueue(const SpscQueue&) = delete;
+  SpscQueue &operator=(const SpscQueue&) = delete;
+
+  // Producer only.
+  bool push(const T &item) {
+    size_t tail = this->tail.load(std::memory_order_relaxed);
+    if (tail - this->head.load(std::memory_order_acquire) == Capacity)
+      return false;
+
+    this->items[tail % Capacity] = item;
+    this->tail.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only.
+  bool pop(T &item) {
+    size_t head = this->head.load(std::memory_order_relaxed);
+    if (head == this->tail.load(std::memory_order_acquire))
+      return false;
+
+    item = this->items[head % Capacity];
+    this->head.store(head + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// The latest of a series of sizes, passed from one thread to another.
+// Sizes aren't queued, so none is lost however many arrive between looks:
+// the reader just sees the last one.
+class LatestSize {
+private:
+  // Width in bits 32 to 62 and height in the low bits, with PENDING set
+  // until the reader takes them.
+  std::atomic<uint64_t> packed;
+  static const uint64_t PENDING = (uint64_t) 1 << 63;
+
+public:
+  LatestSize() : packed(0) {}
+
+  LatestSize(const LatestSize&) = delete;
+  LatestSize &operator=(const LatestSize&) = delete;
+
+  void store(int width, int height) {
+    this->packed.store
+      (PENDING | (uint64_t) (uint32_t) width << 32 | (uint32_t) height,
+       std::memory_order_release);
+  }
+
+  // Returns false if nothing has been stored since the last take.
+  bool take(int &width, int &height) {
+    uint64_t packed = this->packed.exchange(0, std::memory_order_acquire);
+    if (!(packed & PENDING))
+      return false;
+
+    width = (int) ((packed >> 32) & 0x7fffffff);
+    height = (int) (uint32_t) packed;
+    return true;
+  }
+};
@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run batches of numbered jobs. The
+// thread that calls run works on the batch too, as worker 0, so a system
+// with one worker runs everything inline.
+//
+// Each job is told which worker is running it, so that per-worker resources
+// (like command pools, which mustn't be used from two threads at once) can
+// be indexed without locking.
+class JobSystem {
+private:
+  std::vector<std::thread> threads;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable finished;
+
+  // The current batch. generation changes whenever a new batch starts, so
+  // that a worker never picks up the same batch twice.
+  std::function<void(uint32_t, uint32_t)> job;
+  uint32_t jobCount;
+  uint32_t nextJob;
+  uint32_t running;
+  uint64_t generation;
+  std::exception_ptr error;
+  bool stopping;
+
+  // Runs jobs from the current batch until there are none left. Called with
+  // the lock held, and returns with it held.
+  void work(std::unique_lock<std::mutex> &lock, uint32_t worker) {
+    while (this->nextJob < this->jobCount) {
+      uint32_t index = this->nextJob++;
+      ++this->running;
+      lock.unlock();
+
+      std::exception_ptr error;
+      try {
+        this->job(worker, index);
+      } catch (...) {
+        error = std::current_exception();
+      }
+
+      lock.lock();
+      --this->running;
+      if (error && !this->error)
+        this->error = error;
+    }
+
+    if (0 == this->running)
+      this->finished.notify_all();
+  }
+
+  void workerMain(uint32_t worker) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    uint64_t seen = 0;
+    for (;;) {
+      this->wake.wait(lock, [&]() { return this->stopping || this->generation != seen; });
+      if (this->stopping)
+        return;
+      seen = this->generation;
+      this->work(lock, worker);
+    }
+  }
+
+public:
+  JobSystem() :
+    jobCount(0),
+    nextJob(0),
+    running(0),
+    generation(0),
+    stopping(false) {}
+
+  JobSystem(const JobSystem&) = delete;
+  JobSystem &operator=(const JobSystem&) = delete;
+
+  ~JobSystem() {
+    this->stop();
+  }
+
+  // Starts workerCount - 1 threads; the caller of run is the other worker.
+  void start(uint32_t workerCount) {
+    assert(this->threads.empty());
+    for (uint32_t i = 1; i < workerCount; ++i)
+      this->threads.push_back(std::thread(&JobSystem::workerMain, this, i));
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->wake.notify_all();
+    for (auto &t : this->threads)
+      t.join();
+    this->threads.clear();
+    this->stopping = false;
+  }
+
+  uint32_t workerCount() const {
+    return this->threads.size() + 1;
+  }
+
+  // Calls job(worker, i) for every i in [0, count), spread across the
+  // workers, and waits for all of them. If any job throws, the first
+  // exception is rethrown once the batch has finished.
+  void run(uint32_t count, const std::function<void(uint32_t worker, uint32_t job)> &job) {
+    if (0 == count)
+      return;
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->job = job;
+    this->jobCount = count;
+    this->nextJob = 0;
+    this->error = nullptr;
+    ++this->generation;
+    this->wake.notify_all();
+
+    this->work(lock, 0);
+    this->finished.wait(lock, [&]() { return 0 == this->running; });
+
+    this->job = nullptr;
+    std::exception_ptr error = this->error;
+    this->error = nullptr;
+    lock.unlock();
+
+    if (error)
+      std::rethrow_exception(error);
+  }
+};
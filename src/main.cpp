@@ -3,12 +3,39 @@
 #define VULKAN_HPP_TYPESAFE_CONVERSION
 #include <vulkan/vulkan.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <optional>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <unordered_set>
 
+#include "allocator.h"
+#include "benchmark.h"
+#include "capture.h"
+#include "events.h"
+#include "jobs.h"
+#include "pipeline_compiler.h"
+#include "scene.h"
+#include "scene_file.h"
+#include "shaders.h"
+#include "task_graph.h"
+#include "trace.h"
+#include "upload_ring.h"
+
 VkBool32 messengerCallback
   (VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
    VkDebugUtilsMessageTypeFlagsEXT messageTypes,
@@ -20,6 +47,42 @@ VkBool32 messengerCallback
   return VK_FALSE;
 }
 
+struct Buffer {
+  vk::Buffer buffer;
+  Allocation allocation;
+  vk::DeviceSize size;
+};
+
+// Matches the Cull push constants in cull.comp.
+struct CullParameters {
+  View view;
+  uint32_t instanceCount;
+  uint32_t instancesPerDraw;
+  float meshRadius;
+  float viewportSize[2];
+  float minPixels;
+};
+
+static_assert(sizeof(CullParameters) == 36, "CullParameters must match the shader's layout");
+
+// Matches the Sort push constants in sort.comp.
+struct SortParameters {
+  uint32_t instanceCount;
+  uint32_t pass;
+  uint32_t tileCount;
+  uint32_t indexCount;
+  uint32_t instancesPerDraw;
+  uint32_t drawCount;
+};
+
+static_assert(sizeof(SortParameters) == 24, "SortParameters must match the shader's layout");
+
+// Matches the Step push constants in simulate.comp.
+struct SimulationStep {
+  uint32_t instanceCount;
+  float dt;
+};
+
 class Context {
 private:
   GLFWwindow *window;
@@ -30,12 +93,17 @@ private:
   vk::SurfaceKHR surface;
   vk::DispatchLoaderDynamic loader;
   vk::DebugUtilsMessengerEXT messenger;
+  bool debugUtilsSupported;
   vk::PhysicalDevice physicalDevice;
   vk::Device device;
   uint32_t *graphicsQfIx;
   uint32_t *presentQfIx;
+  uint32_t *transferQfIx;
+  uint32_t *computeQfIx;
   vk::Queue graphicsQueue;
   vk::Queue presentQueue;
+  vk::Queue transferQueue;
+  vk::Queue computeQueue;
   vk::Format swapchainFormat;
   vk::Extent2D swapchainExtent;
   vk::SwapchainKHR swapchain;
@@ -50,18 +118,514 @@ private:
   std::vector<vk::Semaphore> renderFinishedSems;
   std::vector<vk::Fence> inFlightFences;
 
+  Allocator allocator;
+
+  // Headless mode renders into these instead of swapchain images. The
+  // swapchainFormat and swapchainExtent fields describe them as well.
+  bool headless;
+  std::vector<vk::Image> offscreenImages;
+  std::vector<vk::Image> swapchainImages;
+  std::vector<Allocation> offscreenAllocations;
+
+  // Frame n is the n'th submission (starting from 1). frameSerials records the
+  // last frame submitted from each frame-in-flight slot, and completedFrames
+  // is the newest frame whose fence has been seen signalled.
+  std::vector<uint64_t> frameSerials;
+  uint64_t submittedFrames;
+  uint64_t completedFrames;
+
+  FrameTimings timings;
+
+  // Each frame-in-flight slot has its own query pools, and its own copy of
+  // the command buffers that write to them, so results can be read back as
+  // soon as the slot's fence has signalled. Timestamp 0 is written before the
+  // culling and sorting passes, 1 before the render pass, 2 + i after slice i
+  // of the draw list, and the last one after the render pass.
+  std::vector<vk::QueryPool> timestampPools;
+  std::vector<vk::QueryPool> statisticsPools;
+  uint64_t timestampMask;
+  float timestampPeriod;
+  bool statisticsSupported;
+  GpuFrameStats gpuStats;
+
+  uint32_t timestampCount() const {
+    return this->sliceCount + 3;
+  }
+
+  vk::QueryPipelineStatisticFlags statisticsFlags() const {
+    return
+      vk::QueryPipelineStatisticFlagBits::eVertexShaderInvocations |
+      vk::QueryPipelineStatisticFlagBits::eClippingPrimitives |
+      vk::QueryPipelineStatisticFlagBits::eFragmentShaderInvocations;
+  }
+
+  size_t commandBufferIndex(uint32_t frame, uint32_t image) const {
+    return frame * this->framebuffers.size() + image;
+  }
+
+  Clock::time_point overlayUpdated;
+
+  vk::PipelineCache pipelineCache;
+  std::string pipelineCachePath;
+
+  // What readPipelineCache read, until initPipelineCache uses it.
+  std::vector<char> pipelineCacheData;
+
+  // Every variant of the graphics pipeline built so far for the current
+  // render pass. pipeline is the one in use.
+  std::map<PipelineVariant, vk::Pipeline> pipelines;
+  PipelineVariant pipelineVariant;
+  GraphicsShaders graphicsShaders;
+
+  // With a depth pre-pass, the depth-only pipeline for each variant, built
+  // from the same vertex shader as its main pipeline so that the depths
+  // match exactly. depthPipeline is the one in use.
+  std::map<PipelineVariant, vk::Pipeline> depthPipelines;
+  vk::Pipeline depthPipeline;
+
+  // Hot reloading: when the shaders in shaderDir change, the compiler
+  // thread builds a new pipeline through the shared pipeline cache and
+  // leaves it in reloaded, for pollShaderReload to swap in between frames.
+  // The old pipeline keeps drawing until then.
+  struct ReloadedPipeline {
+    bool ready;
+    vk::Pipeline pipeline;
+    vk::Pipeline depthPipeline;
+    GraphicsShaders shaders;
+    PipelineVariant variant;
+    vk::RenderPass renderpass;
+
+    ReloadedPipeline() : ready(false) {}
+  };
+
+  PipelineCompiler compiler;
+  FileWatcher shaderWatcher;
+  std::string shaderDir;
+  Clock::time_point shadersChecked;
+  const double SHADER_POLL_MS = 250;
+  bool reloading;
+  bool reloadAgain;
+  std::mutex reloadMutex;
+  ReloadedPipeline reloaded;
+
+  // Set when the swapchain no longer matches the window. A stale swapchain
+  // couldn't be recreated because the window has no area (it's minimised).
+  bool framebufferResized;
+  bool swapchainStale;
+
+  // Rendering happens on its own thread, so GLFW (which has to be used from
+  // the main thread) never sees it. Window events reach it through this
+  // queue. Resizes come separately, through resizedTo, so that one is never
+  // dropped when the queue is full; the framebuffer size is tracked here
+  // rather than asked for.
+  SpscQueue<Event, 1024> events;
+  std::atomic<uint64_t> eventsDropped;
+  LatestSize resizedTo;
+  int framebufferWidth;
+  int framebufferHeight;
+
+  // The overlay text is made on the render thread, and shown by the main
+  // thread in showOverlay.
+  std::mutex overlayMutex;
+  std::string overlayText;
+  bool overlayChanged;
+
+  // Set when the view has changed since the command buffers were recorded.
+  bool viewChanged;
+
+  // Capturing: once a frame is rendered, captureCommandBuffers[frame],
+  // submitted along with it, copies its image into a free readback buffer.
+  // When the frame's fence has signalled, the buffer goes to captureWriter
+  // to be written out on its own thread, which frees it again. Rendering
+  // never waits for capturing: a frame is dropped if no buffer is free, if
+  // the writer can't take a frame of its size, or if capturing has been
+  // taking longer than captureBudget milliseconds a frame on the render
+  // thread. That's only the time spent recording the copy; the copy itself
+  // runs on the GPU, and the writing on the writer's thread, so neither
+  // counts against the budget. If they can't keep up, it shows as buffers
+  // that aren't free yet.
+  struct PendingCapture {
+    bool pending;
+    CapturedFrame frame;
+
+    PendingCapture() : pending(false) {}
+  };
+
+  bool capturing;
+  CaptureWriter captureWriter;
+  std::vector<Buffer> captureBuffers;
+  vk::CommandPool captureCommandPool;
+  std::vector<vk::CommandBuffer> captureCommandBuffers;
+  std::vector<PendingCapture> pendingCaptures;
+  uint64_t framesCaptured;
+  uint64_t framesDropped;
+  double captureBudget;
+  double captureCost;
+
+  // On-demand rendering: rather than redraw a frame that hasn't changed,
+  // the render thread sleeps until woken by an event. redraw is set by
+  // anything that changes what a frame would show: the view, the window
+  // size or the shaders.
+  bool onDemand;
+  bool redraw;
+  std::mutex wakeMutex;
+  std::condition_variable wakeCondition;
+  bool woken;
+
+  // The present mode and swapchain image count asked for. Without a mode,
+  // mailbox is used where there is one; without a count, one more than the
+  // minimum.
+  bool presentModeRequested;
+  vk::PresentModeKHR requestedPresentMode;
+  uint32_t requestedImageCount;
+  vk::PresentModeKHR presentMode;
+
+  // Frame pacing sleeps at the start of a frame, before anything that might
+  // block, so that the frame reads input and starts as late as it can while
+  // still presenting paceInterval milliseconds after the last one. That's
+  // the requested rate, or the monitor's refresh rate (refreshRate, in Hz,
+  // zero if unknown), or failing both the measured presentInterval. With
+  // MAILBOX or IMMEDIATE, pacing is what sets the frame rate. presentInterval
+  // is the smoothed time between presents, and frameWork the smoothed time
+  // from waking up to presenting, less any wait for the fence or in acquire.
+  bool pacing;
+  double paceInterval;
+  int refreshRate;
+  double presentInterval;
+  double frameWork;
+  Clock::time_point lastPresent;
+
+  const double PACING_MARGIN_MS = 1;
+
+  // How much each new sample moves a smoothed measurement.
+  const double SMOOTHING = 0.1;
+
+  // The oldest input that changed what's drawn and hasn't been presented
+  // yet, and how long it waited to be picked up. Unset (the epoch) when
+  // there's none.
+  Clock::time_point pendingInput;
+  double pendingInputQueued;
+  double inputLatency;
+
+  // The draw list is recorded into secondary command buffers on the job
+  // system, one slice of it per job, and each frame's primary command buffer
+  // runs its slot's secondaries. A command pool can only be used by one
+  // thread at a time, so every worker has its own pool for each slot:
+  // workerPools[frame * workerCount + worker].
+  struct WorkerPool {
+    vk::CommandPool pool;
+
+    // The secondaries allocated so far, which are reused after the pool is
+    // reset. next is the first one not yet used since then.
+    std::vector<vk::CommandBuffer> secondaries;
+    size_t next;
+  };
+
+  JobSystem jobs;
+  std::vector<WorkerPool> workerPools;
+  std::vector<Draw> draws;
+  uint32_t sliceCount;
+
+  // When recording once, re-recording retires the worker pools along with
+  // the command buffers recorded from them, and records into a spare set.
+  // Retired sets are reset and kept here once their frames are done.
+  std::vector<std::vector<WorkerPool>> spareWorkerPools;
+
+  // Indexed by frame * secondariesPerFrame() + pass * sliceCount + slice.
+  // Unused when recording every frame.
+  std::vector<vk::CommandBuffer> secondaryCommandBuffers;
+
+  // Instead of replaying commandBuffers, each frame can be recorded into its
+  // slot's own command buffer just before it's submitted.
+  bool recordEveryFrame;
+  std::vector<vk::CommandPool> perFramePools;
+  std::vector<vk::CommandBuffer> perFrameCommandBuffers;
+
+  struct RenderTarget {
+    vk::Image image;
+    Allocation allocation;
+    vk::ImageView view;
+    vk::Framebuffer framebuffer;
+  };
+
+  // Resources replaced while frames that use them may still be in flight.
+  // They're destroyed once frame has completed.
+  struct RetiredResources {
+    uint64_t frame;
+    vk::SwapchainKHR swapchain;
+    std::vector<vk::ImageView> imageViews;
+    std::vector<vk::Framebuffer> framebuffers;
+    std::vector<vk::CommandBuffer> commandBuffers;
+    std::vector<WorkerPool> workerPools;
+    vk::RenderPass renderpass;
+    std::vector<vk::Pipeline> pipelines;
+    std::vector<RenderTarget> renderTargets;
+  };
+  std::vector<RetiredResources> retired;
+
+  // With dynamic resolution, each frame is drawn into the corner of its
+  // slot's render target, at renderScale times the size of the image it's
+  // presented from, then blitted up to fill that image. The targets are as
+  // big as the image, so a new scale only changes the render area and the
+  // viewport (and so the recorded command buffers), never the swapchain,
+  // the targets or the pipelines. The scale follows the GPU's frame time,
+  // from the timestamp queries, towards resolutionBudget.
+  bool dynamicResolution;
+  double resolutionBudget;
+  float minRenderScale;
+  float renderScale;
+  std::vector<RenderTarget> renderTargets;
+
+  // What the GPU would take to draw a frame at full resolution, smoothed,
+  // and the scale each slot's last frame was drawn at.
+  double fullResolutionCost;
+  std::vector<float> frameScales;
+
+  // The scale only changes once it's off by this much, so that the command
+  // buffers aren't re-recorded every frame.
+  const float RENDER_SCALE_STEP = 0.05f;
+
+  // The size of the area drawn to: swapchainExtent, scaled.
+  vk::Extent2D renderExtent;
+
+  // With depth testing, every framebuffer shares one depth buffer (the
+  // render pass waits for the last frame's depth tests before clearing it),
+  // which is cleared at the start of the render pass and never stored, so it
+  // can live in lazily allocated memory where there is some: a tiler then
+  // keeps it on chip and never backs it at all.
+  // A pre-pass first lays down the depth of the whole scene with a depth-only
+  // pipeline in a subpass of its own, so that the main subpass only shades
+  // the fragments that end up visible.
+  bool depthTesting;
+  bool depthPrepass;
+  vk::Format depthFormat;
+  RenderTarget depthBuffer;
+
+  // The subpass that draws in colour: the second when there's a pre-pass.
+  uint32_t colorSubpass() const {
+    return this->depthPrepass ? 1 : 0;
+  }
+
+  // Secondary command buffers recorded for each frame: a pass over the draw
+  // list per subpass, in sliceCount slices.
+  uint32_t secondariesPerFrame() const {
+    return (this->depthPrepass ? 2 : 1) * this->sliceCount;
+  }
+
+  Buffer vertexBuffer;
+  Buffer indexBuffer;
+  Buffer instanceBuffer;
+  uint32_t indexCount;
+  uint32_t instanceCount;
+
+  // When streaming, the instances are rewritten every frame from
+  // streamSource, through the upload ring, into the frame's own buffer.
+  bool streaming;
+  std::vector<Instance> streamSource;
+  std::vector<Buffer> streamedInstanceBuffers;
+  UploadRing uploadRing;
+
+  // When loading a scene file, instanceBuffer is filled a chunk at a time
+  // while frames are drawn, with up to loadBudget bytes a frame going
+  // through the upload ring. Only the first loadedInstances are drawn, so
+  // no frame reads a part of the buffer before its copy is done.
+  const SceneFile *sceneFile;
+  uint32_t nextChunk;
+  uint32_t loadedInstances;
+  vk::DeviceSize loadBudget;
+
+  // Unless culling or sorting write them, the draw commands for a scene file
+  // come from the frame's loadingDrawBuffers, rewritten whenever more of it
+  // has loaded (loadingDrawCounts is how much had when each was written), so
+  // that the command buffers don't have to be re-recorded as it does. Only
+  // if the device can draw them; otherwise the draws are re-recorded.
+  bool loadingIndirect;
+  std::vector<Buffer> loadingDrawBuffers;
+  std::vector<uint32_t> loadingDrawCounts;
+
+  bool loading() const {
+    return this->sceneFile && this->nextChunk < this->sceneFile->chunkCount();
+  }
+
+  bool uploading() const {
+    return this->streaming || this->sceneFile;
+  }
+
+  // For the graphics family's half of an upload's ownership transfer.
+  vk::CommandPool frameCommandPool;
+  std::vector<vk::CommandBuffer> acquireCommandBuffers;
+
+  // When simulating, each frame's instances are made on the compute queue:
+  // a compute pass steps every Particle in particleBuffer and writes the
+  // instances to draw into the frame's simulatedInstanceBuffers. The
+  // graphics submit waits for simulatedSems[frame], and the simulation for
+  // a frame is submitted while the previous frame may still be rendering,
+  // so the two overlap. If the compute family isn't the graphics family,
+  // the frame's instances change hands with an ownership transfer.
+  bool simulating;
+  Buffer particleBuffer;
+  std::vector<Buffer> simulatedInstanceBuffers;
+  std::vector<vk::Semaphore> simulatedSems;
+  vk::CommandPool simulateCommandPool;
+  std::vector<vk::CommandBuffer> simulateCommandBuffers;
+  vk::DescriptorSetLayout simulateSetLayout;
+  vk::DescriptorPool simulateDescriptorPool;
+  std::vector<vk::DescriptorSet> simulateDescriptorSets;
+  vk::PipelineLayout simulatePipelineLayout;
+  vk::Pipeline simulatePipeline;
+
+  bool simulationTransfers() const {
+    return this->simulating && *this->computeQfIx != *this->graphicsQfIx;
+  }
+
+  const Buffer &instanceBufferFor(uint32_t frame) const {
+    if (this->simulating)
+      return this->simulatedInstanceBuffers[frame];
+    return this->streaming ? this->streamedInstanceBuffers[frame] : this->instanceBuffer;
+  }
+
+  View view;
+
+  // With GPU culling, a compute pass at the start of each frame copies the
+  // visible instances from instanceBufferFor(frame) into the frame's
+  // culledInstanceBuffers, and counts them into one indirect draw command
+  // per draw in the frame's drawCommandBuffers. The commands start each
+  // frame as a copy of drawCommandTemplate, which has no instances.
+  bool culling;
+  float minPixels;
+  float meshRadius;
+  uint32_t maxIndirectDraws;
+  std::vector<Buffer> culledInstanceBuffers;
+  std::vector<Buffer> drawCommandBuffers;
+  Buffer drawCommandTemplate;
+  vk::DescriptorSetLayout cullSetLayout;
+  vk::DescriptorPool cullDescriptorPool;
+  std::vector<vk::DescriptorSet> cullDescriptorSets;
+  vk::PipelineLayout cullPipelineLayout;
+  vk::Pipeline cullPipeline;
+
+  // For blending, the instances have to be drawn back to front, so with
+  // sorting, a compute pass at the start of each frame radix sorts them by
+  // depth into the frame's sortedInstanceBuffers, and writes the frame's
+  // drawCommandBuffers to draw them from there. The CPU never sees the
+  // order. Each pass sorts one digit of the depth, ping-ponging instance
+  // indices between the frame's two sortIndexBuffers (frame * 2 and
+  // frame * 2 + 1), with per-tile digit counts in its sortHistogramBuffers.
+  // There's a pipeline for each of a pass's stages; see sort.comp.
+  bool sorting;
+  std::vector<Buffer> sortedInstanceBuffers;
+  std::vector<Buffer> sortIndexBuffers;
+  std::vector<Buffer> sortHistogramBuffers;
+  vk::DescriptorSetLayout sortSetLayout;
+  vk::DescriptorPool sortDescriptorPool;
+  std::vector<vk::DescriptorSet> sortDescriptorSets;
+  vk::PipelineLayout sortPipelineLayout;
+  std::vector<vk::Pipeline> sortPipelines;
+
+  // Match sort.comp.
+  const uint32_t SORT_TILE = 2048;
+  const uint32_t SORT_DIGITS = 16;
+  const uint32_t SORT_PASSES = 4;
+
+  // Where the graphics queue first reads the frame's instances.
+  vk::PipelineStageFlags instanceReadStage() const {
+    return
+      this->culling || this->sorting ?
+        vk::PipelineStageFlags(vk::PipelineStageFlagBits::eComputeShader) :
+        vk::PipelineStageFlags(vk::PipelineStageFlagBits::eVertexInput);
+  }
+
+  vk::AccessFlags instanceReadAccess() const {
+    return
+      this->culling || this->sorting ?
+        vk::AccessFlags(vk::AccessFlagBits::eShaderRead) :
+        vk::AccessFlags(vk::AccessFlagBits::eVertexAttributeRead);
+  }
+
   const uint32_t FRAMES_IN_FLIGHT = 2;
   uint32_t currentFrame;
 
 
 public:
   Context() {
+    this->window = nullptr;
+    this->title = nullptr;
+    this->graphicsQfIx = nullptr;
+    this->presentQfIx = nullptr;
+    this->transferQfIx = nullptr;
+    this->computeQfIx = nullptr;
+    this->headless = false;
+    this->debugUtilsSupported = false;
+    this->submittedFrames = 0;
+    this->completedFrames = 0;
+    this->timestampMask = 0;
+    this->timestampPeriod = 0;
+    this->statisticsSupported = false;
+    this->framebufferResized = false;
+    this->swapchainStale = false;
+    this->indexCount = 0;
+    this->instanceCount = 0;
+    this->sliceCount = 1;
+    this->recordEveryFrame = false;
+    this->reloading = false;
+    this->reloadAgain = false;
+    this->eventsDropped = 0;
+    this->framebufferWidth = 0;
+    this->framebufferHeight = 0;
+    this->overlayChanged = false;
+    this->viewChanged = false;
+    this->capturing = false;
+    this->dynamicResolution = false;
+    this->resolutionBudget = 0;
+    this->minRenderScale = 1;
+    this->renderScale = 1;
+    this->fullResolutionCost = 0;
+    this->depthTesting = false;
+    this->depthPrepass = false;
+    this->depthFormat = vk::Format::eUndefined;
+    this->framesCaptured = 0;
+    this->framesDropped = 0;
+    this->captureBudget = 0;
+    this->captureCost = 0;
+    this->onDemand = false;
+    this->redraw = true;
+    this->woken = false;
+    this->presentModeRequested = false;
+    this->requestedPresentMode = vk::PresentModeKHR::eFifo;
+    this->requestedImageCount = 0;
+    this->presentMode = vk::PresentModeKHR::eFifo;
+    this->pacing = false;
+    this->paceInterval = 0;
+    this->refreshRate = 0;
+    this->presentInterval = 0;
+    this->frameWork = 0;
+    this->pendingInputQueued = 0;
+    this->inputLatency = -1;
+    this->streaming = false;
+    this->sceneFile = nullptr;
+    this->nextChunk = 0;
+    this->loadedInstances = 0;
+    this->loadBudget = 0;
+    this->loadingIndirect = false;
+    this->simulating = false;
+    this->culling = false;
+    this->sorting = false;
+    this->minPixels = 0;
+    this->meshRadius = 0;
+    this->maxIndirectDraws = 1;
     this->currentFrame = 0;
   }
 
   ~Context() {
+    // Nothing can be compiling, or reading a readback buffer, while the
+    // device goes away.
+    this->compiler.stop();
+    this->captureWriter.stop();
+
     if (this->graphicsQfIx) free(this->graphicsQfIx);
     if (this->presentQfIx) free(this->presentQfIx);
+    if (this->transferQfIx) free(this->transferQfIx);
+    if (this->computeQfIx) free(this->computeQfIx);
 
     if (this->device) {
 
@@ -76,18 +640,111 @@ public:
       for (auto &s : this->imageAvailableSems)
         this->device.destroySemaphore(s);
 
+      for (auto &p : this->timestampPools)
+        this->device.destroyQueryPool(p);
+
+      for (auto &p : this->statisticsPools)
+        this->device.destroyQueryPool(p);
+
+      if (this->reloaded.pipeline)
+        this->device.destroyPipeline(this->reloaded.pipeline);
+      if (this->reloaded.depthPipeline)
+        this->device.destroyPipeline(this->reloaded.depthPipeline);
+
+      this->releaseRetired(true);
       this->cleanupSwapchain();
 
+      this->destroyBuffer(this->vertexBuffer);
+      this->destroyBuffer(this->indexBuffer);
+      this->destroyBuffer(this->instanceBuffer);
+
+      for (auto &b : this->streamedInstanceBuffers)
+        this->destroyBuffer(b);
+      for (auto &b : this->loadingDrawBuffers)
+        this->destroyBuffer(b);
+      if (this->uploading())
+        this->uploadRing.destroy(this->allocator);
+      if (this->frameCommandPool)
+        this->device.destroyCommandPool(this->frameCommandPool);
+
+      for (auto &b : this->captureBuffers)
+        this->destroyBuffer(b);
+      if (this->captureCommandPool)
+        this->device.destroyCommandPool(this->captureCommandPool);
+
+      this->destroyBuffer(this->particleBuffer);
+      for (auto &b : this->simulatedInstanceBuffers)
+        this->destroyBuffer(b);
+      for (auto &s : this->simulatedSems)
+        this->device.destroySemaphore(s);
+      if (this->simulateCommandPool)
+        this->device.destroyCommandPool(this->simulateCommandPool);
+      if (this->simulatePipeline)
+        this->device.destroyPipeline(this->simulatePipeline);
+      if (this->simulatePipelineLayout)
+        this->device.destroyPipelineLayout(this->simulatePipelineLayout);
+      if (this->simulateDescriptorPool)
+        this->device.destroyDescriptorPool(this->simulateDescriptorPool);
+      if (this->simulateSetLayout)
+        this->device.destroyDescriptorSetLayout(this->simulateSetLayout);
+
+      for (auto &b : this->culledInstanceBuffers)
+        this->destroyBuffer(b);
+      for (auto &b : this->drawCommandBuffers)
+        this->destroyBuffer(b);
+      this->destroyBuffer(this->drawCommandTemplate);
+      if (this->cullPipeline)
+        this->device.destroyPipeline(this->cullPipeline);
+      if (this->cullPipelineLayout)
+        this->device.destroyPipelineLayout(this->cullPipelineLayout);
+      if (this->cullDescriptorPool)
+        this->device.destroyDescriptorPool(this->cullDescriptorPool);
+      if (this->cullSetLayout)
+        this->device.destroyDescriptorSetLayout(this->cullSetLayout);
+
+      for (auto &b : this->sortedInstanceBuffers)
+        this->destroyBuffer(b);
+      for (auto &b : this->sortIndexBuffers)
+        this->destroyBuffer(b);
+      for (auto &b : this->sortHistogramBuffers)
+        this->destroyBuffer(b);
+      for (auto &p : this->sortPipelines)
+        this->device.destroyPipeline(p);
+      if (this->sortPipelineLayout)
+        this->device.destroyPipelineLayout(this->sortPipelineLayout);
+      if (this->sortDescriptorPool)
+        this->device.destroyDescriptorPool(this->sortDescriptorPool);
+      if (this->sortSetLayout)
+        this->device.destroyDescriptorSetLayout(this->sortSetLayout);
+
+      for (auto &p : this->workerPools)
+        this->device.destroyCommandPool(p.pool);
+      for (auto &set : this->spareWorkerPools) {
+        for (auto &p : set)
+          this->device.destroyCommandPool(p.pool);
+      }
+
+      for (auto &p : this->perFramePools)
+        this->device.destroyCommandPool(p);
+
       if (this->commandPool)
         this->device.destroyCommandPool(this->commandPool);
 
+      if (this->pipelineCache) {
+        this->savePipelineCache();
+        this->device.destroyPipelineCache(this->pipelineCache);
+      }
+
+      this->allocator.destroy();
+
       this->device.destroy();
 
     }
 
     if (this->instance) {
 
-      this->instance.destroySurfaceKHR(this->surface);
+      if (this->surface)
+        this->instance.destroySurfaceKHR(this->surface);
       if (this->messenger)
         this->instance.destroyDebugUtilsMessengerEXT(this->messenger, nullptr, this->loader);
       this->instance.destroy();
@@ -100,14 +757,22 @@ public:
 
     }
 
-    glfwTerminate();
+    if (!this->headless)
+      glfwTerminate();
   }
 
   void cleanupSwapchain() {
     if (this->device) {
 
-      if (this->pipeline)
-        this->device.destroyPipeline(this->pipeline);
+      for (auto &p : this->pipelines)
+        this->device.destroyPipeline(p.second);
+      this->pipelines.clear();
+      this->pipeline = vk::Pipeline();
+
+      for (auto &p : this->depthPipelines)
+        this->device.destroyPipeline(p.second);
+      this->depthPipelines.clear();
+      this->depthPipeline = vk::Pipeline();
 
       if (this->pipelineLayout)
         this->device.destroyPipelineLayout(this->pipelineLayout);
@@ -119,6 +784,9 @@ public:
 
       }
 
+      // The worker pools own these.
+      this->secondaryCommandBuffers.clear();
+
       for (auto &f : this->framebuffers) {
         this->device.destroyFramebuffer(f);
       }
@@ -126,50 +794,506 @@ public:
         this->device.destroyImageView(i);
       }
 
+      this->destroyRenderTargets(this->renderTargets);
+      this->destroyRenderTarget(this->depthBuffer);
+
       if (this->renderpass)
         this->device.destroyRenderPass(this->renderpass);
 
       if (this->swapchain)
         this->device.destroySwapchainKHR(this->swapchain, nullptr, this->loader);
 
+      for (auto &i : this->offscreenImages) {
+        this->device.destroyImage(i);
+      }
+      for (auto &a : this->offscreenAllocations) {
+        this->allocator.free(a);
+      }
+
     }
 
   }
 
+  // Frames already in flight keep using the old swapchain, framebuffers and
+  // command buffers, so they're retired rather than destroyed, and nothing
+  // has to wait for the device to go idle. The pipeline's viewport and
+  // scissor are dynamic, so it and the render pass only need replacing if
+  // the surface format changes.
   void recreateSwapchain() {
-    this->device.waitIdle();
+    if (0 == this->framebufferWidth || 0 == this->framebufferHeight) {
+      this->swapchainStale = true;
+      return;
+    }
+    this->swapchainStale = false;
+    this->framebufferResized = false;
 
-    this->cleanupSwapchain();
+    // The time since the last present includes however long the window was
+    // being resized or minimised for.
+    this->lastPresent = Clock::time_point();
 
+    // The new images have nothing in them yet.
+    this->redraw = true;
+
+    RetiredResources retired;
+    retired.frame = this->submittedFrames;
+    retired.swapchain = this->swapchain;
+    retired.imageViews = this->imageViews;
+    retired.framebuffers = this->framebuffers;
+    retired.commandBuffers = this->commandBuffers;
+    this->retireWorkerPools(retired);
+
+    vk::Format oldFormat = this->swapchainFormat;
     this->initSwapchain();
+    if (this->swapchainFormat != oldFormat) {
+      // A reload may be using the render pass that's about to be retired.
+      // Its pipeline will be thrown away, since it won't match the new one.
+      if (this->compiler.running())
+        this->compiler.wait();
+
+      retired.renderpass = this->renderpass;
+      for (auto &p : this->pipelines)
+        retired.pipelines.push_back(p.second);
+      for (auto &p : this->depthPipelines)
+        retired.pipelines.push_back(p.second);
+      this->pipelines.clear();
+      this->depthPipelines.clear();
+      this->initRenderPass();
+      this->initPipeline();
+    }
     this->initImageViews();
-    this->initRenderPass();
-    this->initPipeline();
+    if (this->depthTesting) {
+      retired.renderTargets.push_back(this->depthBuffer);
+      this->initDepthBuffer();
+    }
     this->initFramebuffers();
+    if (this->dynamicResolution) {
+      retired.renderTargets.insert
+        (retired.renderTargets.end(), this->renderTargets.begin(), this->renderTargets.end());
+      this->initRenderTargets();
+    }
     this->initCommandBuffers();
+
+    this->retired.push_back(retired);
+  }
+
+  // Destroys the retired resources that no pending frame can be using, or
+  // all of them once the device is idle.
+  void releaseRetired(bool all) {
+    auto it = this->retired.begin();
+    while (it != this->retired.end()) {
+      if (!all && it->frame > this->completedFrames) {
+        ++it;
+        continue;
+      }
+
+      if (!it->commandBuffers.empty())
+        this->device.freeCommandBuffers(this->commandPool, it->commandBuffers);
+      if (!it->workerPools.empty()) {
+        for (auto &p : it->workerPools) {
+          this->device.resetCommandPool(p.pool, {});
+          p.next = 0;
+        }
+        this->spareWorkerPools.push_back(it->workerPools);
+      }
+      for (auto &f : it->framebuffers)
+        this->device.destroyFramebuffer(f);
+      for (auto &i : it->imageViews)
+        this->device.destroyImageView(i);
+      for (auto &p : it->pipelines)
+        this->device.destroyPipeline(p);
+      if (it->renderpass)
+        this->device.destroyRenderPass(it->renderpass);
+      if (it->swapchain)
+        this->device.destroySwapchainKHR(it->swapchain, nullptr, this->loader);
+      this->destroyRenderTargets(it->renderTargets);
+
+      it = this->retired.erase(it);
+    }
   }
 
+  // Main thread only.
   bool shouldClose() const {
+    if (this->headless)
+      return false;
     return glfwWindowShouldClose(this->window);
   }
 
-  void drawFrame() {
+  // Whether there's nothing to draw to until the window is restored.
+  bool minimised() const {
+    return this->swapchainStale;
+  }
+
+  // Called on the main thread, to pass an event to the render thread. If the
+  // render thread has fallen so far behind that the queue is full, the
+  // event is dropped.
+  void postEvent(const Event &event) {
+    if (!this->events.push(event))
+      ++this->eventsDropped;
+    this->wake();
+  }
+
+  // Call before rendering starts.
+  void setOnDemand(bool onDemand) {
+    this->onDemand = onDemand;
+  }
+
+  // Wakes the render thread if it's waiting for something to change. Can
+  // be called from any thread.
+  void wake() {
+    if (!this->onDemand)
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(this->wakeMutex);
+      this->woken = true;
+    }
+    this->wakeCondition.notify_one();
+  }
+
+  // Whether a frame drawn now would differ from the last one drawn, after
+  // handling whatever has happened since. Render thread only.
+  bool needsRedraw() {
+    this->processEvents();
+    this->pollShaderReload();
+    // A minimised window has nothing to draw to until it's resized.
+    if (this->swapchainStale && !this->framebufferResized)
+      return false;
+    return this->redraw || this->streaming || this->simulating || this->loading() ||
+      this->framebufferResized;
+  }
+
+  // Sleeps until wake is called. While shaders are being watched, which
+  // has to be polled for, it doesn't sleep for longer than the polling
+  // interval.
+  void waitForChange() {
+    std::unique_lock<std::mutex> lock(this->wakeMutex);
+    auto woken = [&]() { return this->woken; };
+    if (this->compiler.running()) {
+      this->wakeCondition.wait_for
+        (lock, std::chrono::duration<double, std::milli>(this->SHADER_POLL_MS), woken);
+    } else {
+      this->wakeCondition.wait(lock, woken);
+    }
+    this->woken = false;
+  }
+
+  // Handles everything the main thread has sent since the last frame.
+  void processEvents() {
+    if (this->resizedTo.take(this->framebufferWidth, this->framebufferHeight)) {
+      this->framebufferResized = true;
+      this->redraw = true;
+    }
+
+    Event event;
+    while (this->events.pop(event)) {
+      switch (event.type) {
+      case Event::Key:
+        this->handleKey(event);
+        break;
+      }
+    }
+
+    if (this->viewChanged) {
+      this->viewChanged = false;
+      this->redraw = true;
+      this->rerecord();
+    }
+  }
+
+  // The arrow keys move the view, and + and - zoom it.
+  void handleKey(const Event &event) {
+    if (GLFW_RELEASE == event.action)
+      return;
+
+    View view = this->view;
+    float step = 0.1f / view.zoom;
+    switch (event.key) {
+    case GLFW_KEY_LEFT: view.center[0] -= step; break;
+    case GLFW_KEY_RIGHT: view.center[0] += step; break;
+    case GLFW_KEY_UP: view.center[1] -= step; break;
+    case GLFW_KEY_DOWN: view.center[1] += step; break;
+    case GLFW_KEY_EQUAL:
+    case GLFW_KEY_KP_ADD:
+      view.zoom *= 1.25f;
+      break;
+    case GLFW_KEY_MINUS:
+    case GLFW_KEY_KP_SUBTRACT:
+      view.zoom /= 1.25f;
+      break;
+    default:
+      return;
+    }
+
+    this->view = view;
+    this->viewChanged = true;
+
+    if (Clock::time_point() == this->pendingInput) {
+      this->pendingInput = event.time;
+      this->pendingInputQueued = millisecondsSince(event.time);
+    }
+  }
+
+  // Re-records the command buffers for the next frame.
+  void rerecord() {
+    RetiredResources retired;
+    retired.frame = this->submittedFrames;
+    this->rerecordCommandBuffers(retired);
+    this->retired.push_back(retired);
+  }
+
+  // Replaces the recorded command buffers, retiring the old ones until the
+  // frames using them are done. Does nothing when recording every frame.
+  void rerecordCommandBuffers(RetiredResources &retired) {
+    if (this->recordEveryFrame)
+      return;
+
+    retired.commandBuffers = this->commandBuffers;
+    this->retireWorkerPools(retired);
+    this->initCommandBuffers();
+  }
+
+  // The number of frames that the GPU is known to have finished.
+  uint64_t framesCompleted() const {
+    return this->completedFrames;
+  }
+
+  // Waits for every submitted frame to finish.
+  void finish() {
+    assert(this->device);
+    assert(this->inFlightFences.size() == this->FRAMES_IN_FLIGHT);
+
+    this->device.waitForFences
+      (this->inFlightFences.size(), this->inFlightFences.data(),
+       true,
+       std::numeric_limits<uint64_t>::max());
+
+    for (auto &serial : this->frameSerials)
+      this->completedFrames = std::max(this->completedFrames, serial);
+
+    if (this->capturing) {
+      for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i)
+        this->handOffCapture(i);
+      this->captureWriter.stop();
+    }
+  }
+
+  void waitForFrame(uint32_t frame) {
+    this->device.waitForFences
+      (1, &this->inFlightFences[frame],
+       true,
+       std::numeric_limits<uint64_t>::max());
+
+    this->completedFrames = std::max(this->completedFrames, this->frameSerials[frame]);
+
+    this->readQueries(frame);
+    this->adjustRenderScale(frame);
+    this->handOffCapture(frame);
+
+    if (this->recordEveryFrame)
+      this->resetFrameCommands(frame);
+  }
+
+  // Picks up the query results of the last frame submitted from a slot.
+  // Only called once the slot's fence has signalled, so this never waits.
+  void readQueries(uint32_t frame) {
+    if (0 == this->frameSerials[frame] ||
+        this->gpuStats.frame == this->frameSerials[frame])
+      return;
+
+    GpuFrameStats stats;
+    stats.frame = this->frameSerials[frame];
+
+    if (!this->timestampPools.empty()) {
+      std::vector<uint64_t> timestamps(this->timestampCount());
+      vk::Result result =
+        this->device.getQueryPoolResults
+          (this->timestampPools[frame],
+           0, timestamps.size(),
+           timestamps.size() * sizeof(uint64_t), timestamps.data(),
+           sizeof(uint64_t),
+           vk::QueryResultFlagBits::e64);
+
+      if (vk::Result::eSuccess == result) {
+        stats.timed = true;
+        auto elapsed = [&](size_t from, size_t to) -> double {
+          uint64_t ticks = (timestamps[to] - timestamps[from]) & this->timestampMask;
+          return ticks * this->timestampPeriod / 1e6;
+        };
+
+        stats.compute = elapsed(0, 1);
+        stats.renderPass = elapsed(1, timestamps.size() - 1);
+        for (uint32_t i = 0; i < this->sliceCount; ++i) {
+          stats.slices.push_back(elapsed(1 + i, 2 + i));
+        }
+      }
+    }
+
+    if (!this->statisticsPools.empty()) {
+      uint64_t statistics[3];
+      vk::Result result =
+        this->device.getQueryPoolResults
+          (this->statisticsPools[frame],
+           0, 1,
+           sizeof(statistics), statistics,
+           sizeof(statistics),
+           vk::QueryResultFlagBits::e64);
+
+      // Results are ordered by flag bit, not by the order they were asked for.
+      if (vk::Result::eSuccess == result) {
+        stats.counted = true;
+        stats.vertexInvocations = statistics[0];
+        stats.clippingPrimitives = statistics[1];
+        stats.fragmentInvocations = statistics[2];
+      }
+    }
+
+    this->gpuStats = stats;
+  }
+
+  // The newest GPU measurements available. Lags drawFrame by about
+  // FRAMES_IN_FLIGHT frames.
+  const GpuFrameStats &gpuFrameStats() const {
+    return this->gpuStats;
+  }
+
+  // Whether frames cull or sort instances on the GPU before rendering them.
+  bool computesBeforeRendering() const {
+    return this->culling || this->sorting;
+  }
+
+  // Picks the render scale for the coming frames from the GPU time of the
+  // slot's last frame, which readQueries has just read. Fill-bound work
+  // costs about the same per pixel, so the frame's time over the fraction
+  // of the pixels it drew estimates what a full-resolution frame would
+  // take, and the scale that fits the budget follows from that.
+  void adjustRenderScale(uint32_t frame) {
+    if (!this->dynamicResolution ||
+        !this->gpuStats.timed ||
+        this->gpuStats.frame != this->frameSerials[frame] ||
+        this->gpuStats.renderPass <= 0)
+      return;
+
+    float drawn = this->frameScales[frame];
+    double cost = this->gpuStats.renderPass / (drawn * drawn);
+    this->fullResolutionCost =
+      0 == this->fullResolutionCost ?
+        cost :
+        this->fullResolutionCost + (cost - this->fullResolutionCost) * this->SMOOTHING;
+
+    float wanted = std::sqrt(this->resolutionBudget / this->fullResolutionCost);
+    wanted = std::min(std::max(wanted, this->minRenderScale), 1.0f);
+
+    bool atLimit = wanted == this->minRenderScale || wanted == 1;
+    if (wanted == this->renderScale ||
+        (std::fabs(wanted - this->renderScale) < this->RENDER_SCALE_STEP && !atLimit))
+      return;
+
+    this->renderScale = wanted;
+    this->updateRenderExtent();
+    this->rerecord();
+  }
+
+  void updateRenderExtent() {
+    float scale = this->currentRenderScale();
+    this->renderExtent =
+      vk::Extent2D
+        (std::max<uint32_t>(1, std::lround(this->swapchainExtent.width * scale)),
+         std::max<uint32_t>(1, std::lround(this->swapchainExtent.height * scale)));
+  }
+
+  // Makes a new overlay, with the frame statistics, a couple of times a
+  // second. The main thread shows it in the window title.
+  void updateOverlay() {
+    assert(this->window);
+
+    if (millisecondsSince(this->overlayUpdated) < 500)
+      return;
+    this->overlayUpdated = Clock::now();
+
+    std::ostringstream text;
+    text.precision(3);
+    text << this->title
+         << " | cpu " << this->timings.total << " ms";
+    if (this->gpuStats.timed) {
+      text << " | gpu " << this->gpuStats.renderPass << " ms";
+      if (this->computesBeforeRendering())
+        text << " + " << this->gpuStats.compute << " ms compute";
+    }
+    if (this->inputLatency >= 0)
+      text << " | input to present " << this->inputLatency << " ms";
+    if (this->gpuStats.counted)
+      text << " | " << this->gpuStats.vertexInvocations << " vertices"
+           << ", " << this->gpuStats.clippingPrimitives << " primitives"
+           << ", " << this->gpuStats.fragmentInvocations << " fragments";
+    if (uint64_t dropped = this->eventsDropped.load())
+      text << " | " << dropped << " input events dropped";
+
+    {
+      std::lock_guard<std::mutex> lock(this->overlayMutex);
+      this->overlayText = text.str();
+      this->overlayChanged = true;
+    }
+    glfwPostEmptyEvent();
+  }
+
+  // Main thread only.
+  void showOverlay() {
+    std::lock_guard<std::mutex> lock(this->overlayMutex);
+    if (!this->overlayChanged)
+      return;
+    glfwSetWindowTitle(this->window, this->overlayText.c_str());
+    this->overlayChanged = false;
+  }
+
+  // CPU timings for the last frame that drawFrame submitted.
+  const FrameTimings &frameTimings() const {
+    return this->timings;
+  }
+
+  // Returns whether a frame was submitted.
+  bool drawFrame() {
+    this->pollShaderReload();
+
+    if (this->headless) {
+      this->processEvents();
+      return this->drawOffscreenFrame();
+    }
+
     assert(this->device);
     assert(this->imageAvailableSems.size() == this->FRAMES_IN_FLIGHT);
     assert(this->renderFinishedSems.size() == this->FRAMES_IN_FLIGHT);
     assert(this->inFlightFences.size() == this->FRAMES_IN_FLIGHT);
     assert(this->swapchain);
-    assert(!this->commandBuffers.empty());
+    assert(!this->commandBuffers.empty() || this->recordEveryFrame);
     assert(this->graphicsQueue);
     assert(this->presentQueue);
 
+    if (this->swapchainStale) {
+      // Only a resize can make it usable again.
+      this->processEvents();
+      this->recreateSwapchain();
+      if (this->swapchainStale)
+        return false;
+    }
+
     uint32_t currentFrame = this->currentFrame;
+    FrameTimings timings;
+    Clock::time_point frameStart = Clock::now();
 
-    this->device.waitForFences
-      (1, &this->inFlightFences[currentFrame],
-       true,
-       std::numeric_limits<uint64_t>::max());
+    // Before the fence wait and acquire, which under FIFO would otherwise
+    // already have waited out the time pacing is meant to sleep through.
+    this->paceFrame();
+    timings.pacing = millisecondsSince(frameStart);
 
+    Clock::time_point wake = Clock::now();
+    this->waitForFrame(currentFrame);
+    this->releaseRetired(false);
+    timings.fenceWait = millisecondsSince(wake);
+
+    // After pacing, so the frame shows the newest input it can.
+    this->processEvents();
+
+    Clock::time_point acquireStart = Clock::now();
     uint32_t ix;
     try {
       vk::ResultValue<uint32_t> o_ix =
@@ -180,119 +1304,844 @@ public:
           vk::Fence(),
           this->loader);
       ix = o_ix.value;
+      if (vk::Result::eSuboptimalKHR == o_ix.result)
+        this->framebufferResized = true;
     } catch (vk::OutOfDateKHRError) {
       this->recreateSwapchain();
-      return;
+      return false;
+    }
+    timings.acquire = millisecondsSince(acquireStart);
+
+    // Only once there's an image to render to, so that an out of date
+    // swapchain can't leave the upload's semaphore signalled and unwaited.
+    Clock::time_point uploadStart = Clock::now();
+    vk::Semaphore instancesReady = this->prepareInstances(currentFrame);
+    timings.upload = millisecondsSince(uploadStart);
+
+    if (this->recordEveryFrame) {
+      Clock::time_point recordStart = Clock::now();
+      this->recordFrame(currentFrame, ix);
+      timings.record = millisecondsSince(recordStart);
     }
 
-    vk::PipelineStageFlags waitMask = vk::PipelineStageFlagBits::eColorAttachmentOutput;
-    vk::SubmitInfo submitInfo
-      (1, &this->imageAvailableSems[currentFrame], &waitMask,
-       1, &this->commandBuffers[ix],
-       1, &this->renderFinishedSems[currentFrame]);
+    Clock::time_point captureStart = Clock::now();
+    this->captureFrame(currentFrame, this->swapchainImages[ix]);
+    timings.capture = millisecondsSince(captureStart);
 
-    this->device.resetFences(1, &this->inFlightFences[currentFrame]);
-    this->graphicsQueue.submit(1, &submitInfo, this->inFlightFences[currentFrame]);
+    Clock::time_point submitStart = Clock::now();
+    this->submitFrame
+      (currentFrame,
+       this->commandBufferFor(currentFrame, ix),
+       this->imageAvailableSems[currentFrame],
+       instancesReady,
+       this->renderFinishedSems[currentFrame]);
+    timings.submit = millisecondsSince(submitStart);
 
+    Clock::time_point presentStart = Clock::now();
     vk::PresentInfoKHR presentInfo
       (1, &this->renderFinishedSems[currentFrame],
        1, &this->swapchain,
        &ix);
 
-    this->presentQueue.presentKHR(presentInfo, this->loader);
+    try {
+      if (vk::Result::eSuboptimalKHR == this->presentQueue.presentKHR(presentInfo, this->loader))
+        this->framebufferResized = true;
+    } catch (vk::OutOfDateKHRError) {
+      this->framebufferResized = true;
+    }
+    timings.present = millisecondsSince(presentStart);
+
+    Clock::time_point presented = Clock::now();
+    this->measurePresent(wake, presented, timings.fenceWait + timings.acquire);
+    this->redraw = false;
+
+    if (Clock::time_point() != this->pendingInput) {
+      timings.inputQueued = this->pendingInputQueued;
+      timings.inputToPresent =
+        std::chrono::duration<double, std::milli>(presented - this->pendingInput).count();
+      this->inputLatency = timings.inputToPresent;
+      this->pendingInput = Clock::time_point();
+    }
 
     this->currentFrame = (this->currentFrame + 1) % this->FRAMES_IN_FLIGHT;
 
-  }
+    if (this->framebufferResized)
+      this->recreateSwapchain();
 
-  void initWindow(uint32_t w, uint32_t h, const char *title) {
-    if (GLFW_FALSE == glfwInit()) {
-      throw std::runtime_error("failed to initialize glfw");
-    }
+    timings.total = millisecondsSince(frameStart);
+    this->timings = timings;
 
-    if (GLFW_FALSE == glfwVulkanSupported()) {
-      throw std::runtime_error("vulkan not supported");
-    }
+    return true;
+  }
 
-    this->width = w;
-    this->height = h;
-    this->title = title;
+  // Sleeps until the next frame has just enough time left to be presented
+  // on time, by the measurements so far.
+  void paceFrame() {
+    double interval = this->pacingTarget();
+    if (!this->pacing || 0 == interval || Clock::time_point() == this->lastPresent)
+      return;
 
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    this->window = glfwCreateWindow(w, h, title, nullptr, nullptr);
+    // A FIFO present that's a little late waits for a whole extra refresh,
+    // so leave some room; any other present is just a little late.
+    bool fifo =
+      vk::PresentModeKHR::eFifo == this->presentMode ||
+      vk::PresentModeKHR::eFifoRelaxed == this->presentMode;
+    double wait =
+      interval - this->frameWork - (fifo ? this->PACING_MARGIN_MS : 0) -
+      millisecondsSince(this->lastPresent);
+    if (wait > 0)
+      std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(wait));
   }
 
-  void initInstance() {
-    assert(this->title);
-    assert(this->window);
+  // blocked is how long the frame waited for its fence and in acquire,
+  // which isn't work it has to leave time for.
+  void measurePresent(Clock::time_point wake, Clock::time_point presented, double blocked) {
+    auto smooth = [&](double &average, double sample) {
+      average = 0 == average ? sample : average + (sample - average) * this->SMOOTHING;
+    };
+
+    if (Clock::time_point() != this->lastPresent)
+      smooth(this->presentInterval,
+             std::chrono::duration<double, std::milli>(presented - this->lastPresent).count());
+    smooth(this->frameWork,
+           std::chrono::duration<double, std::milli>(presented - wake).count() - blocked);
+    this->lastPresent = presented;
+  }
 
-    std::vector<const char*> layers =
-      { "VK_LAYER_LUNARG_standard_validation"
-      };
+  // Each frame-in-flight slot owns one offscreen image, so the slot's fence
+  // is all that guards reuse of its image and command buffer.
+  bool drawOffscreenFrame() {
+    assert(this->device);
+    assert(this->imageAvailableSems.empty() && this->renderFinishedSems.empty());
+    assert(this->inFlightFences.size() == this->FRAMES_IN_FLIGHT);
+    assert(this->recordEveryFrame ||
+           this->commandBuffers.size() == this->FRAMES_IN_FLIGHT * this->framebuffers.size());
+    assert(this->graphicsQueue);
 
-    uint32_t extCount;
-    const char **_exts = glfwGetRequiredInstanceExtensions(&extCount);
-    std::vector<const char*> requiredExts(_exts, _exts + extCount);
+    uint32_t currentFrame = this->currentFrame;
+    FrameTimings timings;
+    Clock::time_point frameStart = Clock::now();
 
-    requiredExts.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+    this->waitForFrame(currentFrame);
+    timings.fenceWait = millisecondsSince(frameStart);
 
-    vk::ApplicationInfo appInfo
-      (this->title,
-       VK_MAKE_VERSION(1,0,0),
-       "No engine",
-       VK_MAKE_VERSION(1,0,0),
-       VK_MAKE_VERSION(1,0,82)
-       );
+    Clock::time_point uploadStart = Clock::now();
+    vk::Semaphore instancesReady = this->prepareInstances(currentFrame);
+    timings.upload = millisecondsSince(uploadStart);
 
-    vk::InstanceCreateInfo instanceInfo
-      ({},
-       &appInfo,
-       layers.size(), layers.data(),
-       requiredExts.size(), requiredExts.data()
-       );
+    if (this->recordEveryFrame) {
+      Clock::time_point recordStart = Clock::now();
+      this->recordFrame(currentFrame, currentFrame);
+      timings.record = millisecondsSince(recordStart);
+    }
 
-    this->instance = vk::createInstance(instanceInfo);
+    Clock::time_point captureStart = Clock::now();
+    this->captureFrame(currentFrame, this->offscreenImages[currentFrame]);
+    timings.capture = millisecondsSince(captureStart);
 
-    this->loader = vk::DispatchLoaderDynamic(instance);
-  }
+    Clock::time_point submitStart = Clock::now();
+    this->submitFrame
+      (currentFrame,
+       this->commandBufferFor(currentFrame, currentFrame),
+       vk::Semaphore(),
+       instancesReady,
+       vk::Semaphore());
+    timings.submit = millisecondsSince(submitStart);
 
-  void initDebugMessenger() {
-    assert(this->instance);
+    this->currentFrame = (this->currentFrame + 1) % this->FRAMES_IN_FLIGHT;
 
-    vk::DebugUtilsMessengerCreateInfoEXT messengerInfo
-      ({},
+    timings.total = millisecondsSince(frameStart);
+    this->timings = timings;
 
-       vk::DebugUtilsMessageSeverityFlagBitsEXT::eError |
-       vk::DebugUtilsMessageSeverityFlagBitsEXT::eVerbose |
-       vk::DebugUtilsMessageSeverityFlagBitsEXT::eWarning,
+    return true;
+  }
 
-       vk::DebugUtilsMessageTypeFlagBitsEXT::eGeneral |
-       vk::DebugUtilsMessageTypeFlagBitsEXT::ePerformance |
-       vk::DebugUtilsMessageTypeFlagBitsEXT::eValidation,
+  // Submits a frame's command buffer. Any of the semaphores may be null.
+  void submitFrame
+    (uint32_t frame,
+     vk::CommandBuffer commandBuffer,
+     vk::Semaphore imageAvailable,
+     vk::Semaphore instancesReady,
+     vk::Semaphore renderFinished) {
+
+    std::vector<vk::Semaphore> waitSems;
+    std::vector<vk::PipelineStageFlags> waitMasks;
+    if (imageAvailable) {
+      waitSems.push_back(imageAvailable);
+      waitMasks.push_back(vk::PipelineStageFlagBits::eColorAttachmentOutput);
+    }
+    if (instancesReady) {
+      waitSems.push_back(instancesReady);
+      waitMasks.push_back(this->instanceReadStage());
+    }
 
-       messengerCallback,
-       nullptr
-       );
+    std::vector<vk::CommandBuffer> commandBuffers;
+    if (instancesReady && this->uploading() && this->uploadRing.hasAcquires())
+      commandBuffers.push_back(this->acquireCommandBuffers[frame]);
+    commandBuffers.push_back(commandBuffer);
+    if (this->capturing && this->pendingCaptures[frame].pending)
+      commandBuffers.push_back(this->captureCommandBuffers[frame]);
 
-    this->messenger =
-      instance.createDebugUtilsMessengerEXT(messengerInfo, nullptr, this->loader);
+    vk::SubmitInfo submitInfo
+      (waitSems.size(), waitSems.data(), waitMasks.data(),
+       commandBuffers.size(), commandBuffers.data(),
+       renderFinished ? 1 : 0, &renderFinished);
+
+    this->device.resetFences(1, &this->inFlightFences[frame]);
+    this->graphicsQueue.submit(1, &submitInfo, this->inFlightFences[frame]);
+    this->frameSerials[frame] = ++this->submittedFrames;
+    if (this->dynamicResolution)
+      this->frameScales[frame] = this->renderScale;
   }
 
-  void getPhysicalDevice() {
-    assert(this->instance);
+  // Records the copy of the frame's image into a free readback buffer, for
+  // submitFrame to submit after the frame, unless the frame is dropped.
+  void captureFrame(uint32_t frame, vk::Image image) {
+    if (!this->capturing)
+      return;
 
-    std::vector<vk::PhysicalDevice> devices = this->instance.enumeratePhysicalDevices();
+    Clock::time_point start = Clock::now();
+    auto smooth = [&](double sample) {
+      this->captureCost += (sample - this->captureCost) * this->SMOOTHING;
+    };
+
+    bool bgra =
+      vk::Format::eB8G8R8A8Unorm == this->swapchainFormat ||
+      vk::Format::eB8G8R8A8Srgb == this->swapchainFormat;
+    bool rgba =
+      vk::Format::eR8G8B8A8Unorm == this->swapchainFormat ||
+      vk::Format::eR8G8B8A8Srgb == this->swapchainFormat;
+
+    uint32_t slot;
+    if ((!bgra && !rgba) ||
+        this->captureCost > this->captureBudget ||
+        !this->captureWriter.accepts(this->swapchainExtent.width, this->swapchainExtent.height) ||
+        !this->captureWriter.reserve(slot)) {
+      ++this->framesDropped;
+      smooth(0);
+      return;
+    }
 
-    if (devices.empty()) {
-      throw std::runtime_error("no physical devices");
+    vk::DeviceSize size =
+      (vk::DeviceSize) this->swapchainExtent.width * this->swapchainExtent.height * 4;
+    Buffer &buffer = this->captureBuffers[slot];
+    if (buffer.size < size) {
+      // It's free, so nothing is using it.
+      this->destroyBuffer(buffer);
+      buffer =
+        this->createBuffer
+          (size,
+           vk::BufferUsageFlagBits::eTransferDst,
+           vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+           vk::MemoryPropertyFlagBits::eHostCached);
     }
 
-    this->physicalDevice = devices[0];
-  }
+    // Rendered images end up ready to present, or ready to copy if there's
+    // no window.
+    vk::ImageLayout layout =
+      this->headless ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR;
+    vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+
+    vk::CommandBuffer c = this->captureCommandBuffers[frame];
+    c.reset({});
+    c.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr));
+
+    // With dynamic resolution, the image was last written by a blit.
+    vk::ImageMemoryBarrier toCopy
+      (vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eTransferWrite,
+       vk::AccessFlagBits::eTransferRead,
+       layout,
+       vk::ImageLayout::eTransferSrcOptimal,
+       VK_QUEUE_FAMILY_IGNORED,
+       VK_QUEUE_FAMILY_IGNORED,
+       image,
+       range);
+    c.pipelineBarrier
+      (vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eTransfer,
+       vk::PipelineStageFlagBits::eTransfer,
+       {},
+       nullptr,
+       nullptr,
+       toCopy);
+
+    vk::BufferImageCopy region
+      (0, 0, 0,
+       vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1),
+       vk::Offset3D(0, 0, 0),
+       vk::Extent3D(this->swapchainExtent.width, this->swapchainExtent.height, 1));
+    c.copyImageToBuffer(image, vk::ImageLayout::eTransferSrcOptimal, buffer.buffer, region);
+
+    vk::ImageMemoryBarrier toPresent
+      (vk::AccessFlagBits::eTransferRead,
+       {},
+       vk::ImageLayout::eTransferSrcOptimal,
+       layout,
+       VK_QUEUE_FAMILY_IGNORED,
+       VK_QUEUE_FAMILY_IGNORED,
+       image,
+       range);
+    vk::BufferMemoryBarrier toHost
+      (vk::AccessFlagBits::eTransferWrite,
+       vk::AccessFlagBits::eHostRead,
+       VK_QUEUE_FAMILY_IGNORED,
+       VK_QUEUE_FAMILY_IGNORED,
+       buffer.buffer,
+       0,
+       VK_WHOLE_SIZE);
+    c.pipelineBarrier
+      (vk::PipelineStageFlagBits::eTransfer,
+       vk::PipelineStageFlagBits::eBottomOfPipe | vk::PipelineStageFlagBits::eHost,
+       {},
+       nullptr,
+       toHost,
+       toPresent);
+
+    c.end();
+
+    PendingCapture &capture = this->pendingCaptures[frame];
+    capture.pending = true;
+    capture.frame.number = this->framesCaptured++;
+    capture.frame.slot = slot;
+    capture.frame.pixels = (const uint8_t*) buffer.allocation.mapped;
+    capture.frame.width = this->swapchainExtent.width;
+    capture.frame.height = this->swapchainExtent.height;
+    capture.frame.bgra = bgra;
+
+    smooth(millisecondsSince(start));
+  }
+
+  // Once the frame's fence has signalled, gives its capture to the writer.
+  void handOffCapture(uint32_t frame) {
+    if (!this->capturing || !this->pendingCaptures[frame].pending)
+      return;
+
+    this->captureWriter.write(this->pendingCaptures[frame].frame);
+    this->pendingCaptures[frame].pending = false;
+  }
+
+  // Makes the frame's instances, if they change from frame to frame.
+  // Returns the semaphore to wait on before reading them, or null if there
+  // isn't one.
+  vk::Semaphore prepareInstances(uint32_t frame) {
+    if (this->simulating)
+      return this->simulateFrame(frame);
+    if (this->streaming)
+      return this->streamFrame(frame);
+    vk::Semaphore loaded = this->loadSceneChunks(frame);
+    this->writeLoadingDraws(frame);
+    return loaded;
+  }
+
+  // Brings the frame's draw commands up to date with what's loaded. The
+  // frame's fence has signalled, so nothing is reading them.
+  void writeLoadingDraws(uint32_t frame) {
+    if (!this->loadingIndirect || this->loadedInstances == this->loadingDrawCounts[frame])
+      return;
+
+    uint32_t loaded = this->loadedInstances;
+    vk::DrawIndexedIndirectCommand *commands =
+      (vk::DrawIndexedIndirectCommand*) this->loadingDrawBuffers[frame].allocation.mapped;
+    for (size_t i = 0; i < this->draws.size(); ++i) {
+      const Draw &d = this->draws[i];
+      commands[i] =
+        vk::DrawIndexedIndirectCommand
+          (this->indexCount,
+           d.firstInstance < loaded ? std::min(d.instanceCount, loaded - d.firstInstance) : 0,
+           0, 0, d.firstInstance);
+    }
+    this->loadingDrawCounts[frame] = loaded;
+  }
+
+  // Submits the frame's simulation step to the compute queue. The slot's
+  // fence has signalled, so the frame that last read its instances is done.
+  vk::Semaphore simulateFrame(uint32_t frame) {
+    vk::SubmitInfo submitInfo
+      (0, nullptr, nullptr,
+       1, &this->simulateCommandBuffers[frame],
+       1, &this->simulatedSems[frame]);
+    this->computeQueue.submit(1, &submitInfo, vk::Fence());
+    return this->simulatedSems[frame];
+  }
+
+  // Writes this frame's instances straight into the upload ring and submits
+  // the copy to the transfer queue. Returns the semaphore to wait on before
+  // reading them, or null when not streaming.
+  vk::Semaphore streamFrame(uint32_t frame) {
+    if (!this->streaming)
+      return vk::Semaphore();
+
+    this->uploadRing.beginFrame(frame);
+
+    if (!this->streamSource.empty()) {
+      vk::DeviceSize size = this->streamSource.size() * sizeof(Instance);
+      Instance *instances =
+        (Instance*) this->uploadRing.reserve
+          (this->streamedInstanceBuffers[frame].buffer, 0, size);
+
+      // The ring holds more than FRAMES_IN_FLIGHT frames of instances, so
+      // this only fails if the GPU has fallen far behind.
+      if (!instances) {
+        throw std::runtime_error("upload ring is full");
+      }
+
+      animateInstances
+        (this->streamSource.data(), instances, this->streamSource.size(),
+         this->submittedFrames / 60.0f);
+    }
+
+    return this->submitUploads(frame);
+  }
+
+  // Copies the next chunks of the scene file into instanceBuffer, up to the
+  // load budget but always at least one chunk, and submits the copies to
+  // the transfer queue. Returns the semaphore to wait on before drawing
+  // them, or null once everything has been loaded.
+  vk::Semaphore loadSceneChunks(uint32_t frame) {
+    if (!this->loading())
+      return vk::Semaphore();
+
+    this->uploadRing.beginFrame(frame);
+
+    const SceneFile &file = *this->sceneFile;
+    vk::DeviceSize copied = 0;
+    while (this->nextChunk < file.chunkCount()) {
+      const SceneChunk &chunk = file.chunk(this->nextChunk);
+      vk::DeviceSize size = chunk.instanceCount * sizeof(Instance);
+      if (copied > 0 && copied + size > this->loadBudget)
+        break;
+      // The ring has room for more than FRAMES_IN_FLIGHT frames' worth, so
+      // this only fails if the GPU has fallen behind; the chunk waits for
+      // the next frame.
+      if (!this->uploadRing.upload
+            (this->instanceBuffer.buffer,
+             (vk::DeviceSize) chunk.firstInstance * sizeof(Instance),
+             file.instances(chunk),
+             size))
+        break;
+
+      copied += size;
+      this->loadedInstances = chunk.firstInstance + chunk.instanceCount;
+      ++this->nextChunk;
+    }
+
+    // Have the next frame's chunks read in from disk while this one draws.
+    vk::DeviceSize prefetched = 0;
+    for (uint32_t i = this->nextChunk; i < file.chunkCount() && prefetched < this->loadBudget; ++i) {
+      file.prefetch(file.chunk(i));
+      prefetched += file.chunk(i).instanceCount * sizeof(Instance);
+    }
+
+    vk::Semaphore uploaded = this->submitUploads(frame);
+    if (!uploaded)
+      return uploaded;
+
+    // Draw the new instances from this frame on. Culling and sorting are
+    // told how many there are as they're recorded.
+    this->redraw = true;
+    if (!this->loadingIndirect || this->culling || this->sorting)
+      this->rerecord();
+
+    return uploaded;
+  }
+
+  // Submits the frame's uploads, and records the graphics family's half of
+  // their ownership transfer into the frame's acquire command buffer.
+  // Returns the semaphore to wait on, or null if there was nothing to copy.
+  vk::Semaphore submitUploads(uint32_t frame) {
+    vk::Semaphore uploaded = this->uploadRing.submit();
+
+    if (uploaded && this->uploadRing.hasAcquires()) {
+      vk::CommandBuffer c = this->acquireCommandBuffers[frame];
+      c.reset({});
+      c.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr));
+      this->uploadRing.recordAcquire(c);
+      c.end();
+    }
+
+    return uploaded;
+  }
+
+  // Captures rendered frames to path, through bufferCount readback buffers.
+  // Call before initSwapchain or initOffscreenTargets.
+  void initCapture
+    (CaptureFormat format,
+     const std::string &path,
+     uint32_t bufferCount,
+     double budget) {
+    assert(this->device);
+    assert(bufferCount > 0);
+
+    this->capturing = true;
+    this->captureBudget = budget;
+    this->captureBuffers = std::vector<Buffer>(bufferCount);
+    this->pendingCaptures = std::vector<PendingCapture>(this->FRAMES_IN_FLIGHT);
+
+    vk::CommandPoolCreateInfo commandPoolInfo
+      (vk::CommandPoolCreateFlagBits::eResetCommandBuffer |
+       vk::CommandPoolCreateFlagBits::eTransient,
+       *this->graphicsQfIx);
+    this->captureCommandPool = this->device.createCommandPool(commandPoolInfo);
+
+    vk::CommandBufferAllocateInfo allocateInfo
+      (this->captureCommandPool,
+       vk::CommandBufferLevel::ePrimary,
+       this->FRAMES_IN_FLIGHT);
+    this->captureCommandBuffers = this->device.allocateCommandBuffers(allocateInfo);
+
+    this->captureWriter.start(format, path, bufferCount);
+  }
+
+  uint64_t capturedFrameCount() {
+    return this->captureWriter.framesWritten();
+  }
+
+  uint64_t droppedFrameCount() const {
+    return this->framesDropped;
+  }
+
+  // Window events that arrived while the render thread's queue was full.
+  uint64_t droppedEventCount() const {
+    return this->eventsDropped.load();
+  }
+
+  // Call before initSwapchain.
+  void setPresentMode(vk::PresentModeKHR mode) {
+    this->presentModeRequested = true;
+    this->requestedPresentMode = mode;
+  }
+
+  // Zero for the default. Clamped to what the surface allows.
+  void setImageCount(uint32_t count) {
+    this->requestedImageCount = count;
+  }
+
+  // rate is the frame rate to pace to, in Hz, or zero for the monitor's
+  // refresh rate. Call after initWindow.
+  void setFramePacing(bool pacing, double rate) {
+    this->pacing = pacing;
+    if (rate <= 0)
+      rate = this->refreshRate;
+    this->paceInterval = rate > 0 ? 1000 / rate : 0;
+  }
+
+  // The time between presents that pacing aims for, in milliseconds.
+  double pacingTarget() const {
+    return this->paceInterval > 0 ? this->paceInterval : this->presentInterval;
+  }
+
+  // Draws at a resolution that keeps the GPU's frame time near budget
+  // milliseconds, but no lower than minScale times the size of the window
+  // (or offscreen image) in each dimension. See renderTargets. Call before
+  // initSwapchain or initOffscreenTargets.
+  void setDynamicResolution(double budget, float minScale) {
+    this->dynamicResolution = true;
+    this->resolutionBudget = budget;
+    this->minRenderScale = std::min(std::max(minScale, 0.01f), 1.0f);
+    this->frameScales = std::vector<float>(this->FRAMES_IN_FLIGHT, 1);
+  }
+
+  float currentRenderScale() const {
+    return this->dynamicResolution ? this->renderScale : 1;
+  }
+
+  // Draws with depth testing, nearest instances in front, optionally after a
+  // depth pre-pass. See depthBuffer. Call before initRenderPass.
+  void setDepthTesting(bool prepass) {
+    this->depthTesting = true;
+    this->depthPrepass = prepass;
+  }
+
+  std::string presentModeName() const {
+    return vk::to_string(this->presentMode);
+  }
+
+  uint32_t swapchainImageCount() const {
+    return this->imageViews.size();
+  }
+
+  std::string deviceName() const {
+    assert(this->physicalDevice);
+    return this->physicalDevice.getProperties().deviceName;
+  }
+
+  // Sets up for rendering without a window, display or swapchain. Use
+  // initOffscreenTargets in place of initWindow, getSurface and
+  // initSwapchain.
+  void initHeadless(uint32_t w, uint32_t h, const char *title) {
+    this->headless = true;
+    this->width = w;
+    this->height = h;
+    this->title = title;
+  }
+
+  // Enough of GLFW for initInstance, which can then run while initWindow
+  // does. Main thread only.
+  void initGlfw(uint32_t w, uint32_t h, const char *title) {
+    if (GLFW_FALSE == glfwInit()) {
+      throw std::runtime_error("failed to initialize glfw");
+    }
+
+    if (GLFW_FALSE == glfwVulkanSupported()) {
+      throw std::runtime_error("vulkan not supported");
+    }
+
+    this->width = w;
+    this->height = h;
+    this->title = title;
+  }
+
+  // Main thread only.
+  void initWindow() {
+    assert(this->title);
+
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    this->window = glfwCreateWindow(this->width, this->height, this->title, nullptr, nullptr);
+    if (!this->window) {
+      throw std::runtime_error("couldn't create window");
+    }
+
+    glfwGetFramebufferSize(this->window, &this->framebufferWidth, &this->framebufferHeight);
+
+    // GLFW can only be asked on the main thread, so find out now for pacing.
+    if (GLFWmonitor *monitor = glfwGetPrimaryMonitor()) {
+      if (const GLFWvidmode *mode = glfwGetVideoMode(monitor))
+        this->refreshRate = mode->refreshRate;
+    }
+
+    glfwSetWindowUserPointer(this->window, this);
+    glfwSetFramebufferSizeCallback(this->window, framebufferSizeCallback);
+    glfwSetKeyCallback(this->window, keyCallback);
+  }
+
+  static void framebufferSizeCallback(GLFWwindow *window, int w, int h) {
+    Context *context = (Context*) glfwGetWindowUserPointer(window);
+    context->resizedTo.store(w, h);
+    context->wake();
+  }
+
+  static void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+    Context *context = (Context*) glfwGetWindowUserPointer(window);
+
+    Event event;
+    event.type = Event::Key;
+    event.time = Clock::now();
+    event.key = key;
+    event.action = action;
+    event.mods = mods;
+    context->postEvent(event);
+  }
+
+  void initInstance() {
+    assert(this->title);
+
+    // Render farm machines don't necessarily have the validation layers
+    // installed, so only ask for them when they're there.
+    std::vector<const char*> layers;
+    for (auto &l : vk::enumerateInstanceLayerProperties()) {
+      if (0 == strcmp(l.layerName, "VK_LAYER_LUNARG_standard_validation")) {
+        layers.push_back("VK_LAYER_LUNARG_standard_validation");
+        break;
+      }
+    }
+
+    std::vector<const char*> requiredExts;
+    if (!this->headless) {
+      uint32_t extCount;
+      const char **_exts = glfwGetRequiredInstanceExtensions(&extCount);
+      requiredExts = std::vector<const char*>(_exts, _exts + extCount);
+    }
+
+    // Nor are the debug utils, which either the loader or a layer may
+    // provide, so the messenger is only made when one of them does.
+    std::vector<vk::ExtensionProperties> exts = vk::enumerateInstanceExtensionProperties();
+    for (auto &l : layers) {
+      std::vector<vk::ExtensionProperties> layerExts =
+        vk::enumerateInstanceExtensionProperties(std::string(l));
+      exts.insert(exts.end(), layerExts.begin(), layerExts.end());
+    }
+    for (auto &e : exts) {
+      if (0 == strcmp(e.extensionName, VK_EXT_DEBUG_UTILS_EXTENSION_NAME)) {
+        requiredExts.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+        this->debugUtilsSupported = true;
+        break;
+      }
+    }
+
+    vk::ApplicationInfo appInfo
+      (this->title,
+       VK_MAKE_VERSION(1,0,0),
+       "No engine",
+       VK_MAKE_VERSION(1,0,0),
+       VK_MAKE_VERSION(1,0,82)
+       );
+
+    vk::InstanceCreateInfo instanceInfo
+      ({},
+       &appInfo,
+       layers.size(), layers.data(),
+       requiredExts.size(), requiredExts.data()
+       );
+
+    this->instance = vk::createInstance(instanceInfo);
+
+    this->loader = vk::DispatchLoaderDynamic(instance);
+  }
+
+  // Does nothing if the instance doesn't support the debug utils.
+  void initDebugMessenger() {
+    assert(this->instance);
+
+    if (!this->debugUtilsSupported)
+      return;
+
+    vk::DebugUtilsMessengerCreateInfoEXT messengerInfo
+      ({},
+
+       vk::DebugUtilsMessageSeverityFlagBitsEXT::eError |
+       vk::DebugUtilsMessageSeverityFlagBitsEXT::eVerbose |
+       vk::DebugUtilsMessageSeverityFlagBitsEXT::eWarning,
+
+       vk::DebugUtilsMessageTypeFlagBitsEXT::eGeneral |
+       vk::DebugUtilsMessageTypeFlagBitsEXT::ePerformance |
+       vk::DebugUtilsMessageTypeFlagBitsEXT::eValidation,
+
+       messengerCallback,
+       nullptr
+       );
+
+    this->messenger =
+      instance.createDebugUtilsMessengerEXT(messengerInfo, nullptr, this->loader);
+  }
+
+  std::vector<const char*> requiredDeviceExtensions() const {
+    std::vector<const char*> extensions;
+    if (!this->headless)
+      extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    return extensions;
+  }
+
+  // How well suited a device is to drawing triangles, or -1 if it can't at
+  // all. Discrete GPUs beat integrated ones, which beat anything else, and
+  // software rasterisers come last. Ties go to the device with more local
+  // memory, then to one that can present from its graphics family.
+  int64_t scoreDevice(vk::PhysicalDevice device) const {
+    std::vector<vk::ExtensionProperties> available =
+      device.enumerateDeviceExtensionProperties();
+    for (auto &required : this->requiredDeviceExtensions()) {
+      bool found = false;
+      for (auto &e : available) {
+        if (0 == strcmp(required, e.extensionName)) {
+          found = true;
+          break;
+        }
+      }
+      if (!found)
+        return -1;
+    }
+
+    std::vector<vk::QueueFamilyProperties> queueFamilies = device.getQueueFamilyProperties();
+    bool graphics = false, present = false, combined = false;
+    for (uint32_t i = 0; i < queueFamilies.size(); ++i) {
+      bool g = bool(queueFamilies[i].queueFlags & vk::QueueFlagBits::eGraphics);
+      bool p = !this->headless && device.getSurfaceSupportKHR(i, this->surface, this->loader);
+      graphics = graphics || g;
+      present = present || p;
+      combined = combined || (g && p);
+    }
+    if (!graphics || (!this->headless && !present))
+      return -1;
+
+    if (!this->headless &&
+        (device.getSurfaceFormatsKHR(this->surface, this->loader).empty() ||
+         device.getSurfacePresentModesKHR(this->surface, this->loader).empty()))
+      return -1;
+
+    int64_t score = 0;
+    switch (device.getProperties().deviceType) {
+    case vk::PhysicalDeviceType::eDiscreteGpu: score = 3; break;
+    case vk::PhysicalDeviceType::eIntegratedGpu: score = 2; break;
+    case vk::PhysicalDeviceType::eVirtualGpu: score = 1; break;
+    default: score = 0; break;
+    }
+
+    // In MiB, which leaves plenty of room for the other terms.
+    vk::PhysicalDeviceMemoryProperties memory = device.getMemoryProperties();
+    int64_t localMemory = 0;
+    for (uint32_t i = 0; i < memory.memoryHeapCount; ++i) {
+      if (memory.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal)
+        localMemory += memory.memoryHeaps[i].size >> 20;
+    }
+
+    return (score << 40) + (localMemory << 1) + (combined ? 1 : 0);
+  }
+
+  // Picks the best scoring device, unless preference names one: either its
+  // index in the list the driver gives or, failing that, part of the name
+  // of exactly one device.
+  void getPhysicalDevice(const std::string &preference) {
+    assert(this->instance);
+    assert(this->surface || this->headless);
+
+    std::vector<vk::PhysicalDevice> devices = this->instance.enumeratePhysicalDevices();
+
+    if (devices.empty()) {
+      throw std::runtime_error("no physical devices");
+    }
+
+    if (!preference.empty()) {
+      std::vector<std::string> names;
+      std::string list;
+      for (size_t i = 0; i < devices.size(); ++i) {
+        names.push_back(devices[i].getProperties().deviceName);
+        list += "\n  " + std::to_string(i) + ": " + names[i];
+      }
+
+      // An index takes precedence, so that a device whose name contains
+      // another's index can't shadow it.
+      std::vector<size_t> matches;
+      for (size_t i = 0; i < devices.size() && matches.empty(); ++i) {
+        if (std::to_string(i) == preference)
+          matches.push_back(i);
+      }
+      if (matches.empty()) {
+        for (size_t i = 0; i < devices.size(); ++i) {
+          if (std::string::npos != names[i].find(preference))
+            matches.push_back(i);
+        }
+      }
+
+      if (matches.empty()) {
+        throw std::runtime_error("no device matches " + preference + "; there's" + list);
+      }
+      if (matches.size() > 1) {
+        throw std::runtime_error
+          ("more than one device matches " + preference + "; pick one by index from" + list);
+      }
+
+      size_t i = matches[0];
+      if (this->scoreDevice(devices[i]) < 0)
+        throw std::runtime_error("device " + names[i] + " can't run this");
+      this->physicalDevice = devices[i];
+      return;
+    }
+
+    int64_t best = -1;
+    for (auto &d : devices) {
+      int64_t score = this->scoreDevice(d);
+      if (score > best) {
+        best = score;
+        this->physicalDevice = d;
+      }
+    }
+
+    if (best < 0) {
+      throw std::runtime_error("no suitable physical devices");
+    }
+  }
 
   void getQueueIndices() {
     assert(this->physicalDevice);
-    assert(this->surface);
+    assert(this->surface || this->headless);
 
     std::vector<vk::QueueFamilyProperties> queueFamilies =
       this->physicalDevice.getQueueFamilyProperties();
@@ -303,7 +2152,8 @@ public:
         graphicsQfIxs.push_back(i);
       }
 
-      if (this->physicalDevice.getSurfaceSupportKHR(i, this->surface, this->loader)) {
+      if (!this->headless &&
+          this->physicalDevice.getSurfaceSupportKHR(i, this->surface, this->loader)) {
         presentQfIxs.push_back(i);
       }
     }
@@ -312,23 +2162,63 @@ public:
       throw std::runtime_error("no graphics queues");
     }
 
-    if (presentQfIxs.empty()) {
+    if (!this->headless && presentQfIxs.empty()) {
       throw std::runtime_error("no present queues");
     }
 
     this->graphicsQfIx = (uint32_t*) malloc(sizeof(uint32_t));
     *this->graphicsQfIx = graphicsQfIxs[0];
 
-    this->presentQfIx = (uint32_t*) malloc(sizeof(uint32_t));
-    *this->presentQfIx = presentQfIxs[0];
+    // A family that can both draw and present saves an ownership transfer
+    // and a concurrently shared swapchain.
+    if (!this->headless) {
+      this->presentQfIx = (uint32_t*) malloc(sizeof(uint32_t));
+      *this->presentQfIx = presentQfIxs[0];
+      for (auto &g : graphicsQfIxs) {
+        if (std::find(presentQfIxs.begin(), presentQfIxs.end(), g) != presentQfIxs.end()) {
+          *this->graphicsQfIx = g;
+          *this->presentQfIx = g;
+          break;
+        }
+      }
+    }
+
+    // A family with transfer but neither graphics nor compute is usually a
+    // DMA engine that can copy alongside rendering, and one with compute but
+    // not graphics can run compute work alongside it. Failing those, the
+    // graphics family does the work.
+    this->transferQfIx = (uint32_t*) malloc(sizeof(uint32_t));
+    *this->transferQfIx = *this->graphicsQfIx;
+    this->computeQfIx = (uint32_t*) malloc(sizeof(uint32_t));
+    *this->computeQfIx = *this->graphicsQfIx;
+    bool transferFound = false, computeFound = false;
+    for (uint32_t i = 0; i < queueFamilies.size(); ++i) {
+      vk::QueueFlags flags = queueFamilies[i].queueFlags;
+      if (!transferFound &&
+          (flags & vk::QueueFlagBits::eTransfer) &&
+          !(flags & vk::QueueFlagBits::eGraphics) &&
+          !(flags & vk::QueueFlagBits::eCompute)) {
+        *this->transferQfIx = i;
+        transferFound = true;
+      }
+      if (!computeFound &&
+          (flags & vk::QueueFlagBits::eCompute) &&
+          !(flags & vk::QueueFlagBits::eGraphics)) {
+        *this->computeQfIx = i;
+        computeFound = true;
+      }
+    }
   }
 
   void initDevice() {
     assert(this->graphicsQfIx);
-    assert(this->presentQfIx);
+    assert(this->presentQfIx || this->headless);
     assert(this->physicalDevice);
 
-    std::unordered_set<uint32_t> ixs = { *this->graphicsQfIx, *this->presentQfIx };
+    std::unordered_set<uint32_t> ixs =
+      { *this->graphicsQfIx, *this->transferQfIx, *this->computeQfIx };
+    if (this->presentQfIx)
+      ixs.insert(*this->presentQfIx);
 
     std::vector<vk::DeviceQueueCreateInfo> queueInfos(ixs.size());
     size_t ix = 0;
@@ -339,7 +2229,7 @@ public:
     }
 
     vk::PhysicalDeviceFeatures features = this->physicalDevice.getFeatures();
-    std::vector<const char*> deviceExtensions = { VK_KHR_SWAPCHAIN_EXTENSION_NAME };
+    std::vector<const char*> deviceExtensions = this->requiredDeviceExtensions();
 
     vk::DeviceCreateInfo deviceInfo
       ({},
@@ -360,53 +2250,216 @@ public:
     this->surface = _surface;
   }
 
-  void getQueues() {
-    assert(this->graphicsQfIx);
-    assert(this->presentQfIx);
-    assert(this->device);
-    this->graphicsQueue = this->device.getQueue(*this->graphicsQfIx, 0);
-    this->presentQueue = this->device.getQueue(*this->presentQfIx, 0);
+  // Reads the cache saved by a previous run, if there is one, for
+  // initPipelineCache. Needs no device, so it can happen while one is being
+  // set up.
+  void readPipelineCache(const std::string &path) {
+    this->pipelineCachePath = path;
+
+    std::vector<char> &data = this->pipelineCacheData;
+    data.clear();
+    std::ifstream cacheFile(path, std::ios_base::binary | std::ios_base::ate);
+    if (cacheFile.is_open()) {
+      data = std::vector<char>(cacheFile.tellg());
+      cacheFile.seekg(0);
+      cacheFile.read(data.data(), data.size());
+      if (!cacheFile) {
+        data.clear();
+      }
+    }
   }
 
-  void initSwapchain() {
+  // Starts from the cache that readPipelineCache read, if it was made by
+  // this device and driver. Vulkan 1.0 has no driverUUID, but the
+  // pipelineCacheUUID in the cache header changes whenever the driver's
+  // compiler does, so it serves the same purpose.
+  void initPipelineCache() {
+    assert(this->device);
     assert(this->physicalDevice);
-    assert(this->surface);
-    assert(this->window);
 
-    vk::SurfaceCapabilitiesKHR capabilities =
-      this->physicalDevice.getSurfaceCapabilitiesKHR(this->surface, this->loader);
-    uint32_t minImageCount = capabilities.minImageCount + 1;
-    if (capabilities.maxImageCount > 0) {
-      minImageCount = std::min(minImageCount, capabilities.maxImageCount);
+    std::vector<char> data;
+    data.swap(this->pipelineCacheData);
+
+    // The header is laid out as in the spec for VK_PIPELINE_CACHE_HEADER_VERSION_ONE.
+    struct {
+      uint32_t headerLength;
+      uint32_t headerVersion;
+      uint32_t vendorID;
+      uint32_t deviceID;
+      uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    } header;
+
+    if (data.size() >= sizeof(header)) {
+      memcpy(&header, data.data(), sizeof(header));
+
+      vk::PhysicalDeviceProperties properties = this->physicalDevice.getProperties();
+      bool valid =
+        header.headerLength >= sizeof(header) &&
+        header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header.vendorID == properties.vendorID &&
+        header.deviceID == properties.deviceID &&
+        0 == memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+      if (!valid) {
+        std::cerr << "ignoring pipeline cache from a different device or driver" << std::endl;
+        data.clear();
+      }
+    } else {
+      data.clear();
     }
 
-    std::vector<vk::SurfaceFormatKHR> formats =
-      this->physicalDevice.getSurfaceFormatsKHR(this->surface, this->loader);
+    vk::PipelineCacheCreateInfo pipelineCacheInfo({}, data.size(), data.data());
+    this->pipelineCache = this->device.createPipelineCache(pipelineCacheInfo);
+  }
 
-    this->swapchainFormat = formats[0].format;
+  // Called on shutdown. Writes to a temporary file first so that an
+  // interrupted save can't leave a truncated cache behind.
+  void savePipelineCache() {
+    assert(this->pipelineCache);
 
-    vk::ColorSpaceKHR swapchainColorSpace = formats[0].colorSpace;
-    if (formats.empty()) {
-      throw std::runtime_error("no swapchain formats");
-    }
-    for (auto &f : formats) {
-      if (vk::Format::eUndefined == f.format ||
-          (vk::Format::eB8G8R8A8Unorm == f.format &&
-           vk::ColorSpaceKHR::eSrgbNonlinear == f.colorSpace)) {
+    if (this->pipelineCachePath.empty())
+      return;
 
-        this->swapchainFormat = vk::Format::eB8G8R8A8Unorm;
-        swapchainColorSpace = vk::ColorSpaceKHR::eSrgbNonlinear;
+    try {
+      std::vector<uint8_t> data = this->device.getPipelineCacheData(this->pipelineCache);
 
-        break;
+      std::string tmpPath = this->pipelineCachePath + ".tmp";
+      std::ofstream cacheFile(tmpPath, std::ios_base::binary | std::ios_base::trunc);
+      cacheFile.write((const char*) data.data(), data.size());
+      cacheFile.close();
+
+      if (!cacheFile || 0 != rename(tmpPath.c_str(), this->pipelineCachePath.c_str())) {
+        std::cerr << "couldn't save pipeline cache" << std::endl;
       }
+    } catch (std::exception &e) {
+      std::cerr << "couldn't save pipeline cache: " << e.what() << std::endl;
     }
+  }
 
-    if (capabilities.currentExtent.width != 0xFFFFFFFF) {
+  void getQueues() {
+    assert(this->graphicsQfIx);
+    assert(this->presentQfIx || this->headless);
+    assert(this->device);
+    this->graphicsQueue = this->device.getQueue(*this->graphicsQfIx, 0);
+    this->transferQueue = this->device.getQueue(*this->transferQfIx, 0);
+    this->computeQueue = this->device.getQueue(*this->computeQfIx, 0);
+    if (this->presentQfIx)
+      this->presentQueue = this->device.getQueue(*this->presentQfIx, 0);
+  }
+
+  // All device memory comes from the allocator.
+  void initAllocator() {
+    assert(this->device);
+
+    this->allocator.init(this->physicalDevice, this->device);
+  }
+
+  AllocatorStats memoryStats() const {
+    return this->allocator.stats();
+  }
+
+  // The headless counterpart of initSwapchain and initImageViews: one
+  // device-local colour image per frame in flight.
+  void initOffscreenTargets() {
+    assert(this->device);
+    assert(this->headless);
+
+    this->swapchainFormat = vk::Format::eR8G8B8A8Unorm;
+    this->swapchainExtent = vk::Extent2D(this->width, this->height);
+    this->updateRenderExtent();
+
+    vk::ImageUsageFlags usage =
+      vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc;
+    if (this->dynamicResolution)
+      usage |= vk::ImageUsageFlagBits::eTransferDst;
+
+    this->offscreenImages = std::vector<vk::Image>(this->FRAMES_IN_FLIGHT);
+    this->offscreenAllocations = std::vector<Allocation>(this->FRAMES_IN_FLIGHT);
+    this->imageViews = std::vector<vk::ImageView>(this->FRAMES_IN_FLIGHT);
+
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      vk::ImageCreateInfo imageInfo
+        ({},
+         vk::ImageType::e2D,
+         this->swapchainFormat,
+         vk::Extent3D(this->swapchainExtent.width, this->swapchainExtent.height, 1),
+         1,
+         1,
+         vk::SampleCountFlagBits::e1,
+         vk::ImageTiling::eOptimal,
+         usage,
+         vk::SharingMode::eExclusive,
+         0, nullptr,
+         vk::ImageLayout::eUndefined);
+      this->offscreenImages[i] = this->device.createImage(imageInfo);
+
+      this->offscreenAllocations[i] =
+        this->allocator.allocate
+          (this->device.getImageMemoryRequirements(this->offscreenImages[i]),
+           vk::MemoryPropertyFlagBits::eDeviceLocal,
+           {},
+           true);
+      this->device.bindImageMemory
+        (this->offscreenImages[i],
+         this->offscreenAllocations[i].memory,
+         this->offscreenAllocations[i].offset);
+
+      vk::ImageViewCreateInfo imageViewInfo
+        ({},
+         this->offscreenImages[i],
+         vk::ImageViewType::e2D,
+         this->swapchainFormat,
+         vk::ComponentMapping
+         (vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity),
+         vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1)
+         );
+      this->imageViews[i] = this->device.createImageView(imageViewInfo);
+    }
+  }
+
+  void initSwapchain() {
+    assert(this->physicalDevice);
+    assert(this->surface);
+    assert(this->window);
+
+    vk::SurfaceCapabilitiesKHR capabilities =
+      this->physicalDevice.getSurfaceCapabilitiesKHR(this->surface, this->loader);
+    uint32_t minImageCount = capabilities.minImageCount + 1;
+    if (this->requestedImageCount > 0) {
+      minImageCount = std::max(this->requestedImageCount, capabilities.minImageCount);
+    }
+    if (capabilities.maxImageCount > 0) {
+      minImageCount = std::min(minImageCount, capabilities.maxImageCount);
+    }
+
+    std::vector<vk::SurfaceFormatKHR> formats =
+      this->physicalDevice.getSurfaceFormatsKHR(this->surface, this->loader);
+
+    this->swapchainFormat = formats[0].format;
+
+    vk::ColorSpaceKHR swapchainColorSpace = formats[0].colorSpace;
+    if (formats.empty()) {
+      throw std::runtime_error("no swapchain formats");
+    }
+    for (auto &f : formats) {
+      if (vk::Format::eUndefined == f.format ||
+          (vk::Format::eB8G8R8A8Unorm == f.format &&
+           vk::ColorSpaceKHR::eSrgbNonlinear == f.colorSpace)) {
+
+        this->swapchainFormat = vk::Format::eB8G8R8A8Unorm;
+        swapchainColorSpace = vk::ColorSpaceKHR::eSrgbNonlinear;
+
+        break;
+      }
+    }
+
+    if (capabilities.currentExtent.width != 0xFFFFFFFF) {
       this->swapchainExtent = capabilities.currentExtent;
     } else {
-      int w, h;
-      glfwGetFramebufferSize(this->window, &w, &h);
-      this->swapchainExtent = vk::Extent2D(w, h);
+      this->swapchainExtent = vk::Extent2D(this->framebufferWidth, this->framebufferHeight);
     }
 
     vk::SharingMode sharingMode;
@@ -421,12 +2474,30 @@ public:
 
     std::vector<vk::PresentModeKHR> presentModes =
       this->physicalDevice.getSurfacePresentModesKHR(this->surface, this->loader);
+    // FIFO is the only mode that's always supported.
     vk::PresentModeKHR swapchainPresentMode = vk::PresentModeKHR::eFifo;
-    for (auto &pm : presentModes) {
-      if (vk::PresentModeKHR::eMailbox == pm) {
-        swapchainPresentMode = pm;
-        break;
+    vk::PresentModeKHR wanted =
+      this->presentModeRequested ? this->requestedPresentMode : vk::PresentModeKHR::eMailbox;
+    if (std::find(presentModes.begin(), presentModes.end(), wanted) != presentModes.end()) {
+      swapchainPresentMode = wanted;
+    } else if (this->presentModeRequested && !this->swapchain) {
+      std::cerr << "present mode " << vk::to_string(wanted)
+                << " isn't supported, using Fifo" << std::endl;
+    }
+    this->presentMode = swapchainPresentMode;
+
+    vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eColorAttachment;
+    if (this->capturing) {
+      if (!(capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eTransferSrc)) {
+        throw std::runtime_error("swapchain images can't be copied from, so can't be captured");
       }
+      usage |= vk::ImageUsageFlagBits::eTransferSrc;
+    }
+    if (this->dynamicResolution) {
+      if (!(capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eTransferDst)) {
+        throw std::runtime_error("swapchain images can't be blitted to, so can't be upscaled to");
+      }
+      usage |= vk::ImageUsageFlagBits::eTransferDst;
     }
 
     vk::SwapchainCreateInfoKHR swapchainInfo
@@ -437,7 +2508,7 @@ public:
        swapchainColorSpace,
        this->swapchainExtent,
        1,
-       vk::ImageUsageFlagBits::eColorAttachment,
+       usage,
        sharingMode,
        sharingIndices.size(),
        sharingIndices.data(),
@@ -445,177 +2516,1902 @@ public:
        vk::CompositeAlphaFlagBitsKHR::eOpaque,
        swapchainPresentMode,
        true,
+       this->swapchain);
+
+    this->swapchain = this->device.createSwapchainKHR(swapchainInfo, nullptr, this->loader);
+    this->updateRenderExtent();
+  }
+
+  void initRenderPass() {
+    assert(this->device);
+    assert(this->swapchain || this->headless);
+
+    vk::AttachmentDescription colorAttachment
+      ({},
+       this->swapchainFormat,
+       vk::SampleCountFlagBits::e1,
+       vk::AttachmentLoadOp::eClear,
+       vk::AttachmentStoreOp::eStore,
+       vk::AttachmentLoadOp::eDontCare,
+       vk::AttachmentStoreOp::eDontCare,
+       vk::ImageLayout::eUndefined,
+       this->headless || this->dynamicResolution ?
+         vk::ImageLayout::eTransferSrcOptimal :
+         vk::ImageLayout::ePresentSrcKHR);
+
+    std::vector<vk::AttachmentReference> colorAttachments =
+      { vk::AttachmentReference(0, vk::ImageLayout::eColorAttachmentOptimal)
+      };
+    vk::AttachmentReference depthAttachment(1, vk::ImageLayout::eDepthStencilAttachmentOptimal);
+
+    vk::SubpassDescription subpass
+      ({},
+       vk::PipelineBindPoint::eGraphics,
+       0, nullptr,
+       colorAttachments.size(), colorAttachments.data(), nullptr,
+       this->depthTesting ? &depthAttachment : nullptr,
+       0, nullptr);
+
+    vk::SubpassDependency subpassDep
+      (VK_SUBPASS_EXTERNAL,
+       this->colorSubpass(),
+       vk::PipelineStageFlagBits::eColorAttachmentOutput,
+       vk::PipelineStageFlagBits::eColorAttachmentOutput,
+       {},
+       vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite,
+       {});
+
+    std::vector<vk::AttachmentDescription> attachmentDescs = { colorAttachment };
+    std::vector<vk::SubpassDescription> subpasses = { subpass };
+    std::vector<vk::SubpassDependency> subpassDeps = { subpassDep };
+
+    if (this->depthTesting) {
+      this->depthFormat = this->chooseDepthFormat();
+
+      // Only the clear and the tests ever see it.
+      attachmentDescs.push_back
+        (vk::AttachmentDescription
+           ({},
+            this->depthFormat,
+            vk::SampleCountFlagBits::e1,
+            vk::AttachmentLoadOp::eClear,
+            vk::AttachmentStoreOp::eDontCare,
+            vk::AttachmentLoadOp::eDontCare,
+            vk::AttachmentStoreOp::eDontCare,
+            vk::ImageLayout::eUndefined,
+            vk::ImageLayout::eDepthStencilAttachmentOptimal));
+
+      // The previous frame's depth tests have to be done with the shared
+      // depth buffer before this frame clears it.
+      subpassDeps.push_back
+        (vk::SubpassDependency
+           (VK_SUBPASS_EXTERNAL,
+            0,
+            vk::PipelineStageFlagBits::eEarlyFragmentTests |
+            vk::PipelineStageFlagBits::eLateFragmentTests,
+            vk::PipelineStageFlagBits::eEarlyFragmentTests |
+            vk::PipelineStageFlagBits::eLateFragmentTests,
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+            vk::AccessFlagBits::eDepthStencilAttachmentRead |
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+            {}));
+    }
+
+    if (this->depthPrepass) {
+      // The pre-pass only writes depth, which the colour subpass then tests
+      // against, pixel for pixel.
+      vk::SubpassDescription prepass
+        ({},
+         vk::PipelineBindPoint::eGraphics,
+         0, nullptr,
+         0, nullptr, nullptr,
+         &depthAttachment,
+         0, nullptr);
+      subpasses.insert(subpasses.begin(), prepass);
+
+      subpassDeps.push_back
+        (vk::SubpassDependency
+           (0,
+            1,
+            vk::PipelineStageFlagBits::eEarlyFragmentTests |
+            vk::PipelineStageFlagBits::eLateFragmentTests,
+            vk::PipelineStageFlagBits::eEarlyFragmentTests |
+            vk::PipelineStageFlagBits::eLateFragmentTests,
+            vk::AccessFlagBits::eDepthStencilAttachmentWrite,
+            vk::AccessFlagBits::eDepthStencilAttachmentRead,
+            vk::DependencyFlagBits::eByRegion));
+    }
+
+    // The capture copy, or the blit that upscales a render target, comes
+    // after the render pass's final layout transition, which without this
+    // is only ordered before the bottom of the pipe.
+    if (this->capturing || this->dynamicResolution)
+      subpassDeps.push_back
+        (vk::SubpassDependency
+           (this->colorSubpass(),
+            VK_SUBPASS_EXTERNAL,
+            vk::PipelineStageFlagBits::eColorAttachmentOutput,
+            vk::PipelineStageFlagBits::eTransfer,
+            vk::AccessFlagBits::eColorAttachmentWrite,
+            vk::AccessFlagBits::eTransferRead,
+            {}));
+    vk::RenderPassCreateInfo renderpassInfo
+      ({},
+       attachmentDescs.size(), attachmentDescs.data(),
+       subpasses.size(), subpasses.data(),
+       subpassDeps.size(), subpassDeps.data());
+
+    this->renderpass = this->device.createRenderPass(renderpassInfo);
+  }
+
+  // The instances' depths are 16-bit, so 16 bits of depth buffer is enough
+  // to tell them all apart, and the least to read and write. Every device
+  // supports D16Unorm attachments; the others are only fallbacks.
+  vk::Format chooseDepthFormat() const {
+    std::vector<vk::Format> candidates =
+      { vk::Format::eD16Unorm,
+        vk::Format::eX8D24UnormPack32,
+        vk::Format::eD32Sfloat,
+        vk::Format::eD24UnormS8Uint,
+        vk::Format::eD32SfloatS8Uint
+      };
+    for (auto format : candidates) {
+      vk::FormatProperties properties = this->physicalDevice.getFormatProperties(format);
+      if (properties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eDepthStencilAttachment)
+        return format;
+    }
+    throw std::runtime_error("no depth format can be rendered to");
+  }
+
+  // Makes the depth buffer the framebuffers share, as big as the swapchain
+  // (or offscreen) images. Call after initRenderPass and before the
+  // framebuffers are made, and again whenever the swapchain is recreated.
+  void initDepthBuffer() {
+    assert(this->device);
+    assert(this->depthTesting);
+    assert(vk::Format::eUndefined != this->depthFormat);
+
+    vk::ImageCreateInfo imageInfo
+      ({},
+       vk::ImageType::e2D,
+       this->depthFormat,
+       vk::Extent3D(this->swapchainExtent.width, this->swapchainExtent.height, 1),
+       1,
+       1,
+       vk::SampleCountFlagBits::e1,
+       vk::ImageTiling::eOptimal,
+       vk::ImageUsageFlagBits::eDepthStencilAttachment |
+       vk::ImageUsageFlagBits::eTransientAttachment,
+       vk::SharingMode::eExclusive,
+       0, nullptr,
+       vk::ImageLayout::eUndefined);
+    this->depthBuffer.image = this->device.createImage(imageInfo);
+
+    this->depthBuffer.allocation =
+      this->allocator.allocate
+        (this->device.getImageMemoryRequirements(this->depthBuffer.image),
+         vk::MemoryPropertyFlagBits::eDeviceLocal,
+         vk::MemoryPropertyFlagBits::eLazilyAllocated,
+         true);
+    this->device.bindImageMemory
+      (this->depthBuffer.image,
+       this->depthBuffer.allocation.memory,
+       this->depthBuffer.allocation.offset);
+
+    vk::ImageViewCreateInfo imageViewInfo
+      ({},
+       this->depthBuffer.image,
+       vk::ImageViewType::e2D,
+       this->depthFormat,
+       vk::ComponentMapping
+       (vk::ComponentSwizzle::eIdentity,
+        vk::ComponentSwizzle::eIdentity,
+        vk::ComponentSwizzle::eIdentity,
+        vk::ComponentSwizzle::eIdentity),
+       vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eDepth, 0, 1, 0, 1)
+       );
+    this->depthBuffer.view = this->device.createImageView(imageViewInfo);
+  }
+
+  // The attachments of a framebuffer that draws to view.
+  std::vector<vk::ImageView> framebufferAttachments(vk::ImageView view) const {
+    std::vector<vk::ImageView> attachments = { view };
+    if (this->depthTesting)
+      attachments.push_back(this->depthBuffer.view);
+    return attachments;
+  }
+
+  void initImageViews() {
+    assert(this->device);
+    assert(this->swapchain);
+
+    std::vector<vk::Image> images =
+      this->device.getSwapchainImagesKHR(this->swapchain, this->loader);
+    this->swapchainImages = images;
+
+    this->imageViews = std::vector<vk::ImageView>(images.size());
+
+    for (size_t i = 0; i < images.size(); ++i) {
+      vk::ImageViewCreateInfo imageViewInfo
+        ({},
+         images[i],
+         vk::ImageViewType::e2D,
+         swapchainFormat,
+         vk::ComponentMapping
+         (vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity),
+         vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1)
+         );
+      this->imageViews[i] = this->device.createImageView(imageViewInfo);
+    }
+  }
+
+  void initFramebuffers() {
+    assert(this->device);
+    assert(this->swapchain || this->headless);
+    assert(this->renderpass);
+    assert(!this->imageViews.empty());
+
+    size_t count = this->imageViews.size();
+    this->framebuffers = std::vector<vk::Framebuffer>(count);
+    for (size_t i = 0; i < count; ++i) {
+      std::vector<vk::ImageView> attachments = this->framebufferAttachments(this->imageViews[i]);
+      vk::FramebufferCreateInfo framebufferInfo
+        ({},
+         this->renderpass,
+         attachments.size(), attachments.data(),
+         this->swapchainExtent.width, this->swapchainExtent.height,
+         1);
+
+      this->framebuffers[i] = this->device.createFramebuffer(framebufferInfo);
+    }
+  }
+
+  // Gives each frame-in-flight slot a render target as big as the images
+  // it's upscaled to, with a framebuffer for the render pass. Call after
+  // initRenderPass, and again whenever the swapchain is recreated.
+  void initRenderTargets() {
+    assert(this->device);
+    assert(this->renderpass);
+    assert(this->dynamicResolution);
+
+    vk::FormatFeatureFlags blit =
+      vk::FormatFeatureFlagBits::eBlitSrc | vk::FormatFeatureFlagBits::eBlitDst;
+    vk::FormatProperties properties = this->physicalDevice.getFormatProperties(this->swapchainFormat);
+    if (blit != (properties.optimalTilingFeatures & blit)) {
+      throw std::runtime_error
+        (vk::to_string(this->swapchainFormat) + " images can't be blitted, so can't be upscaled");
+    }
+
+    this->renderTargets = std::vector<RenderTarget>(this->FRAMES_IN_FLIGHT);
+    for (auto &target : this->renderTargets) {
+      vk::ImageCreateInfo imageInfo
+        ({},
+         vk::ImageType::e2D,
+         this->swapchainFormat,
+         vk::Extent3D(this->swapchainExtent.width, this->swapchainExtent.height, 1),
+         1,
+         1,
+         vk::SampleCountFlagBits::e1,
+         vk::ImageTiling::eOptimal,
+         vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc,
+         vk::SharingMode::eExclusive,
+         0, nullptr,
+         vk::ImageLayout::eUndefined);
+      target.image = this->device.createImage(imageInfo);
+
+      target.allocation =
+        this->allocator.allocate
+          (this->device.getImageMemoryRequirements(target.image),
+           vk::MemoryPropertyFlagBits::eDeviceLocal,
+           {},
+           true);
+      this->device.bindImageMemory(target.image, target.allocation.memory, target.allocation.offset);
+
+      vk::ImageViewCreateInfo imageViewInfo
+        ({},
+         target.image,
+         vk::ImageViewType::e2D,
+         this->swapchainFormat,
+         vk::ComponentMapping
+         (vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity,
+          vk::ComponentSwizzle::eIdentity),
+         vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1)
+         );
+      target.view = this->device.createImageView(imageViewInfo);
+
+      std::vector<vk::ImageView> attachments = this->framebufferAttachments(target.view);
+      vk::FramebufferCreateInfo framebufferInfo
+        ({},
+         this->renderpass,
+         attachments.size(), attachments.data(),
+         this->swapchainExtent.width, this->swapchainExtent.height,
+         1);
+      target.framebuffer = this->device.createFramebuffer(framebufferInfo);
+    }
+  }
+
+  void destroyRenderTarget(RenderTarget &target) {
+    this->device.destroyFramebuffer(target.framebuffer);
+    this->device.destroyImageView(target.view);
+    this->device.destroyImage(target.image);
+    this->allocator.free(target.allocation);
+    target = RenderTarget();
+  }
+
+  void destroyRenderTargets(std::vector<RenderTarget> &targets) {
+    for (auto &target : targets)
+      this->destroyRenderTarget(target);
+    targets.clear();
+  }
+
+  // Blits the part of the slot's render target that was drawn to over the
+  // whole of output, leaving output ready to present (or to copy, without
+  // a window). The blit is ordered after the image is acquired by waiting
+  // for the colour attachment output stage, which is where the submit
+  // waits for it.
+  void recordUpscale(vk::CommandBuffer c, uint32_t frame, vk::Image output) {
+    vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+    vk::ImageSubresourceLayers layers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+
+    // Whatever the image held before is overwritten.
+    vk::ImageMemoryBarrier toBlit
+      ({},
+       vk::AccessFlagBits::eTransferWrite,
+       vk::ImageLayout::eUndefined,
+       vk::ImageLayout::eTransferDstOptimal,
+       VK_QUEUE_FAMILY_IGNORED,
+       VK_QUEUE_FAMILY_IGNORED,
+       output,
+       range);
+    c.pipelineBarrier
+      (vk::PipelineStageFlagBits::eColorAttachmentOutput,
+       vk::PipelineStageFlagBits::eTransfer,
+       {},
+       nullptr,
+       nullptr,
+       toBlit);
+
+    vk::FormatProperties properties = this->physicalDevice.getFormatProperties(this->swapchainFormat);
+    bool linear =
+      bool(properties.optimalTilingFeatures & vk::FormatFeatureFlagBits::eSampledImageFilterLinear);
+
+    vk::ImageBlit region
+      (layers,
+       {{ vk::Offset3D(0, 0, 0),
+          vk::Offset3D(this->renderExtent.width, this->renderExtent.height, 1) }},
+       layers,
+       {{ vk::Offset3D(0, 0, 0),
+          vk::Offset3D(this->swapchainExtent.width, this->swapchainExtent.height, 1) }});
+    c.blitImage
+      (this->renderTargets[frame].image, vk::ImageLayout::eTransferSrcOptimal,
+       output, vk::ImageLayout::eTransferDstOptimal,
+       region,
+       linear ? vk::Filter::eLinear : vk::Filter::eNearest);
+
+    vk::ImageMemoryBarrier toFinal
+      (vk::AccessFlagBits::eTransferWrite,
+       {},
+       vk::ImageLayout::eTransferDstOptimal,
+       this->headless ? vk::ImageLayout::eTransferSrcOptimal : vk::ImageLayout::ePresentSrcKHR,
+       VK_QUEUE_FAMILY_IGNORED,
+       VK_QUEUE_FAMILY_IGNORED,
+       output,
+       range);
+    // Up to the transfer stage, where a capture's copy waits for it.
+    c.pipelineBarrier
+      (vk::PipelineStageFlagBits::eTransfer,
+       vk::PipelineStageFlagBits::eTransfer,
+       {},
+       nullptr,
+       nullptr,
+       toFinal);
+  }
+
+  Buffer createBuffer
+    (vk::DeviceSize size,
+     vk::BufferUsageFlags usage,
+     vk::MemoryPropertyFlags properties,
+     vk::MemoryPropertyFlags preferred = {}) {
+    assert(this->device);
+
+    Buffer result;
+    result.size = size;
+
+    vk::BufferCreateInfo bufferInfo
+      ({},
+       size,
+       usage,
+       vk::SharingMode::eExclusive,
+       0, nullptr);
+    result.buffer = this->device.createBuffer(bufferInfo);
+
+    result.allocation =
+      this->allocator.allocate
+        (this->device.getBufferMemoryRequirements(result.buffer),
+         properties,
+         preferred,
+         false);
+    this->device.bindBufferMemory
+      (result.buffer, result.allocation.memory, result.allocation.offset);
+
+    return result;
+  }
+
+  void destroyBuffer(Buffer &buffer) {
+    if (buffer.buffer)
+      this->device.destroyBuffer(buffer.buffer);
+    this->allocator.free(buffer.allocation);
+    buffer = Buffer();
+  }
+
+  // Copies data into a device-local buffer through a staging buffer, and
+  // waits for the copy to finish. The buffer belongs to the graphics family.
+  void uploadBuffer(Buffer &dst, const void *data, vk::DeviceSize size) {
+    this->uploadBuffer(dst, data, size, this->graphicsQueue, this->commandPool);
+  }
+
+  // As above, for a buffer used by the family that pool and queue are from.
+  void uploadBuffer
+    (Buffer &dst,
+     const void *data,
+     vk::DeviceSize size,
+     vk::Queue queue,
+     vk::CommandPool pool) {
+    assert(pool);
+    assert(size <= dst.size);
+
+    Buffer staging =
+      this->createBuffer
+        (size,
+         vk::BufferUsageFlagBits::eTransferSrc,
+         vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+
+    memcpy(staging.allocation.mapped, data, size);
+
+    vk::CommandBufferAllocateInfo allocateInfo
+      (pool,
+       vk::CommandBufferLevel::ePrimary,
+       1);
+    vk::CommandBuffer c = this->device.allocateCommandBuffers(allocateInfo)[0];
+
+    c.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr));
+    vk::BufferCopy region(0, 0, size);
+    c.copyBuffer(staging.buffer, dst.buffer, region);
+    c.end();
+
+    vk::SubmitInfo submitInfo
+      (0, nullptr, nullptr,
+       1, &c,
+       0, nullptr);
+    queue.submit(1, &submitInfo, vk::Fence());
+    queue.waitIdle();
+
+    this->device.freeCommandBuffers(pool, c);
+    this->destroyBuffer(staging);
+  }
+
+  // Puts the scene's vertices, indices and instances in device-local memory,
+  // and splits its instances into draws of at most instancesPerDraw each (or
+  // one draw, if that's zero).
+  void initGeometry(const Scene &scene, uint32_t instancesPerDraw) {
+    assert(this->device);
+    assert(!scene.vertices.empty());
+    assert(!scene.indices.empty());
+
+    this->initMesh
+      (scene.vertices.data(), scene.vertices.size(),
+       scene.indices.data(), scene.indices.size(),
+       scene.radius);
+    this->initInstanceBuffer(scene.instances.size());
+    if (!scene.instances.empty())
+      this->uploadBuffer
+        (this->instanceBuffer, scene.instances.data(), scene.instances.size() * sizeof(Instance));
+    this->loadedInstances = this->instanceCount;
+
+    this->setDrawList(makeDrawList(this->instanceCount, instancesPerDraw));
+  }
+
+  // Like initGeometry, but for a scene file. The mesh is uploaded straight
+  // from the mapping, and the instances are left to loadSceneChunks, so that
+  // frames are drawn while they load rather than after. The file has to
+  // stay open until the context is destroyed. Call before initCulling.
+  void initSceneFile
+    (const SceneFile &file,
+     uint32_t instancesPerDraw,
+     vk::DeviceSize loadBudget) {
+    assert(this->device);
+    assert(this->transferQfIx);
+
+    this->initMesh
+      (file.vertices(), file.vertexCount(),
+       file.indices(), file.indexCount(),
+       file.radius());
+    this->initInstanceBuffer(file.instanceCount());
+
+    this->sceneFile = &file;
+    this->nextChunk = 0;
+    this->loadedInstances = 0;
+    this->loadBudget = loadBudget;
+
+    this->setDrawList(makeDrawList(this->instanceCount, instancesPerDraw));
+
+    vk::PhysicalDeviceFeatures features = this->physicalDevice.getFeatures();
+    this->loadingIndirect = features.drawIndirectFirstInstance || this->draws.size() <= 1;
+    if (this->loadingIndirect) {
+      this->maxIndirectDraws = this->indirectDrawLimit();
+      vk::DeviceSize commandsSize =
+        std::max<size_t>(this->draws.size(), 1) * sizeof(vk::DrawIndexedIndirectCommand);
+      for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+        this->loadingDrawBuffers.push_back
+          (this->createBuffer
+             (commandsSize,
+              vk::BufferUsageFlagBits::eIndirectBuffer,
+              vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent));
+      }
+      this->loadingDrawCounts =
+        std::vector<uint32_t>(this->FRAMES_IN_FLIGHT, std::numeric_limits<uint32_t>::max());
+    }
+
+    // A chunk bigger than the budget still goes in one frame.
+    vk::DeviceSize largestChunk = 0;
+    for (uint32_t i = 0; i < file.chunkCount(); ++i)
+      largestChunk =
+        std::max<vk::DeviceSize>(largestChunk, file.chunk(i).instanceCount * sizeof(Instance));
+    this->initUploadRing
+      ((this->FRAMES_IN_FLIGHT + 1) * std::max(loadBudget, largestChunk) + (1 << 20));
+  }
+
+  void initMesh
+    (const Vertex *vertices,
+     size_t vertexCount,
+     const uint16_t *indices,
+     size_t indexCount,
+     float radius) {
+
+    vk::MemoryPropertyFlags deviceLocal = vk::MemoryPropertyFlagBits::eDeviceLocal;
+    vk::BufferUsageFlags transferDst = vk::BufferUsageFlagBits::eTransferDst;
+
+    vk::DeviceSize vertexSize = vertexCount * sizeof(Vertex);
+    this->vertexBuffer =
+      this->createBuffer
+        (vertexSize, vk::BufferUsageFlagBits::eVertexBuffer | transferDst, deviceLocal);
+    this->uploadBuffer(this->vertexBuffer, vertices, vertexSize);
+
+    vk::DeviceSize indexSize = indexCount * sizeof(uint16_t);
+    this->indexBuffer =
+      this->createBuffer
+        (indexSize, vk::BufferUsageFlagBits::eIndexBuffer | transferDst, deviceLocal);
+    this->uploadBuffer(this->indexBuffer, indices, indexSize);
+
+    this->indexCount = indexCount;
+    this->meshRadius = radius;
+  }
+
+  // Creates instanceBuffer, with room for count instances and nothing in it.
+  void initInstanceBuffer(uint32_t count) {
+    // Zero-sized buffers aren't allowed, so an empty scene still gets one.
+    vk::DeviceSize instanceSize = std::max<size_t>(count, 1) * sizeof(Instance);
+    // Storage too, so that the culling pass can read it.
+    vk::BufferUsageFlags instanceUsage =
+      vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer;
+    this->instanceBuffer =
+      this->createBuffer
+        (instanceSize,
+         instanceUsage | vk::BufferUsageFlagBits::eTransferDst,
+         vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+    this->instanceCount = count;
+  }
+
+  void setDrawList(const std::vector<Draw> &draws) {
+    this->draws = draws;
+
+    // Enough slices to keep every worker busy, but not so many that setting
+    // up a secondary command buffer costs more than recording its draws.
+    const uint32_t minDrawsPerSlice = 64;
+    uint32_t wanted = (this->draws.size() + minDrawsPerSlice - 1) / minDrawsPerSlice;
+    this->sliceCount = std::max<uint32_t>(1, std::min(wanted, this->jobs.workerCount()));
+  }
+
+  // Where to look from. Baked into the command buffers when they're recorded
+  // up front, so it only takes effect every frame when recording every frame.
+  void setView(const View &view) {
+    this->view = view;
+    this->redraw = true;
+  }
+
+  // How many draws one indirect draw call can make.
+  uint32_t indirectDrawLimit() const {
+    return
+      this->physicalDevice.getFeatures().multiDrawIndirect ?
+        this->physicalDevice.getProperties().limits.maxDrawIndirectCount :
+        1;
+  }
+
+  // Sets up drawing from one indirect command per draw in the draw list, in
+  // each frame's drawCommandBuffers, for a compute pass (user) to fill in.
+  // usage is added to the buffers' own. Uploaded instances are then handed
+  // to the compute pass rather than the vertex input stage.
+  void initDrawCommandBuffers(const std::string &user, vk::BufferUsageFlags usage) {
+    vk::PhysicalDeviceFeatures features = this->physicalDevice.getFeatures();
+    this->maxIndirectDraws = this->indirectDrawLimit();
+
+    // Each draw's instances are written to the start of its own range, so
+    // its command needs a non-zero firstInstance unless there's only one.
+    if (!features.drawIndirectFirstInstance && this->draws.size() > 1) {
+      std::cerr << "drawIndirectFirstInstance isn't supported, so " << user
+                << " needs a single draw" << std::endl;
+      this->setDrawList(makeDrawList(this->instanceCount, 0));
+    }
+
+    if (this->uploading())
+      this->uploadRing.setConsumer
+        (vk::PipelineStageFlagBits::eComputeShader, vk::AccessFlagBits::eShaderRead);
+
+    vk::DeviceSize commandsSize =
+      std::max<size_t>(this->draws.size(), 1) * sizeof(vk::DrawIndexedIndirectCommand);
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      this->drawCommandBuffers.push_back
+        (this->createBuffer
+           (commandsSize,
+            vk::BufferUsageFlagBits::eIndirectBuffer |
+            vk::BufferUsageFlagBits::eStorageBuffer |
+            usage,
+            vk::MemoryPropertyFlagBits::eDeviceLocal));
+    }
+  }
+
+  // Moves the decision about what to draw to the GPU: see culledInstanceBuffers.
+  // Instances whose bounds are less than minPixels across are dropped along
+  // with those outside the view. Call after initGeometry and initStreaming.
+  void initCulling(float minPixels) {
+    assert(this->device);
+    assert(this->instanceBuffer.buffer);
+
+    this->culling = true;
+    this->minPixels = minPixels;
+
+    this->initDrawCommandBuffers("culling", vk::BufferUsageFlagBits::eTransferDst);
+
+    std::vector<vk::DrawIndexedIndirectCommand> commands;
+    for (auto &d : this->draws)
+      commands.push_back(vk::DrawIndexedIndirectCommand(this->indexCount, 0, 0, 0, d.firstInstance));
+    if (commands.empty())
+      commands.push_back(vk::DrawIndexedIndirectCommand(this->indexCount, 0, 0, 0, 0));
+    vk::DeviceSize commandsSize = commands.size() * sizeof(vk::DrawIndexedIndirectCommand);
+
+    vk::MemoryPropertyFlags deviceLocal = vk::MemoryPropertyFlagBits::eDeviceLocal;
+    this->drawCommandTemplate =
+      this->createBuffer
+        (commandsSize,
+         vk::BufferUsageFlagBits::eTransferSrc | vk::BufferUsageFlagBits::eTransferDst,
+         deviceLocal);
+    this->uploadBuffer(this->drawCommandTemplate, commands.data(), commandsSize);
+
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      this->culledInstanceBuffers.push_back
+        (this->createBuffer
+           (this->instanceBuffer.size,
+            vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer,
+            deviceLocal));
+    }
+
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    for (uint32_t binding = 0; binding < 3; ++binding) {
+      bindings.push_back
+        (vk::DescriptorSetLayoutBinding
+           (binding,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+            nullptr));
+    }
+    vk::DescriptorSetLayoutCreateInfo setLayoutInfo({}, bindings.size(), bindings.data());
+    this->cullSetLayout = this->device.createDescriptorSetLayout(setLayoutInfo);
+
+    vk::DescriptorPoolSize poolSize
+      (vk::DescriptorType::eStorageBuffer, bindings.size() * this->FRAMES_IN_FLIGHT);
+    vk::DescriptorPoolCreateInfo poolInfo({}, this->FRAMES_IN_FLIGHT, 1, &poolSize);
+    this->cullDescriptorPool = this->device.createDescriptorPool(poolInfo);
+
+    std::vector<vk::DescriptorSetLayout> setLayouts(this->FRAMES_IN_FLIGHT, this->cullSetLayout);
+    vk::DescriptorSetAllocateInfo setInfo
+      (this->cullDescriptorPool, setLayouts.size(), setLayouts.data());
+    this->cullDescriptorSets = this->device.allocateDescriptorSets(setInfo);
+
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      std::vector<vk::DescriptorBufferInfo> bufferInfos =
+        { vk::DescriptorBufferInfo(this->instanceBufferFor(i).buffer, 0, VK_WHOLE_SIZE),
+          vk::DescriptorBufferInfo(this->culledInstanceBuffers[i].buffer, 0, VK_WHOLE_SIZE),
+          vk::DescriptorBufferInfo(this->drawCommandBuffers[i].buffer, 0, VK_WHOLE_SIZE)
+        };
+
+      std::vector<vk::WriteDescriptorSet> writes;
+      for (uint32_t binding = 0; binding < bufferInfos.size(); ++binding) {
+        writes.push_back
+          (vk::WriteDescriptorSet
+             (this->cullDescriptorSets[i],
+              binding,
+              0,
+              1,
+              vk::DescriptorType::eStorageBuffer,
+              nullptr,
+              &bufferInfos[binding],
+              nullptr));
+      }
+      this->device.updateDescriptorSets(writes, nullptr);
+    }
+
+    vk::PushConstantRange pushConstants
+      (vk::ShaderStageFlagBits::eCompute, 0, sizeof(CullParameters));
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo
+      ({}, 1, &this->cullSetLayout, 1, &pushConstants);
+    this->cullPipelineLayout = this->device.createPipelineLayout(pipelineLayoutInfo);
+
+    vk::ShaderModule cullShaderModule = this->createShaderModule(shaderCode(cullSpirv));
+
+    SpecializationConstants cullConstants;
+    cullConstants.add(minPixels > 0);
+
+    vk::ComputePipelineCreateInfo cullPipelineInfo
+      ({},
+       vk::PipelineShaderStageCreateInfo
+         ({},
+          vk::ShaderStageFlagBits::eCompute,
+          cullShaderModule,
+          "main",
+          cullConstants.info()),
+       this->cullPipelineLayout,
+       nullptr,
+       -1);
+    this->cullPipeline =
+      this->device.createComputePipeline(this->pipelineCache, cullPipelineInfo);
+    this->device.destroyShaderModule(cullShaderModule);
+  }
+
+  // Resets the frame's draw commands and runs the culling pass, leaving the
+  // results ready for the vertex input and indirect draw stages.
+  void recordCulling(vk::CommandBuffer c, uint32_t frame) {
+    const Buffer &commands = this->drawCommandBuffers[frame];
+
+    c.copyBuffer
+      (this->drawCommandTemplate.buffer,
+       commands.buffer,
+       vk::BufferCopy(0, 0, this->drawCommandTemplate.size));
+
+    vk::BufferMemoryBarrier resetBarrier
+      (vk::AccessFlagBits::eTransferWrite,
+       vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+       VK_QUEUE_FAMILY_IGNORED,
+       VK_QUEUE_FAMILY_IGNORED,
+       commands.buffer,
+       0,
+       VK_WHOLE_SIZE);
+    c.pipelineBarrier
+      (vk::PipelineStageFlagBits::eTransfer,
+       vk::PipelineStageFlagBits::eComputeShader,
+       {},
+       nullptr,
+       resetBarrier,
+       nullptr);
+
+    if (this->loadedInstances > 0) {
+      CullParameters parameters;
+      parameters.view = this->view;
+      parameters.instanceCount = this->loadedInstances;
+      parameters.instancesPerDraw = this->draws.empty() ? 1 : this->draws[0].instanceCount;
+      parameters.meshRadius = this->meshRadius;
+      parameters.viewportSize[0] = this->renderExtent.width;
+      parameters.viewportSize[1] = this->renderExtent.height;
+      parameters.minPixels = this->minPixels;
+
+      c.bindPipeline(vk::PipelineBindPoint::eCompute, this->cullPipeline);
+      c.bindDescriptorSets
+        (vk::PipelineBindPoint::eCompute,
+         this->cullPipelineLayout,
+         0,
+         this->cullDescriptorSets[frame],
+         nullptr);
+      c.pushConstants
+        (this->cullPipelineLayout,
+         vk::ShaderStageFlagBits::eCompute,
+         0,
+         sizeof(parameters),
+         &parameters);
+      c.dispatch((this->loadedInstances + 63) / 64, 1, 1);
+    }
+
+    std::vector<vk::BufferMemoryBarrier> cullBarriers =
+      { vk::BufferMemoryBarrier
+          (vk::AccessFlagBits::eShaderWrite,
+           vk::AccessFlagBits::eIndirectCommandRead,
+           VK_QUEUE_FAMILY_IGNORED,
+           VK_QUEUE_FAMILY_IGNORED,
+           commands.buffer,
+           0,
+           VK_WHOLE_SIZE),
+        vk::BufferMemoryBarrier
+          (vk::AccessFlagBits::eShaderWrite,
+           vk::AccessFlagBits::eVertexAttributeRead,
+           VK_QUEUE_FAMILY_IGNORED,
+           VK_QUEUE_FAMILY_IGNORED,
+           this->culledInstanceBuffers[frame].buffer,
+           0,
+           VK_WHOLE_SIZE)
+      };
+    c.pipelineBarrier
+      (vk::PipelineStageFlagBits::eComputeShader,
+       vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexInput,
+       {},
+       nullptr,
+       cullBarriers,
+       nullptr);
+  }
+
+  // Draws the instances back to front, sorted on the GPU every frame: see
+  // sortedInstanceBuffers. Call after initGeometry, initStreaming and
+  // initSimulation.
+  void initSorting() {
+    assert(this->device);
+    assert(this->instanceBuffer.buffer);
+    assert(!this->culling);
+
+    this->sorting = true;
+    this->initDrawCommandBuffers("sorting", {});
+
+    // Zero-sized buffers aren't allowed.
+    uint32_t tileCount =
+      std::max<uint32_t>((this->instanceCount + this->SORT_TILE - 1) / this->SORT_TILE, 1);
+    vk::DeviceSize indicesSize = std::max<size_t>(this->instanceCount, 1) * sizeof(uint32_t);
+    vk::DeviceSize histogramSize = tileCount * this->SORT_DIGITS * sizeof(uint32_t);
+
+    vk::MemoryPropertyFlags deviceLocal = vk::MemoryPropertyFlagBits::eDeviceLocal;
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      this->sortedInstanceBuffers.push_back
+        (this->createBuffer
+           (this->instanceBuffer.size,
+            vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer,
+            deviceLocal));
+      for (uint32_t j = 0; j < 2; ++j)
+        this->sortIndexBuffers.push_back
+          (this->createBuffer(indicesSize, vk::BufferUsageFlagBits::eStorageBuffer, deviceLocal));
+      this->sortHistogramBuffers.push_back
+        (this->createBuffer(histogramSize, vk::BufferUsageFlagBits::eStorageBuffer, deviceLocal));
+    }
+
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    for (uint32_t binding = 0; binding < 6; ++binding) {
+      bindings.push_back
+        (vk::DescriptorSetLayoutBinding
+           (binding,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+            nullptr));
+    }
+    vk::DescriptorSetLayoutCreateInfo setLayoutInfo({}, bindings.size(), bindings.data());
+    this->sortSetLayout = this->device.createDescriptorSetLayout(setLayoutInfo);
+
+    vk::DescriptorPoolSize poolSize
+      (vk::DescriptorType::eStorageBuffer, bindings.size() * this->FRAMES_IN_FLIGHT);
+    vk::DescriptorPoolCreateInfo poolInfo({}, this->FRAMES_IN_FLIGHT, 1, &poolSize);
+    this->sortDescriptorPool = this->device.createDescriptorPool(poolInfo);
+
+    std::vector<vk::DescriptorSetLayout> setLayouts(this->FRAMES_IN_FLIGHT, this->sortSetLayout);
+    vk::DescriptorSetAllocateInfo setInfo
+      (this->sortDescriptorPool, setLayouts.size(), setLayouts.data());
+    this->sortDescriptorSets = this->device.allocateDescriptorSets(setInfo);
+
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      std::vector<vk::DescriptorBufferInfo> bufferInfos =
+        { vk::DescriptorBufferInfo(this->instanceBufferFor(i).buffer, 0, VK_WHOLE_SIZE),
+          vk::DescriptorBufferInfo(this->sortIndexBuffers[i * 2].buffer, 0, VK_WHOLE_SIZE),
+          vk::DescriptorBufferInfo(this->sortIndexBuffers[i * 2 + 1].buffer, 0, VK_WHOLE_SIZE),
+          vk::DescriptorBufferInfo(this->sortHistogramBuffers[i].buffer, 0, VK_WHOLE_SIZE),
+          vk::DescriptorBufferInfo(this->sortedInstanceBuffers[i].buffer, 0, VK_WHOLE_SIZE),
+          vk::DescriptorBufferInfo(this->drawCommandBuffers[i].buffer, 0, VK_WHOLE_SIZE)
+        };
+
+      std::vector<vk::WriteDescriptorSet> writes;
+      for (uint32_t binding = 0; binding < bufferInfos.size(); ++binding) {
+        writes.push_back
+          (vk::WriteDescriptorSet
+             (this->sortDescriptorSets[i],
+              binding,
+              0,
+              1,
+              vk::DescriptorType::eStorageBuffer,
+              nullptr,
+              &bufferInfos[binding],
+              nullptr));
+      }
+      this->device.updateDescriptorSets(writes, nullptr);
+    }
+
+    vk::PushConstantRange pushConstants
+      (vk::ShaderStageFlagBits::eCompute, 0, sizeof(SortParameters));
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo
+      ({}, 1, &this->sortSetLayout, 1, &pushConstants);
+    this->sortPipelineLayout = this->device.createPipelineLayout(pipelineLayoutInfo);
+
+    vk::ShaderModule sortShaderModule = this->createShaderModule(shaderCode(sortSpirv));
+
+    // Count, scan and scatter.
+    for (uint32_t stage = 0; stage < 3; ++stage) {
+      SpecializationConstants sortConstants;
+      sortConstants.add(stage);
+
+      vk::ComputePipelineCreateInfo sortPipelineInfo
+        ({},
+         vk::PipelineShaderStageCreateInfo
+           ({},
+            vk::ShaderStageFlagBits::eCompute,
+            sortShaderModule,
+            "main",
+            sortConstants.info()),
+         this->sortPipelineLayout,
+         nullptr,
+         -1);
+      this->sortPipelines.push_back
+        (this->device.createComputePipeline(this->pipelineCache, sortPipelineInfo));
+    }
+    this->device.destroyShaderModule(sortShaderModule);
+  }
+
+  // Sorts the frame's instances and writes its draw commands, leaving both
+  // ready for the vertex input and indirect draw stages.
+  void recordSorting(vk::CommandBuffer c, uint32_t frame) {
+    uint32_t tileCount = (this->loadedInstances + this->SORT_TILE - 1) / this->SORT_TILE;
+
+    SortParameters parameters;
+    parameters.instanceCount = this->loadedInstances;
+    parameters.tileCount = tileCount;
+    parameters.indexCount = this->indexCount;
+    parameters.instancesPerDraw = this->draws.empty() ? 1 : this->draws[0].instanceCount;
+    parameters.drawCount = this->draws.size();
+
+    // Each dispatch reads what the one before it wrote.
+    vk::MemoryBarrier stageBarrier
+      (vk::AccessFlagBits::eShaderWrite,
+       vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite);
+    auto dispatch = [&](uint32_t stage, uint32_t groups) {
+      c.bindPipeline(vk::PipelineBindPoint::eCompute, this->sortPipelines[stage]);
+      c.dispatch(groups, 1, 1);
+    };
+    auto wait = [&]() {
+      c.pipelineBarrier
+        (vk::PipelineStageFlagBits::eComputeShader,
+         vk::PipelineStageFlagBits::eComputeShader,
+         {},
+         stageBarrier,
+         nullptr,
+         nullptr);
+    };
+
+    c.bindDescriptorSets
+      (vk::PipelineBindPoint::eCompute,
+       this->sortPipelineLayout,
+       0,
+       this->sortDescriptorSets[frame],
        nullptr);
 
-    this->swapchain = this->device.createSwapchainKHR(swapchainInfo, nullptr, this->loader);
+    // With nothing to sort, the first scan still writes the (empty) draw
+    // commands.
+    uint32_t passCount = tileCount > 0 ? this->SORT_PASSES : 1;
+    for (uint32_t pass = 0; pass < passCount; ++pass) {
+      parameters.pass = pass;
+      c.pushConstants
+        (this->sortPipelineLayout,
+         vk::ShaderStageFlagBits::eCompute,
+         0,
+         sizeof(parameters),
+         &parameters);
+
+      if (pass > 0)
+        wait();
+      if (tileCount > 0) {
+        dispatch(0, tileCount);
+        wait();
+      }
+      dispatch(1, 1);
+      if (tileCount > 0) {
+        wait();
+        dispatch(2, tileCount);
+      }
+    }
+
+    std::vector<vk::BufferMemoryBarrier> sortBarriers =
+      { vk::BufferMemoryBarrier
+          (vk::AccessFlagBits::eShaderWrite,
+           vk::AccessFlagBits::eIndirectCommandRead,
+           VK_QUEUE_FAMILY_IGNORED,
+           VK_QUEUE_FAMILY_IGNORED,
+           this->drawCommandBuffers[frame].buffer,
+           0,
+           VK_WHOLE_SIZE),
+        vk::BufferMemoryBarrier
+          (vk::AccessFlagBits::eShaderWrite,
+           vk::AccessFlagBits::eVertexAttributeRead,
+           VK_QUEUE_FAMILY_IGNORED,
+           VK_QUEUE_FAMILY_IGNORED,
+           this->sortedInstanceBuffers[frame].buffer,
+           0,
+           VK_WHOLE_SIZE)
+      };
+    c.pipelineBarrier
+      (vk::PipelineStageFlagBits::eComputeShader,
+       vk::PipelineStageFlagBits::eDrawIndirect | vk::PipelineStageFlagBits::eVertexInput,
+       {},
+       nullptr,
+       sortBarriers,
+       nullptr);
+  }
+
+  // Gives each frame in flight its own instance buffer, to be rewritten by
+  // streamFrame while the other frames are still reading theirs.
+  void initStreaming(const Scene &scene) {
+    assert(this->device);
+    assert(this->transferQfIx);
+    assert(this->instanceBuffer.buffer);
+
+    this->streaming = true;
+    this->streamSource = scene.instances;
+
+    vk::DeviceSize instanceSize = this->instanceBuffer.size;
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      this->streamedInstanceBuffers.push_back
+        (this->createBuffer
+           (instanceSize,
+            vk::BufferUsageFlagBits::eVertexBuffer |
+            vk::BufferUsageFlagBits::eStorageBuffer |
+            vk::BufferUsageFlagBits::eTransferDst,
+            vk::MemoryPropertyFlagBits::eDeviceLocal));
+    }
+
+    // Room for one more frame than can be in flight, since wrapping around
+    // the end of the ring can waste up to a frame's worth.
+    this->initUploadRing((this->FRAMES_IN_FLIGHT + 1) * instanceSize + (1 << 20));
+  }
+
+  void initUploadRing(vk::DeviceSize size) {
+    this->uploadRing.init
+      (this->allocator,
+       this->device,
+       this->transferQueue,
+       *this->transferQfIx,
+       *this->graphicsQfIx,
+       size,
+       this->FRAMES_IN_FLIGHT);
+
+    vk::CommandPoolCreateInfo commandPoolInfo
+      (vk::CommandPoolCreateFlagBits::eResetCommandBuffer |
+       vk::CommandPoolCreateFlagBits::eTransient,
+       *this->graphicsQfIx);
+    this->frameCommandPool = this->device.createCommandPool(commandPoolInfo);
+
+    vk::CommandBufferAllocateInfo allocateInfo
+      (this->frameCommandPool,
+       vk::CommandBufferLevel::ePrimary,
+       this->FRAMES_IN_FLIGHT);
+    this->acquireCommandBuffers = this->device.allocateCommandBuffers(allocateInfo);
+  }
+
+  // Moves the instances with a simulation on the compute queue: see
+  // simulatedInstanceBuffers. Call after initGeometry, and before
+  // initCulling. Can't be combined with streaming.
+  void initSimulation(const Scene &scene) {
+    assert(this->device);
+    assert(this->computeQfIx);
+    assert(this->instanceBuffer.buffer);
+    assert(!this->streaming);
+
+    this->simulating = true;
+
+    vk::CommandPoolCreateInfo commandPoolInfo({}, *this->computeQfIx);
+    this->simulateCommandPool = this->device.createCommandPool(commandPoolInfo);
+
+    // Uploaded through the compute queue, since only it ever uses them.
+    std::vector<Particle> particles = makeParticles(scene.instances);
+    vk::DeviceSize particleSize = std::max<size_t>(particles.size(), 1) * sizeof(Particle);
+    this->particleBuffer =
+      this->createBuffer
+        (particleSize,
+         vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst,
+         vk::MemoryPropertyFlagBits::eDeviceLocal);
+    if (!particles.empty())
+      this->uploadBuffer
+        (this->particleBuffer,
+         particles.data(), particles.size() * sizeof(Particle),
+         this->computeQueue, this->simulateCommandPool);
+
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      this->simulatedInstanceBuffers.push_back
+        (this->createBuffer
+           (this->instanceBuffer.size,
+            vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eStorageBuffer,
+            vk::MemoryPropertyFlagBits::eDeviceLocal));
+      this->simulatedSems.push_back(this->device.createSemaphore(vk::SemaphoreCreateInfo()));
+    }
+
+    std::vector<vk::DescriptorSetLayoutBinding> bindings;
+    for (uint32_t binding = 0; binding < 2; ++binding) {
+      bindings.push_back
+        (vk::DescriptorSetLayoutBinding
+           (binding,
+            vk::DescriptorType::eStorageBuffer,
+            1,
+            vk::ShaderStageFlagBits::eCompute,
+            nullptr));
+    }
+    vk::DescriptorSetLayoutCreateInfo setLayoutInfo({}, bindings.size(), bindings.data());
+    this->simulateSetLayout = this->device.createDescriptorSetLayout(setLayoutInfo);
+
+    vk::DescriptorPoolSize poolSize
+      (vk::DescriptorType::eStorageBuffer, bindings.size() * this->FRAMES_IN_FLIGHT);
+    vk::DescriptorPoolCreateInfo poolInfo({}, this->FRAMES_IN_FLIGHT, 1, &poolSize);
+    this->simulateDescriptorPool = this->device.createDescriptorPool(poolInfo);
+
+    std::vector<vk::DescriptorSetLayout> setLayouts(this->FRAMES_IN_FLIGHT, this->simulateSetLayout);
+    vk::DescriptorSetAllocateInfo setInfo
+      (this->simulateDescriptorPool, setLayouts.size(), setLayouts.data());
+    this->simulateDescriptorSets = this->device.allocateDescriptorSets(setInfo);
+
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      std::vector<vk::DescriptorBufferInfo> bufferInfos =
+        { vk::DescriptorBufferInfo(this->particleBuffer.buffer, 0, VK_WHOLE_SIZE),
+          vk::DescriptorBufferInfo(this->simulatedInstanceBuffers[i].buffer, 0, VK_WHOLE_SIZE)
+        };
+
+      std::vector<vk::WriteDescriptorSet> writes;
+      for (uint32_t binding = 0; binding < bufferInfos.size(); ++binding) {
+        writes.push_back
+          (vk::WriteDescriptorSet
+             (this->simulateDescriptorSets[i],
+              binding,
+              0,
+              1,
+              vk::DescriptorType::eStorageBuffer,
+              nullptr,
+              &bufferInfos[binding],
+              nullptr));
+      }
+      this->device.updateDescriptorSets(writes, nullptr);
+    }
+
+    vk::PushConstantRange pushConstants
+      (vk::ShaderStageFlagBits::eCompute, 0, sizeof(SimulationStep));
+    vk::PipelineLayoutCreateInfo pipelineLayoutInfo
+      ({}, 1, &this->simulateSetLayout, 1, &pushConstants);
+    this->simulatePipelineLayout = this->device.createPipelineLayout(pipelineLayoutInfo);
+
+    vk::ShaderModule simulateShaderModule = this->createShaderModule(shaderCode(simulateSpirv));
+    vk::ComputePipelineCreateInfo simulatePipelineInfo
+      ({},
+       vk::PipelineShaderStageCreateInfo
+         ({},
+          vk::ShaderStageFlagBits::eCompute,
+          simulateShaderModule,
+          "main",
+          nullptr),
+       this->simulatePipelineLayout,
+       nullptr,
+       -1);
+    this->simulatePipeline =
+      this->device.createComputePipeline(this->pipelineCache, simulatePipelineInfo);
+    this->device.destroyShaderModule(simulateShaderModule);
+
+    // Every step is the same, so each slot's is recorded once.
+    vk::CommandBufferAllocateInfo allocateInfo
+      (this->simulateCommandPool,
+       vk::CommandBufferLevel::ePrimary,
+       this->FRAMES_IN_FLIGHT);
+    this->simulateCommandBuffers = this->device.allocateCommandBuffers(allocateInfo);
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i)
+      this->recordSimulation(this->simulateCommandBuffers[i], i);
+  }
+
+  void recordSimulation(vk::CommandBuffer c, uint32_t frame) {
+    c.begin(vk::CommandBufferBeginInfo({}, nullptr));
+
+    // The previous step, submitted from either slot, has finished with the
+    // particles.
+    vk::BufferMemoryBarrier stepBarrier
+      (vk::AccessFlagBits::eShaderWrite,
+       vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+       VK_QUEUE_FAMILY_IGNORED,
+       VK_QUEUE_FAMILY_IGNORED,
+       this->particleBuffer.buffer,
+       0,
+       VK_WHOLE_SIZE);
+    c.pipelineBarrier
+      (vk::PipelineStageFlagBits::eComputeShader,
+       vk::PipelineStageFlagBits::eComputeShader,
+       {},
+       nullptr,
+       stepBarrier,
+       nullptr);
+
+    if (this->instanceCount > 0) {
+      SimulationStep step;
+      step.instanceCount = this->instanceCount;
+      step.dt = 1 / 60.0f;
+
+      c.bindPipeline(vk::PipelineBindPoint::eCompute, this->simulatePipeline);
+      c.bindDescriptorSets
+        (vk::PipelineBindPoint::eCompute,
+         this->simulatePipelineLayout,
+         0,
+         this->simulateDescriptorSets[frame],
+         nullptr);
+      c.pushConstants
+        (this->simulatePipelineLayout,
+         vk::ShaderStageFlagBits::eCompute,
+         0,
+         sizeof(step),
+         &step);
+      c.dispatch((this->instanceCount + 63) / 64, 1, 1);
+    }
+
+    // The release half of the transfer; recordPrimary has the acquire. The
+    // graphics family's last use of the buffer needs no transfer back, since
+    // every step overwrites all of it.
+    if (this->simulationTransfers()) {
+      vk::BufferMemoryBarrier release
+        (vk::AccessFlagBits::eShaderWrite,
+         {},
+         *this->computeQfIx,
+         *this->graphicsQfIx,
+         this->simulatedInstanceBuffers[frame].buffer,
+         0,
+         VK_WHOLE_SIZE);
+      c.pipelineBarrier
+        (vk::PipelineStageFlagBits::eComputeShader,
+         vk::PipelineStageFlagBits::eBottomOfPipe,
+         {},
+         nullptr,
+         release,
+         nullptr);
+    }
+
+    c.end();
+  }
+
+  uint64_t trianglesPerFrame() const {
+    return (uint64_t) (this->indexCount / 3) * this->instanceCount;
+  }
+
+  // Where the simulation runs.
+  std::string simulationQueue() const {
+    return this->simulationTransfers() ? "compute family" : "graphics family";
+  }
+
+  uint32_t drawsPerFrame() const {
+    return this->draws.size();
+  }
+
+  // Starts the threads that record command buffers. The main thread is one
+  // of the workers.
+  void initJobs(uint32_t workerCount) {
+    this->jobs.start(std::max<uint32_t>(workerCount, 1));
+  }
+
+  uint32_t workerCount() const {
+    return this->jobs.workerCount();
+  }
+
+  // The primary command buffers come from commandPool, and the secondaries
+  // from the workers' own pools.
+  void initCommandPool() {
+    vk::CommandPoolCreateInfo commandPoolInfo({}, *this->graphicsQfIx);
+    this->commandPool = this->device.createCommandPool(commandPoolInfo);
+
+    this->workerPools = this->createWorkerPools();
   }
 
-  void initRenderPass() {
-    assert(this->device);
-    assert(this->swapchain);
+  // A pool for every worker in every slot.
+  std::vector<WorkerPool> createWorkerPools() {
+    std::vector<WorkerPool> workerPools;
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT * this->jobs.workerCount(); ++i) {
+      vk::CommandPoolCreateInfo workerPoolInfo
+        (vk::CommandPoolCreateFlagBits::eTransient, *this->graphicsQfIx);
+
+      WorkerPool workerPool;
+      workerPool.pool = this->device.createCommandPool(workerPoolInfo);
+      workerPool.next = 0;
+      workerPools.push_back(workerPool);
+    }
+    return workerPools;
+  }
 
-    vk::AttachmentDescription colorAttachment
-      ({},
-       this->swapchainFormat,
-       vk::SampleCountFlagBits::e1,
-       vk::AttachmentLoadOp::eClear,
-       vk::AttachmentStoreOp::eStore,
-       vk::AttachmentLoadOp::eDontCare,
-       vk::AttachmentStoreOp::eDontCare,
-       vk::ImageLayout::eUndefined,
-       vk::ImageLayout::ePresentSrcKHR);
+  // Hands the worker pools, and the secondaries recorded from them, over to
+  // retired, to be reset once the frames using them are done, and takes a
+  // spare set to record into. Does nothing when recording every frame,
+  // where waitForFrame resets a slot's pools as soon as its fence signals.
+  void retireWorkerPools(RetiredResources &retired) {
+    if (this->recordEveryFrame)
+      return;
 
-    std::vector<vk::AttachmentReference> colorAttachments =
-      { vk::AttachmentReference(0, vk::ImageLayout::eColorAttachmentOptimal)
-      };
+    retired.workerPools = this->workerPools;
+    if (this->spareWorkerPools.empty()) {
+      this->workerPools = this->createWorkerPools();
+    } else {
+      this->workerPools = this->spareWorkerPools.back();
+      this->spareWorkerPools.pop_back();
+    }
+    this->secondaryCommandBuffers.clear();
+  }
 
-    vk::SubpassDescription subpass
-      ({},
-       vk::PipelineBindPoint::eGraphics,
-       0, nullptr,
-       colorAttachments.size(), colorAttachments.data(), nullptr,
-       nullptr,
-       0, nullptr);
+  // Switches from recording every command buffer up front to recording each
+  // frame's just before it's submitted, so that the draw list can change
+  // from one frame to the next. Each slot gets a primary command buffer of
+  // its own, from a pool that's reset along with the slot's worker pools
+  // once the slot's fence has signalled.
+  void initPerFrameRecording() {
+    assert(this->device);
+    assert(this->commandBuffers.empty());
 
-    vk::SubpassDependency subpassDep
-      (VK_SUBPASS_EXTERNAL,
-       0,
-       vk::PipelineStageFlagBits::eColorAttachmentOutput,
-       vk::PipelineStageFlagBits::eColorAttachmentOutput,
-       {},
-       vk::AccessFlagBits::eColorAttachmentRead | vk::AccessFlagBits::eColorAttachmentWrite,
-       {});
+    this->recordEveryFrame = true;
 
-    std::vector<vk::AttachmentDescription> attachmentDescs = { colorAttachment };
-    std::vector<vk::SubpassDescription> subpasses = { subpass };
-    std::vector<vk::SubpassDependency> subpassDeps = { subpassDep };
-    vk::RenderPassCreateInfo renderpassInfo
-      ({},
-       attachmentDescs.size(), attachmentDescs.data(),
-       subpasses.size(), subpasses.data(),
-       subpassDeps.size(), subpassDeps.data());
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      vk::CommandPoolCreateInfo poolInfo
+        (vk::CommandPoolCreateFlagBits::eTransient, *this->graphicsQfIx);
+      this->perFramePools.push_back(this->device.createCommandPool(poolInfo));
 
-    this->renderpass = this->device.createRenderPass(renderpassInfo);
+      vk::CommandBufferAllocateInfo allocateInfo
+        (this->perFramePools[i],
+         vk::CommandBufferLevel::ePrimary,
+         1);
+      this->perFrameCommandBuffers.push_back(this->device.allocateCommandBuffers(allocateInfo)[0]);
+    }
   }
 
-  void initImageViews() {
-    assert(this->device);
-    assert(this->swapchain);
+  // Frees up everything a slot recorded last time round. Only called once
+  // the slot's fence has signalled.
+  void resetFrameCommands(uint32_t frame) {
+    this->device.resetCommandPool(this->perFramePools[frame], {});
 
-    std::vector<vk::Image> images =
-      this->device.getSwapchainImagesKHR(this->swapchain, this->loader);
+    uint32_t workerCount = this->jobs.workerCount();
+    for (uint32_t worker = 0; worker < workerCount; ++worker) {
+      WorkerPool &workerPool = this->workerPools[frame * workerCount + worker];
+      this->device.resetCommandPool(workerPool.pool, {});
+      workerPool.next = 0;
+    }
+  }
 
-    this->imageViews = std::vector<vk::ImageView>(images.size());
+  // A secondary command buffer from a worker's pool for a slot. The buffers
+  // allocated before the pool was last reset are reused, so the pool only
+  // grows when a frame needs more of them than any before it.
+  vk::CommandBuffer allocateSecondary(uint32_t frame, uint32_t worker) {
+    WorkerPool &workerPool = this->workerPools[frame * this->jobs.workerCount() + worker];
 
-    for (size_t i = 0; i < images.size(); ++i) {
-      vk::ImageViewCreateInfo imageViewInfo
-        ({},
-         images[i],
-         vk::ImageViewType::e2D,
-         swapchainFormat,
-         vk::ComponentMapping
-         (vk::ComponentSwizzle::eIdentity,
-          vk::ComponentSwizzle::eIdentity,
-          vk::ComponentSwizzle::eIdentity,
-          vk::ComponentSwizzle::eIdentity),
-         vk::ImageSubresourceRange(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1)
-         );
-      this->imageViews[i] = this->device.createImageView(imageViewInfo);
-    }
+    if (workerPool.next < workerPool.secondaries.size())
+      return workerPool.secondaries[workerPool.next++];
+
+    vk::CommandBufferAllocateInfo allocateInfo
+      (workerPool.pool,
+       vk::CommandBufferLevel::eSecondary,
+       1);
+    vk::CommandBuffer c = this->device.allocateCommandBuffers(allocateInfo)[0];
+
+    workerPool.secondaries.push_back(c);
+    ++workerPool.next;
+    return c;
   }
 
-  void initFramebuffers() {
-    assert(this->device);
-    assert(this->swapchain);
-    assert(this->renderpass);
-    assert(!this->imageViews.empty());
+  // Records a slot's slices of the draw list in parallel, and returns them in
+  // draw order: with a pre-pass, every slice of the pre-pass, then every
+  // slice of the colour pass. A secondary command buffer doesn't inherit the
+  // primary's dynamic state, so each one sets its own viewport and scissor,
+  // and they're recorded without a framebuffer so that every swapchain image
+  // can share them.
+  std::vector<vk::CommandBuffer> recordSecondaries
+    (uint32_t frame,
+     vk::CommandBufferUsageFlags usage) {
+
+    uint32_t sliceCount = this->sliceCount;
+    std::vector<vk::CommandBuffer> secondaries(this->secondariesPerFrame());
+
+    this->jobs.run
+      (secondaries.size(),
+       [&](uint32_t worker, uint32_t job) {
+         uint32_t slice = job % sliceCount;
+         uint32_t subpass = this->depthPrepass ? job / sliceCount : 0;
+         bool depthOnly = this->depthPrepass && 0 == subpass;
+
+         vk::CommandBuffer c = this->allocateSecondary(frame, worker);
+         secondaries[job] = c;
+
+         vk::CommandBufferInheritanceInfo inheritanceInfo
+           (this->renderpass,
+            subpass,
+            vk::Framebuffer(),
+            false,
+            {},
+            this->statisticsPools.empty() ? vk::QueryPipelineStatisticFlags() : this->statisticsFlags());
+
+         c.begin
+           (vk::CommandBufferBeginInfo
+              (usage | vk::CommandBufferUsageFlagBits::eRenderPassContinue,
+               &inheritanceInfo));
+
+         vk::Viewport viewport =
+           vk::Viewport(0, 0, this->renderExtent.width, this->renderExtent.height, 0, 1);
+         vk::Rect2D scissor = vk::Rect2D(vk::Offset2D(0, 0), this->renderExtent);
+         c.setViewport(0, viewport);
+         c.setScissor(0, scissor);
+
+         c.bindPipeline
+           (vk::PipelineBindPoint::eGraphics, depthOnly ? this->depthPipeline : this->pipeline);
+         c.pushConstants
+           (this->pipelineLayout,
+            vk::ShaderStageFlagBits::eVertex,
+            0,
+            sizeof(View),
+            &this->view);
+
+         vk::Buffer instances =
+           this->culling ? this->culledInstanceBuffers[frame].buffer :
+           this->sorting ? this->sortedInstanceBuffers[frame].buffer :
+           this->instanceBufferFor(frame).buffer;
+         std::vector<vk::Buffer> vertexBuffers = { this->vertexBuffer.buffer, instances };
+         std::vector<vk::DeviceSize> vertexOffsets = { 0, 0 };
+         c.bindVertexBuffers(0, vertexBuffers, vertexOffsets);
+         c.bindIndexBuffer(this->indexBuffer.buffer, 0, vk::IndexType::eUint16);
+
+         size_t first = slice * this->draws.size() / sliceCount;
+         size_t last = (slice + 1) * this->draws.size() / sliceCount;
+         if (this->culling || this->sorting) {
+           // The draw commands are written on the GPU.
+           vk::DeviceSize stride = sizeof(vk::DrawIndexedIndirectCommand);
+           for (size_t i = first; i < last; i += this->maxIndirectDraws) {
+             uint32_t count = std::min<size_t>(last - i, this->maxIndirectDraws);
+             c.drawIndexedIndirect
+               (this->drawCommandBuffers[frame].buffer, i * stride, count, stride);
+           }
+         } else if (this->loadingIndirect) {
+           // Written every frame by writeLoadingDraws.
+           vk::DeviceSize stride = sizeof(vk::DrawIndexedIndirectCommand);
+           for (size_t i = first; i < last; i += this->maxIndirectDraws) {
+             uint32_t count = std::min<size_t>(last - i, this->maxIndirectDraws);
+             c.drawIndexedIndirect
+               (this->loadingDrawBuffers[frame].buffer, i * stride, count, stride);
+           }
+         } else {
+           // Instances that are still loading aren't drawn.
+           uint32_t loaded = this->loadedInstances;
+           for (size_t i = first; i < last && this->draws[i].firstInstance < loaded; ++i) {
+             const Draw &d = this->draws[i];
+             c.drawIndexed
+               (this->indexCount,
+                std::min(d.instanceCount, loaded - d.firstInstance),
+                0, 0, d.firstInstance);
+           }
+         }
+
+         // The first slice's time includes the pre-pass.
+         if (!this->timestampPools.empty() && !depthOnly)
+           c.writeTimestamp
+             (vk::PipelineStageFlagBits::eBottomOfPipe, this->timestampPools[frame], 2 + slice);
+
+         c.end();
+       });
+
+    return secondaries;
+  }
 
-    size_t count = this->imageViews.size();
-    this->framebuffers = std::vector<vk::Framebuffer>(count);
-    for (size_t i = 0; i < count; ++i) {
-      vk::FramebufferCreateInfo framebufferInfo
+  // Records the primary command buffer that renders a slot's frame to an
+  // image, by running the slot's secondaries inside the render pass.
+  void recordPrimary
+    (vk::CommandBuffer c,
+     uint32_t frame,
+     uint32_t image,
+     const std::vector<vk::CommandBuffer> &secondaries,
+     vk::CommandBufferUsageFlags usage) {
+
+    c.begin(vk::CommandBufferBeginInfo(usage, nullptr));
+
+    if (!this->timestampPools.empty()) {
+      c.resetQueryPool(this->timestampPools[frame], 0, this->timestampCount());
+      c.writeTimestamp
+        (vk::PipelineStageFlagBits::eTopOfPipe, this->timestampPools[frame], 0);
+    }
+
+    if (this->simulationTransfers()) {
+      vk::BufferMemoryBarrier acquire
         ({},
-         this->renderpass,
-         1, &imageViews[i],
-         this->swapchainExtent.width, this->swapchainExtent.height,
-         1);
+         this->instanceReadAccess(),
+         *this->computeQfIx,
+         *this->graphicsQfIx,
+         this->simulatedInstanceBuffers[frame].buffer,
+         0,
+         VK_WHOLE_SIZE);
+      c.pipelineBarrier
+        (this->instanceReadStage(),
+         this->instanceReadStage(),
+         {},
+         nullptr,
+         acquire,
+         nullptr);
+    }
 
-      this->framebuffers[i] = this->device.createFramebuffer(framebufferInfo);
+    if (this->culling)
+      this->recordCulling(c, frame);
+    if (this->sorting)
+      this->recordSorting(c, frame);
+
+    if (!this->timestampPools.empty())
+      c.writeTimestamp
+        (vk::PipelineStageFlagBits::eBottomOfPipe, this->timestampPools[frame], 1);
+
+    if (!this->statisticsPools.empty()) {
+      c.resetQueryPool(this->statisticsPools[frame], 0, 1);
+      c.beginQuery(this->statisticsPools[frame], 0, {});
+    }
+
+    std::vector<vk::ClearValue> clearValues =
+      { vk::ClearValue().setColor(vk::ClearColorValue().setFloat32({{ 1, 1, 1, 1 }})),
+        vk::ClearValue().setDepthStencil(vk::ClearDepthStencilValue(1, 0))
+      };
+    if (!this->depthTesting)
+      clearValues.pop_back();
+    vk::RenderPassBeginInfo renderpassBeginInfo
+      (this->renderpass,
+       this->dynamicResolution ? this->renderTargets[frame].framebuffer : this->framebuffers[image],
+       vk::Rect2D(vk::Offset2D(0, 0), this->renderExtent),
+       clearValues.size(),
+       clearValues.data()
+       );
+    c.beginRenderPass(renderpassBeginInfo, vk::SubpassContents::eSecondaryCommandBuffers);
+
+    std::vector<vk::CommandBuffer> buffers;
+    for (size_t i = 0; i < secondaries.size(); ++i) {
+      if (this->depthPrepass && this->sliceCount == i) {
+        c.executeCommands(buffers);
+        c.nextSubpass(vk::SubpassContents::eSecondaryCommandBuffers);
+        buffers.clear();
+      }
+      buffers.push_back(secondaries[i]);
     }
+    c.executeCommands(buffers);
+
+    c.endRenderPass();
+
+    if (!this->statisticsPools.empty())
+      c.endQuery(this->statisticsPools[frame], 0);
+
+    if (this->dynamicResolution)
+      this->recordUpscale
+        (c, frame, this->headless ? this->offscreenImages[image] : this->swapchainImages[image]);
+    if (!this->timestampPools.empty())
+      c.writeTimestamp
+        (vk::PipelineStageFlagBits::eBottomOfPipe,
+         this->timestampPools[frame],
+         this->timestampCount() - 1);
+
+    c.end();
   }
 
-  void initCommandPool() {
-    vk::CommandPoolCreateInfo commandPoolInfo({}, *this->graphicsQfIx);
-    this->commandPool = this->device.createCommandPool(commandPoolInfo);
+  // Records a slot's command buffers for this frame from the current draw
+  // list. Only used when recording every frame.
+  void recordFrame(uint32_t frame, uint32_t image) {
+    assert(this->recordEveryFrame);
+
+    std::vector<vk::CommandBuffer> secondaries =
+      this->recordSecondaries(frame, vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+    this->recordPrimary
+      (this->perFrameCommandBuffers[frame],
+       frame,
+       image,
+       secondaries,
+       vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+  }
+
+  vk::CommandBuffer commandBufferFor(uint32_t frame, uint32_t image) const {
+    if (this->recordEveryFrame)
+      return this->perFrameCommandBuffers[frame];
+    return this->commandBuffers[this->commandBufferIndex(frame, image)];
   }
 
+  // Records a command buffer for every pairing of frame-in-flight slot and
+  // image, to be replayed unchanged until the swapchain is recreated. Does
+  // nothing when recording every frame.
   void initCommandBuffers() {
     assert(this->device);
     assert(this->commandPool);
     assert(!this->framebuffers.empty());
     assert(this->renderpass);
-    assert(this->swapchain);
+    assert(this->swapchain || this->headless);
     assert(this->pipeline);
+    assert(this->depthPipeline || !this->depthPrepass);
+
+    if (this->recordEveryFrame)
+      return;
+
+    this->secondaryCommandBuffers.clear();
+    for (uint32_t frame = 0; frame < this->FRAMES_IN_FLIGHT; ++frame) {
+      std::vector<vk::CommandBuffer> secondaries =
+        this->recordSecondaries(frame, vk::CommandBufferUsageFlagBits::eSimultaneousUse);
+      this->secondaryCommandBuffers.insert
+        (this->secondaryCommandBuffers.end(), secondaries.begin(), secondaries.end());
+    }
 
     vk::CommandBufferAllocateInfo allocateInfo
       (this->commandPool,
        vk::CommandBufferLevel::ePrimary,
-       this->framebuffers.size());
+       this->FRAMES_IN_FLIGHT * this->framebuffers.size());
 
     this->commandBuffers =
       this->device.allocateCommandBuffers(allocateInfo);
 
-    for (size_t i = 0; i < this->commandBuffers.size(); ++i) {
-      auto &c = this->commandBuffers[i];
-      vk::CommandBufferBeginInfo beginInfo
-        (vk::CommandBufferUsageFlagBits::eSimultaneousUse, nullptr);
-      c.begin(beginInfo);
+    for (size_t ix = 0; ix < this->commandBuffers.size(); ++ix) {
+      uint32_t frame = ix / this->framebuffers.size();
+      uint32_t image = ix % this->framebuffers.size();
 
-      std::vector<vk::ClearValue> clearValues =
-        { vk::ClearValue().setColor(vk::ClearColorValue().setFloat32({{ 1, 1, 1, 1 }}))
-        };
-      vk::RenderPassBeginInfo renderpassBeginInfo
-        (this->renderpass,
-          this->framebuffers[i],
-          vk::Rect2D(vk::Offset2D(0, 0), this->swapchainExtent),
-          clearValues.size(),
-          clearValues.data()
-          );
-      c.beginRenderPass(renderpassBeginInfo, vk::SubpassContents::eInline);
+      std::vector<vk::CommandBuffer> secondaries
+        (this->secondaryCommandBuffers.begin() + frame * this->secondariesPerFrame(),
+         this->secondaryCommandBuffers.begin() + (frame + 1) * this->secondariesPerFrame());
+
+      this->recordPrimary
+        (this->commandBuffers[ix],
+         frame,
+         image,
+         secondaries,
+         vk::CommandBufferUsageFlagBits::eSimultaneousUse);
+    }
+  }
+
+  // Timestamps need a graphics queue that supports them. Pipeline statistics
+  // need the pipelineStatisticsQuery feature, and inheritedQueries too, since
+  // the draws are in secondary command buffers. Either is skipped when it's
+  // unavailable.
+  void initQueryPools() {
+    assert(this->device);
+    assert(this->graphicsQfIx);
 
-      c.bindPipeline(vk::PipelineBindPoint::eGraphics, this->pipeline);
-      c.draw(3, 1, 0, 0);
+    uint32_t validBits =
+      this->physicalDevice.getQueueFamilyProperties()[*this->graphicsQfIx].timestampValidBits;
+    this->timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+    if (0 == validBits && this->dynamicResolution)
+      std::cerr << "timestamps aren't supported, so the render scale will stay at 1" << std::endl;
+    this->timestampPeriod = this->physicalDevice.getProperties().limits.timestampPeriod;
+    vk::PhysicalDeviceFeatures features = this->physicalDevice.getFeatures();
+    this->statisticsSupported = features.pipelineStatisticsQuery && features.inheritedQueries;
 
-      c.endRenderPass();
+    for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
+      if (validBits > 0) {
+        vk::QueryPoolCreateInfo timestampPoolInfo
+          ({},
+           vk::QueryType::eTimestamp,
+           this->timestampCount(),
+           {});
+        this->timestampPools.push_back(this->device.createQueryPool(timestampPoolInfo));
+      }
 
-      c.end();
+      if (this->statisticsSupported) {
+        vk::QueryPoolCreateInfo statisticsPoolInfo
+          ({},
+           vk::QueryType::ePipelineStatistics,
+           1,
+           this->statisticsFlags());
+        this->statisticsPools.push_back(this->device.createQueryPool(statisticsPoolInfo));
+      }
     }
   }
 
-  vk::ShaderModule loadShader(const char *path) {
+  vk::ShaderModule createShaderModule(ShaderCode code) {
     assert(this->device);
 
-    std::ifstream shaderFile(path, std::ios_base::binary | std::ios_base::ate);
-    if (!shaderFile.is_open()) {
-      throw std::runtime_error("couldn't open shader file");
-    }
-    uint32_t shaderCodeSize = shaderFile.tellg();
-    std::vector<char> shaderData(shaderCodeSize);
-    shaderFile.seekg(0);
-    shaderFile.read(shaderData.data(), shaderCodeSize);
-    vk::ShaderModuleCreateInfo shaderInfo
-      ({},
-       shaderCodeSize,
-       (uint32_t*) shaderData.data());
+    vk::ShaderModuleCreateInfo shaderInfo({}, code.size, code.words);
     return this->device.createShaderModule(shaderInfo);
   }
 
+  // Chooses the variant of the graphics pipeline to draw with. Command
+  // buffers that are already recorded keep using the old one.
+  void setPipelineVariant(const PipelineVariant &variant) {
+    this->pipelineVariant = variant;
+    if (this->renderpass)
+      this->initPipeline();
+  }
+
+  vk::Pipeline pipelineFor(const PipelineVariant &variant, bool depthOnly) {
+    std::map<PipelineVariant, vk::Pipeline> &built =
+      depthOnly ? this->depthPipelines : this->pipelines;
+    auto it = built.find(variant);
+    if (it != built.end())
+      return it->second;
+
+    if (!this->pipelineLayout) {
+      vk::PushConstantRange pushConstants(vk::ShaderStageFlagBits::eVertex, 0, sizeof(View));
+      vk::PipelineLayoutCreateInfo pipelineLayoutInfo ({}, 0, nullptr, 1, &pushConstants);
+      this->pipelineLayout = this->device.createPipelineLayout(pipelineLayoutInfo);
+    }
+
+    vk::Pipeline pipeline =
+      this->createPipeline(variant, this->graphicsShaders, this->renderpass, depthOnly);
+    built[variant] = pipeline;
+    return pipeline;
+  }
+
   void initPipeline() {
+    this->pipeline = this->pipelineFor(this->pipelineVariant, false);
+    if (this->depthPrepass)
+      this->depthPipeline = this->pipelineFor(this->pipelineVariant, true);
+  }
+
+  // Watches the GLSL source in dir of each reloadable shader in
+  // embeddedShaders, or its SPIR-V file if there's no source, and rebuilds
+  // the graphics pipeline in the background when they change. Sources are
+  // compiled with glslangValidator to the SPIR-V files the table names;
+  // those aren't watched, or compiling them would count as a change and
+  // reload the pipeline again. Call after initPipeline.
+  void initHotReload(const std::string &dir) {
+    assert(this->pipelineLayout);
+
+    this->shaderDir = dir;
+    for (const EmbeddedShader &shader : embeddedShaders) {
+      if (!reloadable(shader))
+        continue;
+      std::string source = dir + "/" + shader.source;
+      this->shaderWatcher.watch
+        (FileWatcher::exists(source) ? source : dir + "/" + shader.spirv);
+    }
+    this->shadersChecked = Clock::now();
+    this->compiler.start();
+  }
+
+  // Called between frames. Swaps in a reloaded pipeline if one's ready, and
+  // every so often checks whether the shaders have changed.
+  void pollShaderReload() {
+    if (!this->compiler.running())
+      return;
+
+    ReloadedPipeline reloaded;
+    {
+      std::lock_guard<std::mutex> lock(this->reloadMutex);
+      std::swap(reloaded, this->reloaded);
+    }
+    if (reloaded.ready)
+      this->applyReloadedPipeline(reloaded);
+
+    if (this->reloading || millisecondsSince(this->shadersChecked) < this->SHADER_POLL_MS)
+      return;
+    this->shadersChecked = Clock::now();
+
+    bool changed = this->shaderWatcher.changed();
+    if (!changed && !this->reloadAgain)
+      return;
+
+    this->reloading = true;
+    this->reloadAgain = false;
+
+    PipelineVariant variant = this->pipelineVariant;
+    vk::RenderPass renderpass = this->renderpass;
+    bool prepass = this->depthPrepass;
+    std::string dir = this->shaderDir;
+    this->compiler.submit
+      ([this, variant, renderpass, prepass, dir]() {
+         ReloadedPipeline result;
+         result.variant = variant;
+         result.renderpass = renderpass;
+
+         try {
+           if (this->loadShaders(dir, result.shaders)) {
+             result.pipeline = this->createPipeline(variant, result.shaders, renderpass, false);
+             if (prepass)
+               result.depthPipeline = this->createPipeline(variant, result.shaders, renderpass, true);
+           }
+         } catch (std::exception &e) {
+           std::cerr << "couldn't rebuild pipeline: " << e.what() << std::endl;
+         }
+
+         {
+           std::lock_guard<std::mutex> lock(this->reloadMutex);
+           result.ready = true;
+           this->reloaded = result;
+         }
+         this->wake();
+       });
+  }
+
+  // Runs on the compiler thread. Brings each stage's SPIR-V up to date with
+  // its source, then loads it; stages with neither stay embedded.
+  bool loadShaders(const std::string &dir, GraphicsShaders &shaders) {
+    for (const EmbeddedShader &shader : embeddedShaders) {
+      if (!reloadable(shader))
+        continue;
+      std::string source = dir + "/" + shader.source;
+      std::string output = dir + "/" + shader.spirv;
+
+      if (FileWatcher::newer(source, output) && !compileGlsl(source, output)) {
+        std::cerr << "couldn't compile " << source << std::endl;
+        return false;
+      }
+
+      std::vector<uint32_t> words = readSpirv(output);
+      if (words.empty())
+        continue;
+      if (vk::ShaderStageFlagBits::eVertex == shader.stage)
+        shaders.loadVertex(words);
+      else
+        shaders.loadFragment(words);
+    }
+
+    return true;
+  }
+
+  // Replaces every pipeline variant with the reloaded one, retiring the old
+  // ones (and any command buffers that use them) until in-flight frames are
+  // done with them.
+  void applyReloadedPipeline(const ReloadedPipeline &reloaded) {
+    this->reloading = false;
+    if (!reloaded.pipeline)
+      return;
+
+    // Built for a render pass or variant that's since been replaced.
+    if (reloaded.renderpass != this->renderpass ||
+        reloaded.variant < this->pipelineVariant ||
+        this->pipelineVariant < reloaded.variant) {
+      this->device.destroyPipeline(reloaded.pipeline);
+      if (reloaded.depthPipeline)
+        this->device.destroyPipeline(reloaded.depthPipeline);
+      this->reloadAgain = true;
+      return;
+    }
+
+    // The pre-pass can't draw with the old shaders once the colour pass
+    // draws with the new ones, or their depths might not match.
+    if (this->depthPrepass && !reloaded.depthPipeline) {
+      this->device.destroyPipeline(reloaded.pipeline);
+      return;
+    }
+
+    RetiredResources retired;
+    retired.frame = this->submittedFrames;
+    for (auto &p : this->pipelines)
+      retired.pipelines.push_back(p.second);
+    for (auto &p : this->depthPipelines)
+      retired.pipelines.push_back(p.second);
+
+    this->graphicsShaders = reloaded.shaders;
+    this->pipelines.clear();
+    this->pipelines[reloaded.variant] = reloaded.pipeline;
+    this->pipeline = reloaded.pipeline;
+    this->depthPipelines.clear();
+    if (this->depthPrepass) {
+      this->depthPipelines[reloaded.variant] = reloaded.depthPipeline;
+      this->depthPipeline = reloaded.depthPipeline;
+    }
+
+    this->rerecordCommandBuffers(retired);
+    this->retired.push_back(retired);
+    this->redraw = true;
+  }
+
+  // Safe to call from any thread, as long as the pipeline layout exists.
+  // A depth-only pipeline, for the pre-pass, has no fragment shader and
+  // draws in the first subpass.
+  vk::Pipeline createPipeline
+    (const PipelineVariant &variant,
+     const GraphicsShaders &shaders,
+     vk::RenderPass renderpass,
+     bool depthOnly) {
+
     assert(this->device);
-    assert(this->swapchain);
+    assert(renderpass);
+    assert(this->pipelineLayout);
+    assert(!depthOnly || this->depthPrepass);
 
-    vk::ShaderModule vertexShaderModule = this->loadShader("shaders/vert.spv");
-    vk::ShaderModule fragmentShaderModule = this->loadShader("shaders/frag.spv");
+    vk::ShaderModule vertexShaderModule = this->createShaderModule(shaders.vertex);
+    vk::ShaderModule fragmentShaderModule =
+      depthOnly ? vk::ShaderModule() : this->createShaderModule(shaders.fragment);
+
+    SpecializationConstants vertexConstants;
+    vertexConstants.add((uint32_t) variant.colorMode);
 
     std::vector<vk::PipelineShaderStageCreateInfo> shaderStageInfos =
       {
@@ -624,7 +4420,7 @@ public:
           vk::ShaderStageFlagBits::eVertex,
           vertexShaderModule,
           "main",
-          nullptr),
+          vertexConstants.info()),
 
        vk::PipelineShaderStageCreateInfo
             ({},
@@ -634,23 +4430,56 @@ public:
              nullptr)
 
       };
+    if (depthOnly)
+      shaderStageInfos.pop_back();
+
+    std::vector<vk::VertexInputBindingDescription> vertexBindings =
+      { vk::VertexInputBindingDescription(0, sizeof(Vertex), vk::VertexInputRate::eVertex),
+        vk::VertexInputBindingDescription(1, sizeof(Instance), vk::VertexInputRate::eInstance)
+      };
 
-    vk::PipelineVertexInputStateCreateInfo vertexInputInfo({}, {}, {});
+    std::vector<vk::VertexInputAttributeDescription> vertexAttributes =
+      { vk::VertexInputAttributeDescription
+          (0, 0, vk::Format::eR16G16Sfloat, offsetof(Vertex, position)),
+        vk::VertexInputAttributeDescription
+          (1, 0, vk::Format::eR8G8B8A8Unorm, offsetof(Vertex, color)),
+        vk::VertexInputAttributeDescription
+          (2, 1, vk::Format::eR32G32Sfloat, offsetof(Instance, offset)),
+        vk::VertexInputAttributeDescription
+          (3, 1, vk::Format::eR16Sfloat, offsetof(Instance, scale)),
+        vk::VertexInputAttributeDescription
+          (4, 1, vk::Format::eR16Unorm, offsetof(Instance, depth)),
+        vk::VertexInputAttributeDescription
+          (5, 1, vk::Format::eR8G8B8A8Unorm, offsetof(Instance, color))
+      };
+
+    vk::PipelineVertexInputStateCreateInfo vertexInputInfo
+      ({},
+       vertexBindings.size(), vertexBindings.data(),
+       vertexAttributes.size(), vertexAttributes.data());
 
     vk::PipelineInputAssemblyStateCreateInfo inputAssemblyInfo
       ({},
        vk::PrimitiveTopology::eTriangleList,
        false);
 
-    vk::Viewport viewport =
-      vk::Viewport(0, 0, this->swapchainExtent.width, this->swapchainExtent.height, 0, 1);
-    vk::Rect2D scissor = vk::Rect2D(vk::Offset2D(0, 0), this->swapchainExtent);
+    // The viewport and scissor are set when recording, so that the pipeline
+    // doesn't depend on the swapchain's size.
     vk::PipelineViewportStateCreateInfo viewportInfo
       ({},
-       1, &viewport,
-       1, &scissor
+       1, nullptr,
+       1, nullptr
        );
 
+    std::vector<vk::DynamicState> dynamicStates =
+      { vk::DynamicState::eViewport,
+        vk::DynamicState::eScissor
+      };
+    vk::PipelineDynamicStateCreateInfo dynamicStateInfo
+      ({},
+       dynamicStates.size(),
+       dynamicStates.data());
+
     vk::PipelineRasterizationStateCreateInfo rasterizationInfo
       ({},
        false,
@@ -673,14 +4502,15 @@ public:
        false,
        false);
 
+    // Blending is "over", with the colour's alpha as its opacity.
     std::vector<vk::PipelineColorBlendAttachmentState> colorBlendAttachments =
       { vk::PipelineColorBlendAttachmentState
-          (false,
-           vk::BlendFactor::eOne,
-           vk::BlendFactor::eZero,
+          (variant.blend,
+           vk::BlendFactor::eSrcAlpha,
+           vk::BlendFactor::eOneMinusSrcAlpha,
            vk::BlendOp::eAdd,
            vk::BlendFactor::eOne,
-           vk::BlendFactor::eZero,
+           vk::BlendFactor::eOneMinusSrcAlpha,
            vk::BlendOp::eAdd,
            vk::ColorComponentFlagBits::eR |
            vk::ColorComponentFlagBits::eG |
@@ -688,6 +4518,8 @@ public:
            vk::ColorComponentFlagBits::eA
            )
       };
+    if (depthOnly)
+      colorBlendAttachments.clear();
     vk::PipelineColorBlendStateCreateInfo colorBlendInfo
       ({},
        false,
@@ -697,8 +4529,21 @@ public:
        {{ 0, 0, 0, 0 }}
        );
 
-    vk::PipelineLayoutCreateInfo pipelineLayoutInfo ({}, {}, {});
-    this->pipelineLayout = this->device.createPipelineLayout(pipelineLayoutInfo);
+    // Nearer is smaller. After a pre-pass the depth buffer already holds
+    // the nearest depth, so the colour pass only tests against it, and only
+    // the fragments that match are shaded.
+    bool depthWrite = depthOnly || !this->depthPrepass;
+    vk::PipelineDepthStencilStateCreateInfo depthStencilInfo
+      ({},
+       true,
+       depthWrite,
+       depthWrite ? vk::CompareOp::eLess : vk::CompareOp::eLessOrEqual,
+       false,
+       false,
+       vk::StencilOpState(),
+       vk::StencilOpState(),
+       0,
+       1);
 
     vk::GraphicsPipelineCreateInfo graphicsPipelineInfo
       ({},
@@ -710,54 +4555,764 @@ public:
        &viewportInfo,
        &rasterizationInfo,
        &multisampleInfo,
-       nullptr,
+       this->depthTesting ? &depthStencilInfo : nullptr,
        &colorBlendInfo,
-       nullptr,
+       &dynamicStateInfo,
        this->pipelineLayout,
-       this->renderpass,
-       0,
+       renderpass,
+       depthOnly ? 0 : this->colorSubpass(),
        nullptr,
        -1);
-    this->pipeline =
-      this->device.createGraphicsPipeline(nullptr, graphicsPipelineInfo);
+    vk::Pipeline pipeline =
+      this->device.createGraphicsPipeline(this->pipelineCache, graphicsPipelineInfo);
 
     this->device.destroyShaderModule(vertexShaderModule);
     this->device.destroyShaderModule(fragmentShaderModule);
+
+    return pipeline;
   }
 
+  // Without a swapchain there's no image to acquire or present, so headless
+  // frames only need their fences.
   void initSyncObjects() {
+    this->frameSerials = std::vector<uint64_t>(this->FRAMES_IN_FLIGHT, 0);
     for (uint32_t i = 0; i < this->FRAMES_IN_FLIGHT; ++i) {
-      this->imageAvailableSems.push_back(device.createSemaphore(vk::SemaphoreCreateInfo()));
-      this->renderFinishedSems.push_back(device.createSemaphore(vk::SemaphoreCreateInfo()));
+      if (!this->headless) {
+        this->imageAvailableSems.push_back(device.createSemaphore(vk::SemaphoreCreateInfo()));
+        this->renderFinishedSems.push_back(device.createSemaphore(vk::SemaphoreCreateInfo()));
+      }
       this->inFlightFences.push_back
         (device.createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled)));
     }
   }
 };
 
-int main() {
-  Context context = Context();
-
-  context.initWindow(1280, 960, "triangle");
-  context.initInstance();
-  context.initDebugMessenger();
-  context.getPhysicalDevice();
-  context.getSurface();
-  context.getQueueIndices();
-  context.initDevice();
-  context.getQueues();
-  context.initSwapchain();
-  context.initRenderPass();
-  context.initImageViews();
-  context.initFramebuffers();
-  context.initPipeline();
-  context.initCommandPool();
-  context.initCommandBuffers();
-  context.initSyncObjects();
-
-  while (!context.shouldClose()) {
-    glfwPollEvents();
-    context.drawFrame();
+struct Options {
+  bool headless;
+  uint32_t width;
+  uint32_t height;
+
+  // Headless runs and benchmarks stop after this many frames (not counting
+  // warm-up) or this many seconds, whichever comes first. Zero means no limit.
+  uint64_t frames;
+  double seconds;
+
+  bool benchmark;
+  uint64_t warmupFrames;
+  std::string output;
+
+  // Show frame statistics in the window title.
+  bool overlay;
+
+  std::string pipelineCache;
+
+  // How many copies of the triangle to draw, in each of layers overlapping
+  // layers.
+  uint32_t instances;
+  uint32_t layers;
+
+  // A scene file to draw instead of the grid; see SceneFile. It's loaded
+  // while drawing, loadBudget MiB a frame.
+  std::string scene;
+  double loadBudget;
+
+  // Write the grid to a scene file, in chunks of chunkInstances instances,
+  // and exit.
+  std::string writeScene;
+  uint32_t chunkInstances;
+
+  // Upload fresh instance data every frame.
+  bool stream;
+
+  // Move the instances with a simulation on the compute queue.
+  bool simulate;
+
+  // Threads recording command buffers, including the main thread.
+  uint32_t threads;
+
+  // Instances per draw command; zero draws them all at once.
+  uint32_t instancesPerDraw;
+
+  // Record command buffers each frame instead of once up front.
+  bool recordEveryFrame;
+
+  // Magnification around the middle of the scene.
+  float zoom;
+
+  ColorMode colorMode;
+
+  // Where to watch for shader changes; empty for no hot reloading.
+  std::string shaderDir;
+
+  // Test depth, nearest in front, optionally after a depth pre-pass. Front
+  // to back sorts the instances so that the nearest are drawn first (GPU
+  // culling keeps the order of the draws, but not of the instances within
+  // each one).
+  bool depth;
+  bool depthPrepass;
+  bool frontToBack;
+
+  // Blend the instances, sorted back to front on the GPU every frame. The
+  // grid's instances are given opacity (scene files keep their own).
+  bool transparent;
+  float opacity;
+
+  // Cull on the GPU, dropping instances smaller than minPixels across.
+  bool gpuCull;
+  float minPixels;
+
+  // The present mode (presentModeSet is false for the default) and
+  // swapchain image count (zero for the default).
+  bool presentModeSet;
+  vk::PresentModeKHR presentMode;
+  uint32_t imageCount;
+
+  // Start each frame as late as possible, aiming for paceRate frames a
+  // second, or the monitor's refresh rate if that's zero.
+  bool pace;
+  double paceRate;
+
+  // The GPU frame time, in milliseconds, to scale the resolution to fit;
+  // zero for a fixed resolution. It never drops below minRenderScale.
+  double resolutionBudget;
+  float minRenderScale;
+
+  // Only draw when something has changed. Benchmarks and headless runs
+  // always draw continuously.
+  bool onDemand;
+
+  // Where to capture frames to; empty for no capturing. See CaptureFormat.
+  std::string capture;
+  CaptureFormat captureFormat;
+  uint32_t captureBuffers;
+
+  // Milliseconds a frame that capturing may cost the render thread, on
+  // average, before frames are dropped. Only recording the readback counts:
+  // the GPU's copy and the writer thread's disk time don't.
+  double captureBudget;
+
+  // The index or part of the name of the device to use, overriding the
+  // TRIANGLE_DEVICE environment variable. Empty to pick the best one.
+  std::string device;
+
+  // Where to write a Chrome trace of startup and the first frame; empty for
+  // none.
+  std::string trace;
+
+  Options() :
+    headless(false),
+    width(1280),
+    height(960),
+    frames(0),
+    seconds(0),
+    benchmark(false),
+    warmupFrames(100),
+    output(),
+    overlay(false),
+    pipelineCache("pipeline.cache"),
+    instances(1),
+    layers(1),
+    scene(),
+    loadBudget(16),
+    writeScene(),
+    chunkInstances(65536),
+    stream(false),
+    simulate(false),
+    threads(std::max<uint32_t>(std::thread::hardware_concurrency(), 1)),
+    instancesPerDraw(0),
+    recordEveryFrame(false),
+    zoom(1),
+    colorMode(ColorMode::Shaded),
+    shaderDir(),
+    depth(false),
+    depthPrepass(false),
+    frontToBack(false),
+    transparent(false),
+    opacity(1),
+    gpuCull(false),
+    minPixels(1),
+    presentModeSet(false),
+    presentMode(vk::PresentModeKHR::eFifo),
+    imageCount(0),
+    pace(false),
+    paceRate(0),
+    resolutionBudget(0),
+    minRenderScale(0.5f),
+    onDemand(false),
+    capture(),
+    captureFormat(CaptureFormat::Ppm),
+    captureBuffers(4),
+    captureBudget(1),
+    device(),
+    trace() {}
+};
+
+Options parseOptions(int argc, char **argv) {
+  Options options;
+
+  if (const char *device = std::getenv("TRIANGLE_DEVICE"))
+    options.device = device;
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+        throw std::runtime_error("missing value for " + arg);
+      }
+      return argv[++i];
+    };
+
+    if ("--headless" == arg) {
+      options.headless = true;
+    } else if ("--width" == arg) {
+      options.width = std::stoul(value());
+    } else if ("--height" == arg) {
+      options.height = std::stoul(value());
+    } else if ("--frames" == arg) {
+      options.frames = std::stoull(value());
+    } else if ("--seconds" == arg) {
+      options.seconds = std::stod(value());
+    } else if ("--benchmark" == arg) {
+      options.benchmark = true;
+    } else if ("--warmup" == arg) {
+      options.warmupFrames = std::stoull(value());
+    } else if ("--output" == arg) {
+      options.output = value();
+    } else if ("--overlay" == arg) {
+      options.overlay = true;
+    } else if ("--pipeline-cache" == arg) {
+      options.pipelineCache = value();
+    } else if ("--instances" == arg) {
+      options.instances = std::stoul(value());
+    } else if ("--layers" == arg) {
+      options.layers = std::max<uint32_t>(std::stoul(value()), 1);
+    } else if ("--scene" == arg) {
+      options.scene = value();
+    } else if ("--load-budget" == arg) {
+      options.loadBudget = std::stod(value());
+    } else if ("--write-scene" == arg) {
+      options.writeScene = value();
+    } else if ("--chunk-instances" == arg) {
+      options.chunkInstances = std::stoul(value());
+    } else if ("--stream" == arg) {
+      options.stream = true;
+    } else if ("--simulate" == arg) {
+      options.simulate = true;
+    } else if ("--threads" == arg) {
+      options.threads = std::stoul(value());
+    } else if ("--instances-per-draw" == arg) {
+      options.instancesPerDraw = std::stoul(value());
+    } else if ("--record-every-frame" == arg) {
+      options.recordEveryFrame = true;
+    } else if ("--zoom" == arg) {
+      options.zoom = std::stof(value());
+    } else if ("--watch-shaders" == arg) {
+      options.shaderDir = value();
+    } else if ("--color-mode" == arg) {
+      std::string mode = value();
+      if ("shaded" == mode) {
+        options.colorMode = ColorMode::Shaded;
+      } else if ("vertex" == mode) {
+        options.colorMode = ColorMode::Vertex;
+      } else if ("instance" == mode) {
+        options.colorMode = ColorMode::Instance;
+      } else if ("depth" == mode) {
+        options.colorMode = ColorMode::Depth;
+      } else {
+        throw std::runtime_error("unknown colour mode " + mode);
+      }
+    } else if ("--depth" == arg) {
+      options.depth = true;
+    } else if ("--depth-prepass" == arg) {
+      options.depth = true;
+      options.depthPrepass = true;
+    } else if ("--front-to-back" == arg) {
+      options.frontToBack = true;
+    } else if ("--transparent" == arg) {
+      options.transparent = true;
+    } else if ("--opacity" == arg) {
+      options.opacity = std::stof(value());
+    } else if ("--gpu-cull" == arg) {
+      options.gpuCull = true;
+    } else if ("--min-pixels" == arg) {
+      options.minPixels = std::stof(value());
+    } else if ("--present-mode" == arg) {
+      std::string mode = value();
+      options.presentModeSet = true;
+      if ("immediate" == mode) {
+        options.presentMode = vk::PresentModeKHR::eImmediate;
+      } else if ("mailbox" == mode) {
+        options.presentMode = vk::PresentModeKHR::eMailbox;
+      } else if ("fifo" == mode) {
+        options.presentMode = vk::PresentModeKHR::eFifo;
+      } else if ("fifo-relaxed" == mode) {
+        options.presentMode = vk::PresentModeKHR::eFifoRelaxed;
+      } else {
+        throw std::runtime_error("unknown present mode " + mode);
+      }
+    } else if ("--image-count" == arg) {
+      options.imageCount = std::stoul(value());
+    } else if ("--pace" == arg) {
+      options.pace = true;
+    } else if ("--pace-rate" == arg) {
+      options.pace = true;
+      options.paceRate = std::stod(value());
+    } else if ("--dynamic-resolution" == arg) {
+      options.resolutionBudget = std::stod(value());
+    } else if ("--min-render-scale" == arg) {
+      options.minRenderScale = std::stof(value());
+    } else if ("--on-demand" == arg) {
+      options.onDemand = true;
+    } else if ("--capture" == arg) {
+      options.capture = value();
+    } else if ("--capture-format" == arg) {
+      std::string format = value();
+      if ("ppm" == format) {
+        options.captureFormat = CaptureFormat::Ppm;
+      } else if ("raw" == format) {
+        options.captureFormat = CaptureFormat::Raw;
+      } else {
+        throw std::runtime_error("unknown capture format " + format);
+      }
+    } else if ("--capture-buffers" == arg) {
+      options.captureBuffers = std::max<uint32_t>(std::stoul(value()), 1);
+    } else if ("--capture-budget" == arg) {
+      options.captureBudget = std::stod(value());
+    } else if ("--device" == arg) {
+      options.device = value();
+    } else if ("--trace" == arg) {
+      options.trace = value();
+    } else {
+      throw std::runtime_error("unknown argument " + arg);
+    }
+  }
+
+  if ((options.headless || options.benchmark) &&
+      0 == options.frames && 0 == options.seconds) {
+    options.frames = 1000;
+  }
+
+  if (options.headless || options.benchmark)
+    options.onDemand = false;
+
+  if (options.stream && options.simulate) {
+    throw std::runtime_error("--stream and --simulate can't be used together");
+  }
+
+  // Without depth testing, the instances drawn first end up at the back.
+  if (options.frontToBack && !options.depth && options.writeScene.empty()) {
+    throw std::runtime_error("--front-to-back needs --depth or --depth-prepass");
+  }
+
+  // Culling compacts each draw's visible instances with atomics (see
+  // cull.comp), so their order within a draw changes from frame to frame.
+  // Depth testing still draws the right picture, except where instances
+  // overlap at the same depth, but sorting them first no longer saves any
+  // shading.
+  if (options.frontToBack && options.gpuCull) {
+    std::cerr << "--gpu-cull doesn't keep the order --front-to-back sorts instances into"
+              << std::endl;
+  }
+
+  // Culling would scramble the order within each draw, and depth testing
+  // would hide what's behind a transparent instance.
+  if (options.transparent && (options.gpuCull || options.depth)) {
+    throw std::runtime_error("--transparent can't be used with --gpu-cull or depth testing");
+  }
+
+  return options;
+}
+
+// Draws frames until the benchmark is done or stop is set. When there's a
+// window, this runs on a thread of its own.
+void renderLoop
+  (Context &context,
+   const Options &options,
+   Benchmark &benchmark,
+   Trace &trace,
+   const std::atomic<bool> &stop) {
+
+  // An unlimited interactive session has nothing to count.
+  bool counting = options.benchmark || options.frames > 0 || options.seconds > 0;
+
+  uint64_t lastGpuFrame = 0;
+  bool firstFrame = true;
+
+  while (!stop && !benchmark.done()) {
+    if (options.onDemand && !context.needsRedraw()) {
+      context.waitForChange();
+      continue;
+    }
+
+    Clock::time_point frameStart = Clock::now();
+    bool drawn = context.drawFrame();
+    if (drawn && firstFrame) {
+      firstFrame = false;
+      trace.span("first frame", frameStart);
+    }
+    if (drawn && counting) {
+      benchmark.record(context.frameTimings());
+
+      const GpuFrameStats &gpu = context.gpuFrameStats();
+      if (gpu.frame != lastGpuFrame) {
+        lastGpuFrame = gpu.frame;
+        if (gpu.timed) {
+          benchmark.sample("gpu_render_pass_ms", gpu.renderPass);
+          if (context.computesBeforeRendering())
+            benchmark.sample("gpu_compute_ms", gpu.compute);
+          if (options.resolutionBudget > 0)
+            benchmark.sample("render_scale", context.currentRenderScale());
+          for (auto &s : gpu.slices)
+            benchmark.sample("gpu_slice_ms", s);
+        }
+        if (gpu.counted) {
+          benchmark.sample("vertex_invocations", gpu.vertexInvocations);
+          benchmark.sample("clipping_primitives", gpu.clippingPrimitives);
+          benchmark.sample("fragment_invocations", gpu.fragmentInvocations);
+        }
+      }
+    }
+    if (!drawn && context.minimised())
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (options.overlay && !options.headless)
+      context.updateOverlay();
+  }
+
+  context.finish();
+  benchmark.finish();
+}
+
+int main(int argc, char **argv) {
+  Options options = parseOptions(argc, argv);
+
+  if (!options.writeScene.empty()) {
+    Scene scene = makeLayeredScene(options.instances, options.layers);
+    setOpacity(scene.instances, options.opacity);
+    if (options.frontToBack)
+      sortFrontToBack(scene.instances);
+    writeSceneFile(options.writeScene, scene, options.chunkInstances);
+    return 0;
+  }
+
+  Clock::time_point startupStart = Clock::now();
+  Trace trace;
+  if (!options.trace.empty())
+    trace.enable();
+  trace.nameThread("main");
+
+  Context context;
+  PipelineVariant variant;
+  variant.colorMode = options.colorMode;
+  variant.blend = options.transparent;
+  context.setPipelineVariant(variant);
+  if (options.resolutionBudget > 0)
+    context.setDynamicResolution(options.resolutionBudget, options.minRenderScale);
+  if (options.depth)
+    context.setDepthTesting(options.depthPrepass);
+
+  // Startup runs as a graph of tasks on a few threads, so that steps that
+  // don't depend on each other overlap: the instance is created while the
+  // window opens, the scene is made and the pipeline cache read while the
+  // device is set up, and the pipeline compiles while the geometry uploads.
+  // Neither the allocator nor a queue can be used from two threads at once,
+  // so the tasks that allocate or upload are chained one after another.
+  typedef TaskGraph::Task Task;
+  TaskGraph startup;
+
+  // A scene file is mapped, and kept open for as long as the context loads
+  // from it.
+  std::unique_ptr<SceneFile> sceneFile;
+  Scene scene;
+  Task sceneReady = startup.add
+    ("scene", {},
+     [&]() {
+       if (!options.scene.empty())
+         sceneFile.reset(new SceneFile(options.scene));
+       // Streaming and simulating start from every instance at once, so
+       // they copy a scene file out rather than loading it as they go.
+       // A scene file that's loaded as it's drawn is drawn in the file's
+       // order; --write-scene --front-to-back writes one already sorted.
+       if (!sceneFile) {
+         scene = makeLayeredScene(options.instances, options.layers);
+         setOpacity(scene.instances, options.opacity);
+       } else if (options.stream || options.simulate) {
+         scene = sceneFile->toScene();
+       }
+       if (options.frontToBack)
+         sortFrontToBack(scene.instances);
+     });
+
+  Task cacheRead = startup.add
+    ("read pipeline cache", {},
+     [&]() { context.readPipelineCache(options.pipelineCache); });
+
+  std::vector<Task> deviceNeeds;
+  if (options.headless) {
+    context.initHeadless(options.width, options.height, "triangle");
+    deviceNeeds.push_back
+      (startup.add
+         ("instance", {},
+          [&]() {
+            context.initInstance();
+            context.initDebugMessenger();
+          }));
+  } else {
+    Task glfw = startup.add
+      ("glfw", {},
+       [&]() { context.initGlfw(options.width, options.height, "triangle"); },
+       true);
+    Task window = startup.add("window", { glfw }, [&]() { context.initWindow(); }, true);
+    Task instance = startup.add
+      ("instance", { glfw },
+       [&]() {
+         context.initInstance();
+         context.initDebugMessenger();
+       });
+    deviceNeeds.push_back
+      (startup.add("surface", { instance, window }, [&]() { context.getSurface(); }));
+  }
+
+  Task device = startup.add
+    ("device", deviceNeeds,
+     [&]() {
+       context.getPhysicalDevice(options.device);
+       context.getQueueIndices();
+       context.initDevice();
+       context.getQueues();
+     });
+
+  // The last task so far that allocates or uploads; the next one waits for
+  // it.
+  Task allocating = startup.add("allocator", { device }, [&]() { context.initAllocator(); });
+
+  Task pipelineCache = startup.add
+    ("pipeline cache", { device, cacheRead },
+     [&]() { context.initPipelineCache(); });
+
+  std::vector<Task> targetNeeds = { device };
+  if (!options.capture.empty())
+    targetNeeds.push_back
+      (startup.add
+         ("capture", { device },
+          [&]() {
+            context.initCapture
+              (options.captureFormat, options.capture, options.captureBuffers, options.captureBudget);
+          }));
+
+  Task targets;
+  if (options.headless) {
+    targetNeeds.push_back(allocating);
+    targets = allocating = startup.add
+      ("offscreen targets", targetNeeds,
+       [&]() { context.initOffscreenTargets(); });
+  } else {
+    targets = startup.add
+      ("swapchain", targetNeeds,
+       [&]() {
+         if (options.presentModeSet)
+           context.setPresentMode(options.presentMode);
+         context.setImageCount(options.imageCount);
+         context.setFramePacing(options.pace, options.paceRate);
+         context.setOnDemand(options.onDemand);
+         context.initSwapchain();
+         context.initImageViews();
+       });
+  }
+
+  Task renderPass = startup.add("render pass", { targets }, [&]() { context.initRenderPass(); });
+  std::vector<Task> framebufferNeeds = { renderPass };
+  if (options.depth)
+    framebufferNeeds.push_back
+      (allocating = startup.add
+         ("depth buffer", { allocating, renderPass },
+          [&]() { context.initDepthBuffer(); }));
+  Task framebuffers = startup.add
+    ("framebuffers", framebufferNeeds,
+     [&]() { context.initFramebuffers(); });
+  Task pipeline = startup.add
+    ("pipeline", { renderPass, pipelineCache },
+     [&]() {
+       context.initPipeline();
+       if (!options.shaderDir.empty())
+         context.initHotReload(options.shaderDir);
+     });
+
+  Task jobs = startup.add("jobs", {}, [&]() { context.initJobs(options.threads); });
+  Task commandPools = startup.add
+    ("command pools", { device, jobs },
+     [&]() {
+       context.initCommandPool();
+       if (options.recordEveryFrame)
+         context.initPerFrameRecording();
+     });
+
+  allocating = startup.add
+    ("geometry", { allocating, sceneReady, commandPools },
+     [&]() {
+       if (sceneFile && !options.stream && !options.simulate) {
+         context.initSceneFile
+           (*sceneFile, options.instancesPerDraw, (vk::DeviceSize) (options.loadBudget * (1 << 20)));
+       } else {
+         context.initGeometry(scene, options.instancesPerDraw);
+       }
+       if (options.stream)
+         context.initStreaming(scene);
+       if (options.simulate)
+         context.initSimulation(scene);
+     });
+  if (options.gpuCull)
+    allocating = startup.add
+      ("culling", { allocating, pipelineCache },
+       [&]() { context.initCulling(options.minPixels); });
+  if (options.transparent)
+    allocating = startup.add
+      ("sorting", { allocating, pipelineCache },
+       [&]() { context.initSorting(); });
+  if (options.resolutionBudget > 0)
+    allocating = startup.add
+      ("render targets", { allocating, renderPass },
+       [&]() { context.initRenderTargets(); });
+
+  // Query pools are sized for the final draw list.
+  Task queryPools = startup.add("query pools", { allocating }, [&]() { context.initQueryPools(); });
+  Task syncObjects = startup.add("sync objects", { device }, [&]() { context.initSyncObjects(); });
+
+  startup.add
+    ("command buffers", { queryPools, framebuffers, pipeline, syncObjects },
+     [&]() {
+       View view;
+       view.zoom = options.zoom;
+       context.setView(view);
+       context.initCommandBuffers();
+     });
+
+  // The graph is at most four tasks wide.
+  startup.run(std::max<uint32_t>(std::min<uint32_t>(options.threads, 4), 1), trace);
+  trace.span("startup", startupStart);
+  double startupTime = millisecondsSince(startupStart);
+
+  Benchmark benchmark
+    (options.benchmark ? options.warmupFrames : 0,
+     options.frames,
+     options.seconds);
+
+  std::atomic<bool> stop(false);
+
+  if (options.headless) {
+    renderLoop(context, options, benchmark, trace, stop);
+  } else {
+    // The main thread only handles window events from here on, so neither
+    // thread can hold the other up.
+    std::atomic<bool> rendering(true);
+    std::exception_ptr error;
+    std::thread renderThread
+      ([&]() {
+         trace.nameThread("render");
+         try {
+           renderLoop(context, options, benchmark, trace, stop);
+         } catch (...) {
+           error = std::current_exception();
+         }
+         rendering = false;
+         glfwPostEmptyEvent();
+       });
+
+    while (rendering) {
+      glfwWaitEvents();
+      if (context.shouldClose()) {
+        stop = true;
+        context.wake();
+      }
+      context.showOverlay();
+    }
+
+    renderThread.join();
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  if (trace.isEnabled()) {
+    std::ofstream out(options.trace);
+    if (!out.is_open()) {
+      throw std::runtime_error("couldn't open trace file");
+    }
+    trace.writeJson(out);
+  }
+
+  if (options.benchmark) {
+    benchmark.info("device", context.deviceName());
+    benchmark.info("mode", options.headless ? "headless" : "windowed");
+    benchmark.info
+      ("scene",
+       !options.scene.empty() ? options.scene :
+       options.layers > 1 ? "grid, " + std::to_string(options.layers) + " layers" :
+       "grid");
+    benchmark.info("recording", options.recordEveryFrame ? "every frame" : "once");
+    benchmark.info("culling", options.gpuCull ? "gpu" : "none");
+    benchmark.info
+      ("depth", options.depthPrepass ? "pre-pass" : options.depth ? "tested" : "none");
+    benchmark.info
+      ("instance_order",
+       options.transparent ? "back to front, sorted on the gpu" :
+       options.frontToBack ? "front to back" :
+       "as generated");
+    benchmark.info
+      ("resolution",
+       options.resolutionBudget > 0 ?
+         "dynamic, " + std::to_string(options.resolutionBudget) + " ms budget" :
+         "fixed");
+    benchmark.info("simulation", options.simulate ? context.simulationQueue() : "none");
+    if (!options.headless) {
+      benchmark.info("present_mode", context.presentModeName());
+      benchmark.info("pacing", options.pace ? "on" : "off");
+      if (options.pace) {
+        // Pacing is only doing its job if frames come at the rate it aims
+        // for; with MAILBOX or IMMEDIATE, nothing else holds them to it.
+        double target = context.pacingTarget();
+        double achieved =
+          benchmark.framesPerSecond() > 0 ? 1000 / benchmark.framesPerSecond() : 0;
+        bool onTarget = target > 0 && std::fabs(achieved - target) <= target * 0.1;
+        benchmark.metric("pacing_target_ms", target);
+        benchmark.metric("pacing_achieved_ms", achieved);
+        benchmark.metric("pacing_on_target", onTarget ? 1 : 0);
+        if (!onTarget)
+          std::cerr << "frame pacing missed its target: a frame every " << achieved
+                    << " ms rather than every " << target << " ms" << std::endl;
+      }
+      benchmark.metric("swapchain_images", context.swapchainImageCount());
+      benchmark.metric("events_dropped", context.droppedEventCount());
+    }
+    benchmark.metric("startup_ms", startupTime);
+    benchmark.metric("frames_completed", context.framesCompleted());
+    benchmark.metric("triangles_per_frame", context.trianglesPerFrame());
+    benchmark.metric("draws_per_frame", context.drawsPerFrame());
+    benchmark.metric("recording_threads", context.workerCount());
+    if (!options.capture.empty()) {
+      benchmark.metric("frames_captured", context.capturedFrameCount());
+      benchmark.metric("frames_dropped", context.droppedFrameCount());
+    }
+
+    AllocatorStats memory = context.memoryStats();
+    benchmark.metric("memory_blocks", memory.blockCount);
+    benchmark.metric("memory_block_bytes", memory.blockBytes);
+    benchmark.metric("memory_used_bytes", memory.usedBytes);
+    benchmark.metric("memory_allocations", memory.allocationCount);
+    benchmark.metric("memory_fragmentation", memory.fragmentation);
+    benchmark.metric
+      ("triangles_per_second", context.trianglesPerFrame() * benchmark.framesPerSecond());
+
+    if (options.output.empty()) {
+      benchmark.writeJson(std::cout);
+    } else {
+      std::ofstream out(options.output);
+      if (!out.is_open()) {
+        throw std::runtime_error("couldn't open benchmark output file");
+      }
+      benchmark.writeJson(out);
+    }
+  } else if (options.headless) {
+    std::cout << "frames: " << context.framesCompleted() << std::endl;
   }
 
   return 0;
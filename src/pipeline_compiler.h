@@ -0,0 +1,189 @@
+#pragma once
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+// Notices when any of a set of files is modified, created or deleted, by
+// polling their modification times.
+class FileWatcher {
+private:
+  std::vector<std::string> paths;
+  std::vector<int64_t> modified;
+
+  static int64_t modifiedTime(const std::string &path) {
+    struct stat info;
+    if (0 != stat(path.c_str(), &info))
+      return -1;
+    return (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+  }
+
+public:
+  void watch(const std::string &path) {
+    this->paths.push_back(path);
+    this->modified.push_back(modifiedTime(path));
+  }
+
+  // Whether anything changed since the last call (or since it was watched).
+  bool changed() {
+    bool changed = false;
+    for (size_t i = 0; i < this->paths.size(); ++i) {
+      int64_t t = modifiedTime(this->paths[i]);
+      if (t != this->modified[i]) {
+        this->modified[i] = t;
+        changed = true;
+      }
+    }
+    return changed;
+  }
+
+  static bool exists(const std::string &path) {
+    return modifiedTime(path) >= 0;
+  }
+
+  static bool newer(const std::string &path, const std::string &than) {
+    return modifiedTime(path) > modifiedTime(than);
+  }
+};
+
+// Reads a SPIR-V file. Returns an empty vector if it can't.
+inline std::vector<uint32_t> readSpirv(const std::string &path) {
+  std::ifstream file(path, std::ios_base::binary | std::ios_base::ate);
+  if (!file.is_open())
+    return std::vector<uint32_t>();
+
+  size_t size = file.tellg();
+  if (0 == size || 0 != size % sizeof(uint32_t))
+    return std::vector<uint32_t>();
+
+  std::vector<uint32_t> words(size / sizeof(uint32_t));
+  file.seekg(0);
+  file.read((char*) words.data(), size);
+  if (!file)
+    return std::vector<uint32_t>();
+  return words;
+}
+
+// Compiles GLSL to SPIR-V with glslangValidator. Returns whether it worked;
+// the compiler's messages go to the console. The paths are passed to it as
+// they are, without a shell, so they may contain any character.
+inline bool compileGlsl(const std::string &source, const std::string &output) {
+  std::vector<std::string> args = {"glslangValidator", "-V", source, "-o", output};
+  std::vector<char*> argv;
+  for (std::string &arg : args)
+    argv.push_back(&arg[0]);
+  argv.push_back(nullptr);
+
+  pid_t pid;
+  if (0 != posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ)) {
+    std::cerr << "couldn't run glslangValidator" << std::endl;
+    return false;
+  }
+
+  int status;
+  while (pid != waitpid(pid, &status, 0)) {
+    if (EINTR != errno)
+      return false;
+  }
+  return WIFEXITED(status) && 0 == WEXITSTATUS(status);
+}
+
+// Runs jobs one at a time on a background thread, for work like pipeline
+// compilation that mustn't hold up rendering. Jobs report back through
+// state of their own.
+class PipelineCompiler {
+private:
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable idle;
+  std::deque<std::function<void()>> jobs;
+  bool busy;
+  bool stopping;
+
+  void compilerMain() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (;;) {
+      this->wake.wait(lock, [&]() { return this->stopping || !this->jobs.empty(); });
+      if (this->jobs.empty())
+        return;
+
+      std::function<void()> job = this->jobs.front();
+      this->jobs.pop_front();
+      this->busy = true;
+      lock.unlock();
+
+      try {
+        job();
+      } catch (std::exception &e) {
+        std::cerr << "pipeline compilation failed: " << e.what() << std::endl;
+      }
+
+      lock.lock();
+      this->busy = false;
+      if (this->jobs.empty())
+        this->idle.notify_all();
+    }
+  }
+
+public:
+  PipelineCompiler() : busy(false), stopping(false) {}
+
+  PipelineCompiler(const PipelineCompiler&) = delete;
+  PipelineCompiler &operator=(const PipelineCompiler&) = delete;
+
+  ~PipelineCompiler() {
+    this->stop();
+  }
+
+  void start() {
+    this->thread = std::thread(&PipelineCompiler::compilerMain, this);
+  }
+
+  // Finishes the jobs already submitted, then stops the thread.
+  void stop() {
+    if (!this->thread.joinable())
+      return;
+
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->stopping = true;
+    }
+    this->wake.notify_all();
+    this->thread.join();
+    this->stopping = false;
+  }
+
+  bool running() const {
+    return this->thread.joinable();
+  }
+
+  void submit(const std::function<void()> &job) {
+    {
+      std::lock_guard<std::mutex> lock(this->mutex);
+      this->jobs.push_back(job);
+    }
+    this->wake.notify_one();
+  }
+
+  // Waits until every submitted job has finished.
+  void wait() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->idle.wait(lock, [&]() { return !this->busy && this->jobs.empty(); });
+  }
+};
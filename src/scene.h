@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Converts to IEEE half precision, rounding to nearest.
+inline uint16_t toHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  uint16_t sign = (bits >> 16) & 0x8000;
+  int32_t exponent = (int32_t) ((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  if (0xff == ((bits >> 23) & 0xff)) {
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  }
+  if (exponent >= 31) {
+    return sign | 0x7c00;
+  }
+  if (exponent <= 0) {
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    uint32_t shift = 14 - exponent;
+    uint32_t half = mantissa >> shift;
+    if ((mantissa >> (shift - 1)) & 1)
+      ++half;
+    return sign | half;
+  }
+
+  // A carry out of the mantissa correctly bumps the exponent.
+  uint32_t half = sign | (exponent << 10) | (mantissa >> 13);
+  if (mantissa & 0x1000)
+    ++half;
+  return half;
+}
+
+inline uint16_t toUnorm16(float value) {
+  value = std::fmin(std::fmax(value, 0.0f), 1.0f);
+  return (uint16_t) (value * 65535 + 0.5f);
+}
+
+// Packs a colour for an R8G8B8A8Unorm attribute.
+inline uint32_t packColor(float r, float g, float b, float a) {
+  auto channel = [](float c) -> uint32_t {
+    c = std::fmin(std::fmax(c, 0.0f), 1.0f);
+    return (uint32_t) (c * 255 + 0.5f);
+  };
+  return channel(r) | channel(g) << 8 | channel(b) << 16 | channel(a) << 24;
+}
+
+// 8 bytes: a half-float position and a packed colour.
+struct Vertex {
+  uint16_t position[2];
+  uint32_t color;
+};
+
+// 16 bytes: where to put a copy of the mesh, how big it is, how deep it is
+// (0 is nearest), and a packed colour that multiplies the vertex colours.
+// The vertex shader reads it as per-instance attributes; cull.comp,
+// simulate.comp and sort.comp have an Instance struct to match.
+struct Instance {
+  float offset[2];
+  uint16_t scale;
+  uint16_t depth;
+  uint32_t color;
+};
+
+// Which part of the scene is on screen: the point at the centre of the view,
+// and how much to magnify around it. Matches the View push constants in the
+// shaders.
+struct View {
+  float center[2];
+  float zoom;
+
+  View() : center{ 0, 0 }, zoom(1) {}
+};
+
+// 32 bytes: an instance where it is now, and the velocity the simulation
+// moves it with. Matches the Particle struct in simulate.comp.
+struct Particle {
+  Instance instance;
+  float velocity[2];
+  float padding[2];
+};
+
+static_assert(sizeof(Vertex) == 8, "Vertex must be tightly packed");
+static_assert(sizeof(Instance) == 16, "Instance must be tightly packed");
+static_assert(sizeof(View) == 12, "View must be tightly packed");
+static_assert(sizeof(Particle) == 32, "Particle must be tightly packed");
+
+// An indexed mesh drawn once per instance.
+struct Scene {
+  std::vector<Vertex> vertices;
+  std::vector<uint16_t> indices;
+  std::vector<Instance> instances;
+
+  // Half the width of the square around the origin that bounds the mesh, at
+  // an instance scale of 1.
+  float radius;
+
+  Scene() : radius(0) {}
+
+  uint64_t triangleCount() const {
+    return (uint64_t) (this->indices.size() / 3) * this->instances.size();
+  }
+};
+
+// A range of instances drawn with one command.
+struct Draw {
+  uint32_t firstInstance;
+  uint32_t instanceCount;
+};
+
+// Splits instanceCount instances into draws of at most perDraw instances.
+// Zero puts them all in one draw.
+inline std::vector<Draw> makeDrawList(uint32_t instanceCount, uint32_t perDraw) {
+  if (0 == perDraw)
+    perDraw = std::max<uint32_t>(instanceCount, 1);
+
+  std::vector<Draw> draws;
+  for (uint32_t first = 0; first < instanceCount; first += perDraw) {
+    Draw draw;
+    draw.firstInstance = first;
+    draw.instanceCount = std::min(perDraw, instanceCount - first);
+    draws.push_back(draw);
+  }
+  return draws;
+}
+
+// Writes src to dst with each instance bobbing up and down, t seconds in.
+inline void animateInstances(const Instance *src, Instance *dst, size_t count, float t) {
+  for (size_t i = 0; i < count; ++i) {
+    dst[i] = src[i];
+    dst[i].offset[1] += 0.02f * std::sin(t * 3 + src[i].offset[0] * 10);
+  }
+}
+
+// Starts each instance where it is, heading off in its own direction at up
+// to half a unit a second.
+inline std::vector<Particle> makeParticles(const std::vector<Instance> &instances) {
+  std::vector<Particle> particles(instances.size());
+  for (size_t i = 0; i < instances.size(); ++i) {
+    uint32_t h = (uint32_t) i * 2246822519u;
+    h ^= h >> 13;
+
+    float angle = (h & 0xffff) / 65536.0f * 6.2831853f;
+    float speed = 0.05f + (h >> 16) / 65536.0f * 0.45f;
+
+    particles[i].instance = instances[i];
+    particles[i].velocity[0] = speed * std::cos(angle);
+    particles[i].velocity[1] = speed * std::sin(angle);
+    particles[i].padding[0] = 0;
+    particles[i].padding[1] = 0;
+  }
+  return particles;
+}
+
+// A red/green/blue triangle with its corners at (-0.5, 0.5), (0, -0.5) and
+// (0.5, 0.5), tiled count times across the view. A single instance fills
+// the middle of the view.
+inline Scene makeGridScene(uint32_t count) {
+  Scene scene;
+
+  scene.vertices =
+    { { { toHalf(-0.5f), toHalf(0.5f) }, packColor(1, 0, 0, 1) },
+      { { toHalf(0.0f), toHalf(-0.5f) }, packColor(0, 1, 0, 1) },
+      { { toHalf(0.5f), toHalf(0.5f) }, packColor(0, 0, 1, 1) }
+    };
+  scene.indices = { 0, 1, 2 };
+  scene.radius = 0.5f;
+
+  uint32_t columns = (uint32_t) std::ceil(std::sqrt((double) count));
+  uint32_t rows = columns > 0 ? (count + columns - 1) / columns : 0;
+  float cell = columns > 0 ? 2.0f / columns : 0;
+  float rowHeight = rows > 0 ? 2.0f / rows : 0;
+
+  scene.instances.resize(count);
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t column = i % columns;
+    uint32_t row = i / columns;
+
+    // A cheap hash, so that neighbouring instances differ in depth and tint
+    // but every run produces the same scene.
+    uint32_t h = i * 2654435761u;
+    h ^= h >> 15;
+
+    Instance &instance = scene.instances[i];
+    instance.offset[0] = -1 + cell * (column + 0.5f);
+    instance.offset[1] = -1 + rowHeight * (row + 0.5f);
+    instance.scale = toHalf(1 == count ? 1.0f : std::fmin(cell, rowHeight) * 0.9f);
+    instance.depth = (uint16_t) (h & 0xffff);
+    instance.color =
+      1 == count ?
+        packColor(1, 1, 1, 1) :
+        packColor(0.5f + (h >> 16 & 0xff) / 510.0f,
+                  0.5f + (h >> 24 & 0xff) / 510.0f,
+                  0.5f + (h >> 8 & 0xff) / 510.0f,
+                  1);
+  }
+
+  return scene;
+}
+
+// The grid, layers times over. Each layer is shifted a little further along
+// the diagonal than the last, so the copies overlap and most pixels are
+// covered several times, at depths that have nothing to do with the order
+// the layers are drawn in.
+inline Scene makeLayeredScene(uint32_t count, uint32_t layers) {
+  Scene scene = makeGridScene(count);
+  if (layers <= 1 || count <= 1)
+    return scene;
+
+  uint32_t columns = (uint32_t) std::ceil(std::sqrt((double) count));
+  uint32_t rows = (count + columns - 1) / columns;
+  float cell = 2.0f / columns;
+  float rowHeight = 2.0f / rows;
+
+  std::vector<Instance> grid = scene.instances;
+  scene.instances.resize((size_t) count * layers);
+  for (uint32_t layer = 1; layer < layers; ++layer) {
+    float shift = 0.5f * layer / layers;
+    for (uint32_t i = 0; i < count; ++i) {
+      uint32_t h = (layer * count + i) * 2654435761u;
+      h ^= h >> 15;
+
+      Instance &instance = scene.instances[(size_t) layer * count + i];
+      instance = grid[i];
+      instance.offset[0] += cell * shift;
+      instance.offset[1] += rowHeight * shift;
+      instance.depth = (uint16_t) (h & 0xffff);
+    }
+  }
+
+  return scene;
+}
+
+// Puts the nearest instances first, so that with depth testing the ones
+// behind them fail the test before they're shaded. Instances at the same
+// depth keep their order.
+inline void sortFrontToBack(std::vector<Instance> &instances) {
+  std::stable_sort
+    (instances.begin(), instances.end(),
+     [](const Instance &a, const Instance &b) { return a.depth < b.depth; });
+}
+
+// Sets how opaque every instance is, keeping its colour.
+inline void setOpacity(std::vector<Instance> &instances, float opacity) {
+  uint32_t alpha = packColor(0, 0, 0, opacity);
+  for (auto &instance : instances)
+    instance.color = (instance.color & 0x00ffffff) | alpha;
+}
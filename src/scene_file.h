@@ -0,0 +1,257 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scene.h"
+
+// A scene laid out on disk the way it's laid out in GPU buffers, so that it
+// can be mapped into memory and copied straight from the page cache without
+// parsing anything. In order:
+//
+//   SceneFileHeader
+//   Vertex[vertexCount]      at vertexOffset
+//   uint16_t[indexCount]     at indexOffset
+//   SceneChunk[chunkCount]   at chunkTableOffset
+//   Instance[]               each chunk's, at the chunk's offset
+//
+// Every array starts on a SCENE_FILE_ALIGNMENT boundary. The chunks hold
+// consecutive runs of instances, in order, so a scene can be loaded a chunk
+// at a time. Everything is in the host's byte order.
+const char SCENE_FILE_MAGIC[8] = { 'T', 'R', 'I', 'S', 'C', 'E', 'N', 'E' };
+const uint32_t SCENE_FILE_VERSION = 1;
+const uint64_t SCENE_FILE_ALIGNMENT = 16;
+
+struct SceneFileHeader {
+  char magic[8];
+  uint32_t version;
+  float radius;
+  uint32_t vertexCount;
+  uint32_t indexCount;
+  uint32_t instanceCount;
+  uint32_t chunkCount;
+  uint64_t vertexOffset;
+  uint64_t indexOffset;
+  uint64_t chunkTableOffset;
+};
+
+struct SceneChunk {
+  uint64_t offset;
+  uint32_t firstInstance;
+  uint32_t instanceCount;
+};
+
+static_assert(sizeof(SceneFileHeader) == 56, "SceneFileHeader must be tightly packed");
+static_assert(sizeof(SceneChunk) == 16, "SceneChunk must be tightly packed");
+
+// A scene file mapped into memory. The pointers it hands out stay valid for
+// as long as it's open.
+class SceneFile {
+private:
+  std::string path;
+  const uint8_t *data;
+  size_t size;
+
+  const SceneFileHeader &header() const {
+    return *(const SceneFileHeader*) this->data;
+  }
+
+  void check(bool ok, const std::string &problem) const {
+    if (!ok) {
+      throw std::runtime_error(this->path + ": " + problem);
+    }
+  }
+
+  // Whether count items of itemSize bytes at offset lie inside the file.
+  bool inside(uint64_t offset, uint64_t count, uint64_t itemSize) const {
+    return 0 == offset % SCENE_FILE_ALIGNMENT &&
+      offset <= this->size &&
+      count <= (this->size - offset) / itemSize;
+  }
+
+  void validate() const {
+    this->check(this->size >= sizeof(SceneFileHeader), "too short to be a scene file");
+
+    const SceneFileHeader &h = this->header();
+    this->check(0 == memcmp(h.magic, SCENE_FILE_MAGIC, sizeof(h.magic)), "not a scene file");
+    this->check(SCENE_FILE_VERSION == h.version,
+                "scene file version " + std::to_string(h.version) + " isn't supported");
+    this->check(h.vertexCount > 0 && h.indexCount > 0, "scene has no mesh");
+    this->check(0 == h.indexCount % 3, "scene's index count isn't a multiple of 3");
+    this->check(this->inside(h.vertexOffset, h.vertexCount, sizeof(Vertex)), "vertices out of bounds");
+    this->check(this->inside(h.indexOffset, h.indexCount, sizeof(uint16_t)), "indices out of bounds");
+    this->check(this->inside(h.chunkTableOffset, h.chunkCount, sizeof(SceneChunk)),
+                "chunk table out of bounds");
+
+    const uint16_t *indices = this->indices();
+    this->check(std::all_of(indices, indices + h.indexCount,
+                            [&](uint16_t i) { return i < h.vertexCount; }),
+                "index out of range");
+
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < h.chunkCount; ++i) {
+      const SceneChunk &c = this->chunk(i);
+      this->check(c.firstInstance == next && c.instanceCount > 0, "chunks aren't consecutive");
+      this->check(this->inside(c.offset, c.instanceCount, sizeof(Instance)),
+                  "chunk " + std::to_string(i) + " out of bounds");
+      next += c.instanceCount;
+    }
+    this->check(next == h.instanceCount, "chunks don't hold every instance");
+  }
+
+public:
+  // Maps the file, and checks that everything it describes lies inside it.
+  // Throws if it can't be opened or isn't a valid scene file.
+  explicit SceneFile(const std::string &path) : path(path), data(nullptr), size(0) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    this->check(fd >= 0, "couldn't open");
+
+    struct stat info;
+    if (0 != fstat(fd, &info)) {
+      close(fd);
+      this->check(false, "couldn't stat");
+    }
+    this->size = info.st_size;
+
+    void *mapped =
+      this->size > 0 ? mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    // The mapping keeps the file open.
+    close(fd);
+    this->check(MAP_FAILED != mapped, "couldn't map");
+    this->data = (const uint8_t*) mapped;
+
+    try {
+      this->validate();
+    } catch (...) {
+      munmap((void*) this->data, this->size);
+      throw;
+    }
+
+    // Instances are read front to back, once.
+    madvise((void*) this->data, this->size, MADV_SEQUENTIAL);
+  }
+
+  SceneFile(const SceneFile&) = delete;
+  SceneFile &operator=(const SceneFile&) = delete;
+
+  ~SceneFile() {
+    munmap((void*) this->data, this->size);
+  }
+
+  float radius() const { return this->header().radius; }
+  uint32_t vertexCount() const { return this->header().vertexCount; }
+  uint32_t indexCount() const { return this->header().indexCount; }
+  uint32_t instanceCount() const { return this->header().instanceCount; }
+  uint32_t chunkCount() const { return this->header().chunkCount; }
+
+  const Vertex *vertices() const {
+    return (const Vertex*) (this->data + this->header().vertexOffset);
+  }
+
+  const uint16_t *indices() const {
+    return (const uint16_t*) (this->data + this->header().indexOffset);
+  }
+
+  const SceneChunk &chunk(uint32_t i) const {
+    return ((const SceneChunk*) (this->data + this->header().chunkTableOffset))[i];
+  }
+
+  const Instance *instances(const SceneChunk &chunk) const {
+    return (const Instance*) (this->data + chunk.offset);
+  }
+
+  // Asks the kernel to start reading a chunk in, so that copying it later
+  // doesn't wait for the disk.
+  void prefetch(const SceneChunk &chunk) const {
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) (this->data + chunk.offset) & ~(page - 1);
+    uintptr_t end = (uintptr_t) (this->data + chunk.offset) + chunk.instanceCount * sizeof(Instance);
+    madvise((void*) start, end - start, MADV_WILLNEED);
+  }
+
+  // Copies the whole scene out, for uses that need it in memory at once.
+  Scene toScene() const {
+    Scene scene;
+    scene.vertices.assign(this->vertices(), this->vertices() + this->vertexCount());
+    scene.indices.assign(this->indices(), this->indices() + this->indexCount());
+    scene.instances.reserve(this->instanceCount());
+    for (uint32_t i = 0; i < this->chunkCount(); ++i) {
+      const Instance *instances = this->instances(this->chunk(i));
+      scene.instances.insert
+        (scene.instances.end(), instances, instances + this->chunk(i).instanceCount);
+    }
+    scene.radius = this->radius();
+    return scene;
+  }
+};
+
+// Writes scene to path, with instancesPerChunk instances to a chunk. Throws
+// if it can't.
+inline void writeSceneFile
+  (const std::string &path,
+   const Scene &scene,
+   uint32_t instancesPerChunk) {
+
+  auto align = [](uint64_t offset) {
+    return (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+  };
+
+  std::vector<Draw> runs = makeDrawList(scene.instances.size(), instancesPerChunk);
+
+  SceneFileHeader header;
+  memcpy(header.magic, SCENE_FILE_MAGIC, sizeof(header.magic));
+  header.version = SCENE_FILE_VERSION;
+  header.radius = scene.radius;
+  header.vertexCount = scene.vertices.size();
+  header.indexCount = scene.indices.size();
+  header.instanceCount = scene.instances.size();
+  header.chunkCount = runs.size();
+  header.vertexOffset = align(sizeof(header));
+  header.indexOffset = align(header.vertexOffset + scene.vertices.size() * sizeof(Vertex));
+  header.chunkTableOffset = align(header.indexOffset + scene.indices.size() * sizeof(uint16_t));
+
+  std::vector<SceneChunk> chunks;
+  uint64_t offset = align(header.chunkTableOffset + runs.size() * sizeof(SceneChunk));
+  for (auto &run : runs) {
+    SceneChunk chunk;
+    chunk.offset = offset;
+    chunk.firstInstance = run.firstInstance;
+    chunk.instanceCount = run.instanceCount;
+    chunks.push_back(chunk);
+    offset = align(offset + run.instanceCount * sizeof(Instance));
+  }
+
+  std::ofstream file(path, std::ios_base::binary | std::ios_base::trunc);
+  if (!file.is_open()) {
+    throw std::runtime_error("couldn't open " + path);
+  }
+
+  auto writeAt = [&](uint64_t offset, const void *data, size_t size) {
+    static const char zeros[SCENE_FILE_ALIGNMENT] = {};
+    file.write(zeros, offset - (uint64_t) file.tellp());
+    file.write((const char*) data, size);
+  };
+
+  writeAt(0, &header, sizeof(header));
+  writeAt(header.vertexOffset, scene.vertices.data(), scene.vertices.size() * sizeof(Vertex));
+  writeAt(header.indexOffset, scene.indices.data(), scene.indices.size() * sizeof(uint16_t));
+  writeAt(header.chunkTableOffset, chunks.data(), chunks.size() * sizeof(SceneChunk));
+  for (auto &chunk : chunks)
+    writeAt(chunk.offset,
+            scene.instances.data() + chunk.firstInstance,
+            chunk.instanceCount * sizeof(Instance));
+
+  if (!file) {
+    throw std::runtime_error("couldn't write " + path);
+  }
+}
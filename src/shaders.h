@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+// SPIR-V for every shader, generated from shaders/ by the Makefile as
+// constexpr uint32_t arrays. Shader modules are created straight from them,
+// so nothing is read from disk or copied.
+#include "../shaders/vert.spv.h"
+#include "../shaders/frag.spv.h"
+#include "../shaders/cull.spv.h"
+#include "../shaders/simulate.spv.h"
+#include "../shaders/sort.spv.h"
+
+struct ShaderCode {
+  const uint32_t *words;
+
+  // In bytes, as VkShaderModuleCreateInfo wants it.
+  size_t size;
+};
+
+template <size_t N>
+constexpr ShaderCode shaderCode(const uint32_t (&words)[N]) {
+  return ShaderCode{ words, N * sizeof(uint32_t) };
+}
+
+// Every embedded shader, with the GLSL in shaders/ that it's built from,
+// and the SPIR-V file that hot reloading compiles that GLSL to, next to it.
+struct EmbeddedShader {
+  const char *source;
+  const char *spirv;
+  vk::ShaderStageFlagBits stage;
+  ShaderCode code;
+};
+
+constexpr EmbeddedShader embeddedShaders[] = {
+  { "triangle.vert", "vert.spv", vk::ShaderStageFlagBits::eVertex, shaderCode(vertSpirv) },
+  { "triangle.frag", "frag.spv", vk::ShaderStageFlagBits::eFragment, shaderCode(fragSpirv) },
+  { "cull.comp", "cull.spv", vk::ShaderStageFlagBits::eCompute, shaderCode(cullSpirv) },
+  { "simulate.comp", "simulate.spv", vk::ShaderStageFlagBits::eCompute, shaderCode(simulateSpirv) },
+  { "sort.comp", "sort.spv", vk::ShaderStageFlagBits::eCompute, shaderCode(sortSpirv) }
+};
+
+// Only the graphics pipeline is rebuilt at runtime; the compute pipelines
+// are made once, at startup.
+inline bool reloadable(const EmbeddedShader &shader) {
+  return
+    vk::ShaderStageFlagBits::eVertex == shader.stage ||
+    vk::ShaderStageFlagBits::eFragment == shader.stage;
+}
+
+// The code for each stage of the graphics pipeline: the embedded SPIR-V,
+// unless a stage has been replaced with code loaded at runtime, which this
+// then keeps alive.
+struct GraphicsShaders {
+  ShaderCode vertex;
+  ShaderCode fragment;
+  std::shared_ptr<const std::vector<uint32_t>> loadedVertex;
+  std::shared_ptr<const std::vector<uint32_t>> loadedFragment;
+
+  GraphicsShaders() :
+    vertex(shaderCode(vertSpirv)),
+    fragment(shaderCode(fragSpirv)) {}
+
+  void loadVertex(const std::vector<uint32_t> &words) {
+    this->loadedVertex = std::make_shared<const std::vector<uint32_t>>(words);
+    this->vertex = ShaderCode{ this->loadedVertex->data(), words.size() * sizeof(uint32_t) };
+  }
+
+  void loadFragment(const std::vector<uint32_t> &words) {
+    this->loadedFragment = std::make_shared<const std::vector<uint32_t>>(words);
+    this->fragment = ShaderCode{ this->loadedFragment->data(), words.size() * sizeof(uint32_t) };
+  }
+};
+
+// Matches COLOR_MODE in triangle.vert.
+enum class ColorMode : uint32_t {
+  // Vertex colours tinted by the instance colour.
+  Shaded = 0,
+  Vertex = 1,
+  Instance = 2,
+  // Instance depth as a shade of grey.
+  Depth = 3
+};
+
+// Selects a graphics pipeline specialised for a set of constants, so the
+// shaders don't branch on them at runtime. Every field but blend is a
+// specialization constant; blend turns on alpha blending, for instances
+// that are drawn back to front.
+struct PipelineVariant {
+  ColorMode colorMode;
+  bool blend;
+
+  PipelineVariant() : colorMode(ColorMode::Shaded), blend(false) {}
+
+  bool operator<(const PipelineVariant &other) const {
+    if (this->colorMode != other.colorMode)
+      return this->colorMode < other.colorMode;
+    return this->blend < other.blend;
+  }
+};
+
+// Specialization constants for one shader stage. Constant i gets id i, so
+// add them in the order of their constant_id.
+class SpecializationConstants {
+private:
+  std::vector<vk::SpecializationMapEntry> entries;
+  std::vector<uint32_t> data;
+  vk::SpecializationInfo specializationInfo;
+
+public:
+  SpecializationConstants() {}
+
+  // Copying would leave info() pointing into the original.
+  SpecializationConstants(const SpecializationConstants&) = delete;
+  SpecializationConstants &operator=(const SpecializationConstants&) = delete;
+
+  // 32 bits covers int, uint, float and bool (as VkBool32) constants.
+  void add(uint32_t value) {
+    uint32_t id = this->entries.size();
+    this->entries.push_back
+      (vk::SpecializationMapEntry(id, id * sizeof(uint32_t), sizeof(uint32_t)));
+    this->data.push_back(value);
+  }
+
+  const vk::SpecializationInfo *info() {
+    this->specializationInfo =
+      vk::SpecializationInfo
+        (this->entries.size(), this->entries.data(),
+         this->data.size() * sizeof(uint32_t), this->data.data());
+    return &this->specializationInfo;
+  }
+};
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "trace.h"
+
+// A set of tasks, each of which may only start once the tasks it depends on
+// have finished, run once across a pool of threads. The thread that calls
+// run works on the tasks too, and is the only one that runs tasks marked as
+// needing the main thread (like most of GLFW).
+//
+// Tasks can only depend on tasks added before them, so there can't be a
+// cycle, and adding them in an order that would work sequentially is enough
+// to make the graph valid.
+class TaskGraph {
+public:
+  typedef uint32_t Task;
+
+private:
+  struct Node {
+    std::string name;
+    std::function<void()> run;
+    bool mainThread;
+    uint32_t waitingFor;
+    std::vector<Task> dependents;
+  };
+
+  std::vector<Node> nodes;
+
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<Task> ready;
+  std::deque<Task> readyForMain;
+  uint32_t finished;
+  uint32_t running;
+  std::exception_ptr error;
+
+  bool idle() const {
+    return this->finished == this->nodes.size() || (this->error && 0 == this->running);
+  }
+
+  // Runs tasks until there are none left, or one has failed and the rest
+  // have stopped. Once a task fails, no more are started.
+  void work(bool mainThread, Trace &trace) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (;;) {
+      this->wake.wait
+        (lock,
+         [&]() {
+           return this->idle() ||
+             (!this->error &&
+              (!this->ready.empty() || (mainThread && !this->readyForMain.empty())));
+         });
+      if (this->idle())
+        return;
+
+      std::deque<Task> &queue =
+        mainThread && !this->readyForMain.empty() ? this->readyForMain : this->ready;
+      Task task = queue.front();
+      queue.pop_front();
+      ++this->running;
+      lock.unlock();
+
+      std::exception_ptr error;
+      Clock::time_point start = Clock::now();
+      try {
+        this->nodes[task].run();
+      } catch (...) {
+        error = std::current_exception();
+      }
+      trace.span(this->nodes[task].name, start);
+
+      lock.lock();
+      --this->running;
+      ++this->finished;
+      if (error && !this->error)
+        this->error = error;
+      for (Task d : this->nodes[task].dependents) {
+        Node &dependent = this->nodes[d];
+        if (0 == --dependent.waitingFor)
+          (dependent.mainThread ? this->readyForMain : this->ready).push_back(d);
+      }
+      this->wake.notify_all();
+    }
+  }
+
+public:
+  TaskGraph() : finished(0), running(0) {}
+
+  TaskGraph(const TaskGraph&) = delete;
+  TaskGraph &operator=(const TaskGraph&) = delete;
+
+  Task add
+    (const std::string &name,
+     const std::vector<Task> &dependencies,
+     const std::function<void()> &run,
+     bool mainThread = false) {
+
+    Task task = this->nodes.size();
+
+    Node node;
+    node.name = name;
+    node.run = run;
+    node.mainThread = mainThread;
+    node.waitingFor = dependencies.size();
+    this->nodes.push_back(node);
+
+    for (Task d : dependencies) {
+      assert(d < task);
+      this->nodes[d].dependents.push_back(task);
+    }
+    return task;
+  }
+
+  // Runs every task, on threadCount threads including the caller, and
+  // waits for them. If any task throws, the tasks already running are
+  // allowed to finish, then the first exception is rethrown. Each task is
+  // recorded as a span in trace.
+  void run(uint32_t threadCount, Trace &trace) {
+    for (Task i = 0; i < this->nodes.size(); ++i) {
+      if (0 == this->nodes[i].waitingFor)
+        (this->nodes[i].mainThread ? this->readyForMain : this->ready).push_back(i);
+    }
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < threadCount; ++i) {
+      threads.push_back
+        (std::thread
+           ([this, i, &trace]() {
+              trace.nameThread("startup " + std::to_string(i));
+              this->work(false, trace);
+            }));
+    }
+
+    this->work(true, trace);
+    for (auto &t : threads)
+      t.join();
+
+    if (this->error)
+      std::rethrow_exception(this->error);
+  }
+};
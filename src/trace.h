@@ -0,0 +1,138 @@
+#pragma once
+
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+
+// Records how long things take, on which thread, for viewing as a timeline
+// in chrome://tracing or Perfetto. Spans can be recorded from any thread.
+// A disabled trace records nothing.
+class Trace {
+private:
+  struct Event {
+    std::string name;
+    uint32_t thread;
+    double start;
+    double duration;
+  };
+
+  bool enabled;
+  Clock::time_point origin;
+
+  std::mutex mutex;
+  std::vector<Event> events;
+  std::map<std::thread::id, uint32_t> threadIds;
+  std::vector<std::string> threadNames;
+
+  // Called with the lock held. Threads are numbered in the order they're
+  // first seen.
+  uint32_t threadId() {
+    auto it = this->threadIds.find(std::this_thread::get_id());
+    if (it != this->threadIds.end())
+      return it->second;
+
+    uint32_t id = this->threadNames.size();
+    this->threadIds[std::this_thread::get_id()] = id;
+    this->threadNames.push_back("thread " + std::to_string(id));
+    return id;
+  }
+
+public:
+  // Times are measured from when the trace is made.
+  Trace() : enabled(false), origin(Clock::now()) {}
+
+  Trace(const Trace&) = delete;
+  Trace &operator=(const Trace&) = delete;
+
+  void enable() {
+    this->enabled = true;
+  }
+
+  bool isEnabled() const {
+    return this->enabled;
+  }
+
+  // Names the calling thread on the timeline.
+  void nameThread(const std::string &name) {
+    if (!this->enabled)
+      return;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->threadNames[this->threadId()] = name;
+  }
+
+  // Records that name ran on the calling thread from start until now.
+  void span(const std::string &name, Clock::time_point start) {
+    if (!this->enabled)
+      return;
+
+    Clock::time_point end = Clock::now();
+    Event event;
+    event.name = name;
+    event.start = std::chrono::duration<double, std::micro>(start - this->origin).count();
+    event.duration = std::chrono::duration<double, std::micro>(end - start).count();
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    event.thread = this->threadId();
+    this->events.push_back(event);
+  }
+
+  // Records a span covering its own lifetime.
+  class Scope {
+  private:
+    Trace &trace;
+    std::string name;
+    Clock::time_point start;
+
+  public:
+    Scope(Trace &trace, const std::string &name) :
+      trace(trace),
+      name(name),
+      start(Clock::now()) {}
+
+    Scope(const Scope&) = delete;
+    Scope &operator=(const Scope&) = delete;
+
+    ~Scope() {
+      this->trace.span(this->name, this->start);
+    }
+  };
+
+  // Writes everything recorded so far in the Trace Event Format, as
+  // complete ("X") events with times in microseconds.
+  void writeJson(std::ostream &out) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    std::ios_base::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed << std::setprecision(1);
+
+    out << "{\n  \"displayTimeUnit\": \"ms\",\n  \"traceEvents\": [";
+    const char *separator = "\n    ";
+    for (uint32_t i = 0; i < this->threadNames.size(); ++i) {
+      out << separator << "{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << i
+          << ", \"args\": { \"name\": ";
+      writeJsonString(out, this->threadNames[i]);
+      out << " } }";
+      separator = ",\n    ";
+    }
+    for (auto &e : this->events) {
+      out << separator << "{ \"name\": ";
+      writeJsonString(out, e.name);
+      out << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread
+          << ", \"ts\": " << e.start << ", \"dur\": " << e.duration << " }";
+      separator = ",\n    ";
+    }
+    out << "\n  ]\n}\n";
+
+    out.flags(flags);
+    out.precision(precision);
+  }
+};
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <vulkan/vulkan.hpp>
+
+#include "allocator.h"
+
+// A persistently mapped staging buffer used as a ring, for streaming data to
+// device-local buffers every frame. Copies are recorded per frame in flight
+// and submitted to the transfer queue, which is a dedicated transfer family
+// when the device has one.
+//
+// When the transfer and graphics families differ, the destination buffers
+// are released to the graphics family after the copy, and the graphics side
+// must record the matching acquire with recordAcquire. Either way the
+// graphics submission must wait on the semaphore that submit returns.
+class UploadRing {
+private:
+  struct Frame {
+    vk::CommandPool pool;
+    vk::CommandBuffer commands;
+    vk::Fence fence;
+    vk::Semaphore done;
+
+    // Ring position just past this frame's data.
+    vk::DeviceSize end;
+
+    std::vector<vk::BufferMemoryBarrier> acquires;
+  };
+
+  vk::Device device;
+  vk::Queue queue;
+  uint32_t transferFamily;
+  uint32_t graphicsFamily;
+
+  vk::Buffer buffer;
+  Allocation allocation;
+  vk::DeviceSize capacity;
+
+  // Positions increase forever; position p is at offset p % capacity. Data
+  // between tail and head may still be read by the device.
+  vk::DeviceSize head;
+  vk::DeviceSize tail;
+
+  std::vector<Frame> frames;
+  uint32_t current;
+  bool recording;
+
+  // How the graphics family first uses the uploaded data.
+  vk::PipelineStageFlags consumerStage;
+  vk::AccessFlags consumerAccess;
+
+  void begin() {
+    if (this->recording)
+      return;
+
+    Frame &frame = this->frames[this->current];
+    this->device.resetCommandPool(frame.pool, {});
+    frame.commands.begin
+      (vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit, nullptr));
+    this->recording = true;
+  }
+
+public:
+  UploadRing() :
+    transferFamily(0),
+    graphicsFamily(0),
+    capacity(0),
+    head(0),
+    tail(0),
+    current(0),
+    recording(false),
+    consumerStage(vk::PipelineStageFlagBits::eVertexInput),
+    consumerAccess(vk::AccessFlagBits::eVertexAttributeRead) {}
+
+  void init
+    (Allocator &allocator,
+     vk::Device device,
+     vk::Queue queue,
+     uint32_t transferFamily,
+     uint32_t graphicsFamily,
+     vk::DeviceSize size,
+     uint32_t frameCount) {
+
+    this->device = device;
+    this->queue = queue;
+    this->transferFamily = transferFamily;
+    this->graphicsFamily = graphicsFamily;
+    this->capacity = size;
+
+    vk::BufferCreateInfo bufferInfo
+      ({},
+       size,
+       vk::BufferUsageFlagBits::eTransferSrc,
+       vk::SharingMode::eExclusive,
+       0, nullptr);
+    this->buffer = device.createBuffer(bufferInfo);
+
+    this->allocation =
+      allocator.allocate
+        (device.getBufferMemoryRequirements(this->buffer),
+         vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+         {},
+         false);
+    device.bindBufferMemory(this->buffer, this->allocation.memory, this->allocation.offset);
+
+    this->frames = std::vector<Frame>(frameCount);
+    for (auto &frame : this->frames) {
+      vk::CommandPoolCreateInfo poolInfo
+        (vk::CommandPoolCreateFlagBits::eTransient, transferFamily);
+      frame.pool = device.createCommandPool(poolInfo);
+
+      vk::CommandBufferAllocateInfo allocateInfo
+        (frame.pool,
+         vk::CommandBufferLevel::ePrimary,
+         1);
+      frame.commands = device.allocateCommandBuffers(allocateInfo)[0];
+
+      frame.fence = device.createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled));
+      frame.done = device.createSemaphore(vk::SemaphoreCreateInfo());
+      frame.end = 0;
+    }
+  }
+
+  void destroy(Allocator &allocator) {
+    for (auto &frame : this->frames) {
+      this->device.destroyCommandPool(frame.pool);
+      this->device.destroyFence(frame.fence);
+      this->device.destroySemaphore(frame.done);
+    }
+    this->frames.clear();
+
+    if (this->buffer)
+      this->device.destroyBuffer(this->buffer);
+    allocator.free(this->allocation);
+  }
+
+  // Uploads are read as vertex attributes unless this says otherwise. Only
+  // matters for the ownership transfer between queue families.
+  void setConsumer(vk::PipelineStageFlags stage, vk::AccessFlags access) {
+    this->consumerStage = stage;
+    this->consumerAccess = access;
+  }
+
+  bool separateQueue() const {
+    return this->transferFamily != this->graphicsFamily;
+  }
+
+  // Starts collecting the copies for a frame in flight. Space used by the
+  // last frame submitted from the same slot is reclaimed, after waiting for
+  // its copies if they haven't finished already.
+  void beginFrame(uint32_t frame) {
+    assert(!this->recording);
+
+    this->current = frame;
+    Frame &f = this->frames[frame];
+
+    this->device.waitForFences
+      (1, &f.fence,
+       true,
+       std::numeric_limits<uint64_t>::max());
+
+    this->tail = std::max(this->tail, f.end);
+    f.acquires.clear();
+  }
+
+  // Makes room for size bytes to be copied to dst at dstOffset, and returns
+  // where to write them. The data must be written before submit. Returns
+  // null if the ring is too full this frame.
+  void *reserve(vk::Buffer dst, vk::DeviceSize dstOffset, vk::DeviceSize size) {
+    assert(size > 0);
+
+    vk::DeviceSize start = this->head;
+    if (start % this->capacity + size > this->capacity)
+      start = alignUp(start, this->capacity);
+    start = alignUp(start, 16);
+
+    if (start + size - this->tail > this->capacity)
+      return nullptr;
+
+    this->begin();
+    this->head = start + size;
+
+    Frame &frame = this->frames[this->current];
+    vk::BufferCopy region(start % this->capacity, dstOffset, size);
+    frame.commands.copyBuffer(this->buffer, dst, region);
+
+    if (this->separateQueue()) {
+      frame.acquires.push_back
+        (vk::BufferMemoryBarrier
+           ({},
+            this->consumerAccess,
+            this->transferFamily,
+            this->graphicsFamily,
+            dst,
+            dstOffset,
+            size));
+    }
+
+    return (char*) this->allocation.mapped + start % this->capacity;
+  }
+
+  bool upload(vk::Buffer dst, vk::DeviceSize dstOffset, const void *data, vk::DeviceSize size) {
+    void *mapped = this->reserve(dst, dstOffset, size);
+    if (!mapped)
+      return false;
+    memcpy(mapped, data, size);
+    return true;
+  }
+
+  // Submits the frame's copies. Returns the semaphore that the graphics
+  // submission has to wait on, or a null handle if there was nothing to copy.
+  vk::Semaphore submit() {
+    if (!this->recording)
+      return vk::Semaphore();
+
+    Frame &frame = this->frames[this->current];
+
+    if (this->separateQueue()) {
+      std::vector<vk::BufferMemoryBarrier> releases;
+      for (auto &acquire : frame.acquires) {
+        releases.push_back
+          (vk::BufferMemoryBarrier
+             (vk::AccessFlagBits::eTransferWrite,
+              {},
+              acquire.srcQueueFamilyIndex,
+              acquire.dstQueueFamilyIndex,
+              acquire.buffer,
+              acquire.offset,
+              acquire.size));
+      }
+      frame.commands.pipelineBarrier
+        (vk::PipelineStageFlagBits::eTransfer,
+         vk::PipelineStageFlagBits::eBottomOfPipe,
+         {},
+         nullptr,
+         releases,
+         nullptr);
+    }
+
+    frame.commands.end();
+    this->recording = false;
+
+    frame.end = this->head;
+
+    vk::SubmitInfo submitInfo
+      (0, nullptr, nullptr,
+       1, &frame.commands,
+       1, &frame.done);
+    this->device.resetFences(1, &frame.fence);
+    this->queue.submit(1, &submitInfo, frame.fence);
+
+    return frame.done;
+  }
+
+  // The graphics family's half of the ownership transfer, to be recorded in
+  // a command buffer that runs before anything reads the frame's uploads.
+  // Does nothing when there's only one queue family involved.
+  void recordAcquire(vk::CommandBuffer c) const {
+    const Frame &frame = this->frames[this->current];
+    if (frame.acquires.empty())
+      return;
+
+    c.pipelineBarrier
+      (this->consumerStage,
+       this->consumerStage,
+       {},
+       nullptr,
+       frame.acquires,
+       nullptr);
+  }
+
+  bool hasAcquires() const {
+    return !this->frames[this->current].acquires.empty();
+  }
+};
@@ -0,0 +1,173 @@
+// Checks the renderer's output against what's expected of it:
+//
+//   compare image ACTUAL.ppm GOLDEN.ppm TOLERANCE MAX_BAD_FRACTION
+//
+// fails if more than MAX_BAD_FRACTION of the pixels have a channel that's
+// off by more than TOLERANCE (out of 255), and
+//
+//   compare perf RESULT.json BASELINE.json THRESHOLD
+//
+// fails if the median frame time is more than THRESHOLD (a fraction) above
+// the baseline's, or triangles per second more than THRESHOLD below. Both
+// JSON files are --benchmark output.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct Image {
+  uint32_t width;
+  uint32_t height;
+
+  // 3 bytes a pixel.
+  std::vector<uint8_t> rgb;
+};
+
+// Reads a binary (P6) PPM with 8-bit channels, as the renderer writes them.
+Image readPpm(const std::string &path) {
+  std::ifstream file(path, std::ios_base::binary);
+  if (!file.is_open()) {
+    throw std::runtime_error("couldn't open " + path);
+  }
+
+  std::string magic;
+  uint32_t maxValue;
+  Image image;
+  file >> magic >> image.width >> image.height >> maxValue;
+  file.get();
+  if (!file || "P6" != magic || 255 != maxValue) {
+    throw std::runtime_error(path + " isn't an 8-bit binary PPM");
+  }
+
+  image.rgb.resize((size_t) image.width * image.height * 3);
+  file.read((char*) image.rgb.data(), image.rgb.size());
+  if (!file) {
+    throw std::runtime_error(path + " is truncated");
+  }
+  return image;
+}
+
+bool compareImages
+  (const std::string &actualPath,
+   const std::string &goldenPath,
+   int tolerance,
+   double maxBadFraction) {
+
+  Image actual = readPpm(actualPath);
+  Image golden = readPpm(goldenPath);
+
+  if (actual.width != golden.width || actual.height != golden.height) {
+    std::cout << actualPath << " is " << actual.width << "x" << actual.height
+              << " but " << goldenPath << " is " << golden.width << "x" << golden.height
+              << std::endl;
+    return false;
+  }
+
+  size_t pixelCount = (size_t) actual.width * actual.height;
+  size_t bad = 0;
+  int maxDifference = 0;
+  for (size_t i = 0; i < pixelCount; ++i) {
+    int worst = 0;
+    for (size_t c = 0; c < 3; ++c)
+      worst = std::max(worst, std::abs(actual.rgb[i * 3 + c] - golden.rgb[i * 3 + c]));
+    maxDifference = std::max(maxDifference, worst);
+    if (worst > tolerance)
+      ++bad;
+  }
+
+  double badFraction = pixelCount > 0 ? (double) bad / pixelCount : 0;
+  bool ok = badFraction <= maxBadFraction;
+  std::cout << (ok ? "ok" : "FAILED") << ": " << actualPath
+            << ": " << bad << " of " << pixelCount << " pixels differ by more than " << tolerance
+            << " (max difference " << maxDifference << ")" << std::endl;
+  return ok;
+}
+
+// Finds a number in --benchmark output: either a metric ("name": 1.5) or,
+// given a field, one field of a series' summary ("name": { "p50": 1.5 }).
+double jsonNumber(const std::string &json, const std::string &name, const std::string &field) {
+  size_t at = json.find("\"" + name + "\"");
+  if (std::string::npos == at) {
+    throw std::runtime_error("no " + name + " in benchmark output");
+  }
+
+  at = json.find(':', at) + 1;
+  if (!field.empty()) {
+    size_t end = json.find('}', at);
+    at = json.find("\"" + field + "\"", at);
+    if (std::string::npos == at || at > end) {
+      throw std::runtime_error("no " + name + "." + field + " in benchmark output");
+    }
+    at = json.find(':', at) + 1;
+  }
+
+  return std::strtod(json.c_str() + at, nullptr);
+}
+
+std::string readFile(const std::string &path) {
+  std::ifstream file(path);
+  if (!file.is_open()) {
+    throw std::runtime_error("couldn't open " + path);
+  }
+  std::ostringstream contents;
+  contents << file.rdbuf();
+  return contents.str();
+}
+
+bool comparePerformance
+  (const std::string &resultPath,
+   const std::string &baselinePath,
+   double threshold) {
+
+  std::string result = readFile(resultPath);
+  std::string baseline = readFile(baselinePath);
+  bool ok = true;
+
+  // Lower is better for one, higher for the other.
+  auto check = [&](const std::string &label, double actual, double expected, bool lowerIsBetter) {
+    double change = expected != 0 ? (actual - expected) / expected : 0;
+    bool regressed = lowerIsBetter ? change > threshold : -change > threshold;
+    std::cout << (regressed ? "FAILED" : "ok") << ": " << resultPath << ": " << label
+              << " " << actual << " against a baseline of " << expected
+              << " (" << (change >= 0 ? "+" : "") << change * 100 << "%)" << std::endl;
+    ok = ok && !regressed;
+  };
+
+  check("median frame time (ms)",
+        jsonNumber(result, "frame_time_ms", "p50"),
+        jsonNumber(baseline, "frame_time_ms", "p50"),
+        true);
+  check("triangles per second",
+        jsonNumber(result, "triangles_per_second", ""),
+        jsonNumber(baseline, "triangles_per_second", ""),
+        false);
+
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> args(argv + 1, argv + argc);
+
+  try {
+    if (5 == args.size() && "image" == args[0]) {
+      return compareImages(args[1], args[2], std::stoi(args[3]), std::stod(args[4])) ? 0 : 1;
+    }
+    if (4 == args.size() && "perf" == args[0]) {
+      return comparePerformance(args[1], args[2], std::stod(args[3])) ? 0 : 1;
+    }
+  } catch (std::exception &e) {
+    std::cout << "FAILED: " << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cerr << "usage: compare image ACTUAL.ppm GOLDEN.ppm TOLERANCE MAX_BAD_FRACTION" << std::endl
+            << "       compare perf RESULT.json BASELINE.json THRESHOLD" << std::endl;
+  return 2;
+}
@@ -0,0 +1,133 @@
+#!/bin/sh
+# Renders every scene in tests/scenes headlessly, and fails if an image
+# strays from its golden image or performance regresses from its baseline.
+#
+# Meant for a software driver, so results don't depend on the machine's
+# GPU: lavapipe is picked by default (set TRIANGLE_DEVICE to choose another,
+# such as "SwiftShader"), and VK_ICD_FILENAMES can point the loader at its
+# ICD if it isn't installed system-wide.
+#
+# With UPDATE=1, the golden images and baselines are rewritten from this
+# run instead. Only do that on the reference machine, after checking that
+# the differences are intended.
+#
+# IMAGE_TOLERANCE is how far (out of 255) a channel may be off, and
+# IMAGE_MAX_BAD the fraction of pixels that may be off by more, to allow for
+# rasterisation differences between driver versions. PERF_THRESHOLD is the
+# fraction that frame time or throughput may regress by.
+#
+# A scene without a golden image or a baseline fails. Baselines only mean
+# something on the machine that recorded them, so elsewhere set SKIP_PERF=1
+# to leave the benchmarks out and check the images alone.
+
+set -u
+
+cd "$(dirname "$0")"
+
+APP=../app
+COMPARE=./compare
+OUT=out
+WIDTH=320
+HEIGHT=240
+FRAMES=200
+WARMUP=20
+
+export TRIANGLE_DEVICE="${TRIANGLE_DEVICE:-llvmpipe}"
+UPDATE="${UPDATE:-0}"
+IMAGE_TOLERANCE="${IMAGE_TOLERANCE:-2}"
+IMAGE_MAX_BAD="${IMAGE_MAX_BAD:-0.001}"
+PERF_THRESHOLD="${PERF_THRESHOLD:-0.15}"
+SKIP_PERF="${SKIP_PERF:-0}"
+
+rm -rf "$OUT"
+mkdir -p "$OUT" golden baselines
+
+failures=0
+fail() {
+  echo "FAILED: $*"
+  failures=$((failures + 1))
+}
+
+# Before trusting the comparisons, make sure they can fail: an image with a
+# pixel changed, and a benchmark twice as slow, must both be caught.
+ppm() {
+  printf 'P6\n2 2\n255\n'
+  printf "$1"
+}
+benchmark() {
+  printf '{ "frame_time_ms": { "p50": %s }, "triangles_per_second": %s }\n' "$1" "$2"
+}
+mkdir -p "$OUT/self-test"
+ppm '\0\0\0\0\0\0\0\0\0\0\0\0' > "$OUT/self-test/golden.ppm"
+ppm '\0\0\0\0\0\0\0\0\0\377\0\0' > "$OUT/self-test/changed.ppm"
+benchmark 2 1000000 > "$OUT/self-test/baseline.json"
+benchmark 4 500000 > "$OUT/self-test/slower.json"
+if ! $COMPARE image "$OUT/self-test/golden.ppm" "$OUT/self-test/golden.ppm" \
+       "$IMAGE_TOLERANCE" "$IMAGE_MAX_BAD" > /dev/null ||
+   $COMPARE image "$OUT/self-test/changed.ppm" "$OUT/self-test/golden.ppm" \
+       "$IMAGE_TOLERANCE" "$IMAGE_MAX_BAD" > /dev/null ||
+   ! $COMPARE perf "$OUT/self-test/baseline.json" "$OUT/self-test/baseline.json" \
+       "$PERF_THRESHOLD" > /dev/null ||
+   $COMPARE perf "$OUT/self-test/slower.json" "$OUT/self-test/baseline.json" \
+       "$PERF_THRESHOLD" > /dev/null; then
+  echo "FAILED: compare doesn't catch a changed image or a slower benchmark"
+  exit 1
+fi
+
+while read -r name args; do
+  case "$name" in
+    ''|'#'*) continue ;;
+  esac
+
+  echo "== $name"
+  mkdir -p "$OUT/$name"
+
+  # The first frame is enough: the scenes don't change from frame to frame.
+  # The pipeline cache is left out so that every run starts cold.
+  if ! $APP --headless --width $WIDTH --height $HEIGHT --frames 1 \
+       --pipeline-cache '' --capture "$OUT/$name" $args < /dev/null > "$OUT/$name/render.log" 2>&1; then
+    fail "$name: rendering failed; see $OUT/$name/render.log"
+    continue
+  fi
+
+  if [ "$SKIP_PERF" != 1 ] &&
+     ! $APP --headless --width $WIDTH --height $HEIGHT --benchmark \
+       --warmup $WARMUP --frames $FRAMES --pipeline-cache '' \
+       --output "$OUT/$name/benchmark.json" $args < /dev/null > "$OUT/$name/benchmark.log" 2>&1; then
+    fail "$name: benchmark failed; see $OUT/$name/benchmark.log"
+    continue
+  fi
+
+  image="$OUT/$name/frame-000000.ppm"
+  if [ "$UPDATE" = 1 ]; then
+    cp "$image" "golden/$name.ppm"
+    echo "updated golden/$name.ppm"
+    if [ "$SKIP_PERF" != 1 ]; then
+      cp "$OUT/$name/benchmark.json" "baselines/$name.json"
+      echo "updated baselines/$name.json"
+    fi
+    continue
+  fi
+
+  if [ ! -f "golden/$name.ppm" ]; then
+    fail "$name: no golden image; record it with make update-goldens"
+  else
+    $COMPARE image "$image" "golden/$name.ppm" "$IMAGE_TOLERANCE" "$IMAGE_MAX_BAD" ||
+      failures=$((failures + 1))
+  fi
+
+  if [ "$SKIP_PERF" = 1 ]; then
+    echo "SKIPPED: $name: performance, as SKIP_PERF=1"
+  elif [ ! -f "baselines/$name.json" ]; then
+    fail "$name: no performance baseline; record one with make update-goldens, or set SKIP_PERF=1"
+  else
+    $COMPARE perf "$OUT/$name/benchmark.json" "baselines/$name.json" "$PERF_THRESHOLD" ||
+      failures=$((failures + 1))
+  fi
+done < scenes
+
+if [ "$failures" -gt 0 ]; then
+  echo "$failures failure(s)"
+  exit 1
+fi
+echo "all passed"